@@ -0,0 +1,624 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "backup.h"
+#include "database.h"
+#include "generate_migration.h"
+#include "harness.h"
+#include "migrate.h"
+#include "progress.h"
+
+/*
+ * Benchmarks of exodus' costliest operations, on synthetic fixtures.
+ *
+ * Fixtures are a 10 GB database, a 100M rows table with 50 indexes and
+ * triggers, a schema of 5,000 objects and 2,000 tiny migrations. Data sizes
+ * are scaled down linearly with `--scale`, objects and migrations counts
+ * are not, since they are cheap to generate. Fixtures are generated once
+ * per scale, and kept in the work directory.
+ *
+ * Results are written one per line as `<benchmark>\t<seconds>\t<detail>`,
+ * always in the same order, so that runs can be compared with diff.
+ */
+
+#define FULL_DATABASE_BYTES (10LL * 1024 * 1024 * 1024)
+#define FULL_WIDE_ROWS 100000000LL
+#define FULL_SCHEMA_OBJECTS 5000LL
+#define FULL_MIGRATIONS 2000LL
+#define WIDE_INDEXES 50
+#define BLOB_BYTES 4000
+
+typedef struct {
+	char name[MAX_NAME_LEN];
+	double seconds;
+	char detail[MAX_NAME_LEN];
+} bench_result_t;
+
+typedef struct {
+	double scale;
+	char directory[MAX_PATH_LEN - 64];
+	char output[MAX_PATH_LEN];
+	bench_result_t results[8];
+	size_t results_len;
+} bench_t;
+
+static long long
+scaled (const bench_t bench[static 1], long long full)
+{
+	long long value = (long long) ((double) full * bench->scale);
+	return value > 0 ? value : 1;
+}
+
+static void
+fixture_path (char path[MAX_PATH_LEN], const bench_t bench[static 1], const char *name, const char *extension)
+{
+	snprintf (path, MAX_PATH_LEN, "%s/%s-%g%s", bench->directory, name, bench->scale, extension);
+}
+
+static void
+add_result (bench_t bench[static 1], const char *name, double seconds, const char *detail)
+{
+	bench_result_t *result = &bench->results[bench->results_len++];
+	snprintf (result->name, MAX_NAME_LEN, "%s", name);
+	snprintf (result->detail, MAX_NAME_LEN, "%s", detail);
+	result->seconds = seconds;
+
+	fprintf (stderr, "%s: %.3fs (%s)\n", name, seconds, detail);
+}
+
+static int
+exec_fixture_sql (sqlite3 *conn, char *sql)
+{
+	int err = 0;
+
+	if (!sql)
+		{
+			err = 1;
+			fprintf (stderr, "bench.c: exec_fixture_sql(): out of memory.\n");
+			goto teardown;
+		}
+
+	err = db_exec_on (conn, sql);
+
+	teardown:
+	if (sql) sqlite3_free (sql);
+	return err;
+}
+
+static int
+open_fixture (sqlite3 *conn[static 1], const char path[MAX_PATH_LEN])
+{
+	char building_path[MAX_PATH_LEN + 10] = {0};
+	snprintf (building_path, sizeof (building_path), "%s.building", path);
+	unlink (building_path);
+
+	if (sqlite3_open (building_path, conn) != SQLITE_OK)
+		{
+			fprintf (stderr, "bench.c: open_fixture(): can't open fixture: %s\n", building_path);
+			return 1;
+		}
+
+	return db_exec_on (*conn, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF; BEGIN");
+}
+
+/*
+ * Fixtures are built under a temporary name, so that an interrupted
+ * generation is not mistaken for a fixture.
+ */
+static int
+close_fixture (sqlite3 *conn, const char path[MAX_PATH_LEN], int err)
+{
+	char building_path[MAX_PATH_LEN + 10] = {0};
+	snprintf (building_path, sizeof (building_path), "%s.building", path);
+
+	if (!err)
+		err = db_exec_on (conn, "COMMIT");
+
+	sqlite3_close (conn);
+
+	if (!err)
+		err = rename (building_path, path);
+
+	if (err)
+		{
+			fprintf (stderr, "bench.c: close_fixture(): can't generate fixture: %s\n", path);
+			unlink (building_path);
+		}
+
+	return err;
+}
+
+static int
+generate_large_database (const bench_t bench[static 1], const char path[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	long long rows = scaled (bench, FULL_DATABASE_BYTES) / BLOB_BYTES + 1;
+
+	fprintf (stderr, "Generating %s (%lld rows)…\n", path, rows);
+
+	err = open_fixture (&conn, path);
+	if (err)
+		goto teardown;
+
+	err = exec_fixture_sql (conn, sqlite3_mprintf ("CREATE TABLE blobs(id INTEGER PRIMARY KEY, data BLOB);"
+				"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %lld) "
+				"INSERT INTO blobs SELECT x, randomblob(%d) FROM c", rows, BLOB_BYTES));
+
+	teardown:
+	return close_fixture (conn, path, err);
+}
+
+static int
+generate_wide_table (const bench_t bench[static 1], const char path[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	char columns[BUFSIZ] = {0};
+	char values[BUFSIZ] = {0};
+	size_t columns_len = 0;
+	size_t values_len = 0;
+	long long rows = scaled (bench, FULL_WIDE_ROWS);
+
+	fprintf (stderr, "Generating %s (%lld rows)…\n", path, rows);
+
+	for (int i = 0; i < WIDE_INDEXES; i++)
+		{
+			columns_len += snprintf (columns + columns_len, sizeof (columns) - columns_len, ", c%d INTEGER", i);
+			values_len += snprintf (values + values_len, sizeof (values) - values_len, ", (x * %d) %% 100003", i + 1);
+		}
+
+	err = open_fixture (&conn, path);
+	if (err)
+		goto teardown;
+
+	err = exec_fixture_sql (conn, sqlite3_mprintf ("CREATE TABLE wide(id INTEGER PRIMARY KEY%s);"
+				"CREATE TABLE wide_audit(id INTEGER PRIMARY KEY, wide_id INTEGER, operation TEXT);"
+				"WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < %lld) "
+				"INSERT INTO wide SELECT x%s FROM c", columns, rows, values));
+	if (err)
+		goto teardown;
+
+	for (int i = 0; i < WIDE_INDEXES && !err; i++)
+		err = exec_fixture_sql (conn, sqlite3_mprintf ("CREATE INDEX wide_c%d ON wide(c%d)", i, i));
+
+	const char *operations[] = { "INSERT", "UPDATE", "DELETE" };
+	for (size_t i = 0; i < sizeof (operations) / sizeof (operations[0]) && !err; i++)
+		err = exec_fixture_sql (conn, sqlite3_mprintf ("CREATE TRIGGER wide_audit_%s AFTER %s ON wide BEGIN "
+					"INSERT INTO wide_audit(wide_id, operation) VALUES (%s.id, '%s'); END",
+					operations[i], operations[i], i == 2 ? "old" : "new", operations[i]));
+
+	teardown:
+	return close_fixture (conn, path, err);
+}
+
+/*
+ * A table, an index, a view and a trigger per group of four objects.
+ */
+static int
+generate_large_schema (const bench_t bench[static 1], const char path[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	long long groups = FULL_SCHEMA_OBJECTS / 4;
+
+	// Not scaled.
+	(void) bench;
+
+	fprintf (stderr, "Generating %s (%lld objects)…\n", path, groups * 4);
+
+	err = open_fixture (&conn, path);
+	if (err)
+		goto teardown;
+
+	for (long long i = 0; i < groups && !err; i++)
+		err = exec_fixture_sql (conn, sqlite3_mprintf ("CREATE TABLE object_%lld(id INTEGER PRIMARY KEY, name TEXT);"
+					"CREATE INDEX object_%lld_name ON object_%lld(name);"
+					"CREATE VIEW object_%lld_view AS SELECT id, upper(name) FROM object_%lld;"
+					"CREATE TRIGGER object_%lld_trigger AFTER INSERT ON object_%lld BEGIN "
+					"UPDATE object_%lld SET name = lower(new.name) WHERE id = new.id; END",
+					i, i, i, i, i, i, i, i));
+
+	teardown:
+	return close_fixture (conn, path, err);
+}
+
+static int
+write_migration (const char directory[MAX_PATH_LEN], const char *name, const char *sql)
+{
+	char path[MAX_PATH_LEN + MAX_NAME_LEN] = {0};
+	snprintf (path, sizeof (path), "%s/%s", directory, name);
+
+	FILE *file = fopen (path, "w");
+	if (!file)
+		{
+			fprintf (stderr, "bench.c: write_migration(): can't create migration: %s\n", path);
+			return 1;
+		}
+
+	fputs (sql, file);
+	return fclose (file) != 0;
+}
+
+static int
+generate_tiny_migrations (const bench_t bench[static 1], const char directory[MAX_PATH_LEN])
+{
+	int err = 0;
+	long long count = FULL_MIGRATIONS;
+
+	// Not scaled.
+	(void) bench;
+
+	fprintf (stderr, "Generating %s (%lld migrations)…\n", directory, count);
+
+	if (mkdir (directory, 0755) != 0 && errno != EEXIST)
+		{
+			fprintf (stderr, "bench.c: generate_tiny_migrations(): can't create directory: %s\n", directory);
+			return 1;
+		}
+
+	for (long long i = 0; i < count && !err; i++)
+		{
+			char name[MAX_NAME_LEN] = {0};
+			char sql[BUFSIZ] = {0};
+
+			snprintf (name, MAX_NAME_LEN, "%08lld-tiny.sql", i);
+			snprintf (sql, BUFSIZ, "CREATE TABLE tiny_%lld(id INTEGER PRIMARY KEY);\nINSERT INTO tiny_%lld VALUES (1);\n", i, i);
+			err = write_migration (directory, name, sql);
+		}
+
+	return err;
+}
+
+static int
+ensure_fixture (const bench_t bench[static 1], const char path[MAX_PATH_LEN], int (*generate) (const bench_t bench[static 1], const char path[MAX_PATH_LEN]))
+{
+	if (file_exists (path))
+		return 0;
+
+	return generate (bench, path);
+}
+
+static void
+remove_database (const char path[MAX_PATH_LEN])
+{
+	char other_path[MAX_PATH_LEN + 16] = {0};
+	const char *suffixes[] = { "", "-journal", "-wal", "-shm", ".prev", ".failed", ".sql" };
+
+	for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+		{
+			snprintf (other_path, sizeof (other_path), "%s%s", path, suffixes[i]);
+			unlink (other_path);
+		}
+}
+
+static void
+remove_directory (const char path[MAX_PATH_LEN])
+{
+	DIR *dir = opendir (path);
+	if (!dir)
+		return;
+
+	struct dirent *entry = NULL;
+	while ((entry = readdir (dir)))
+		{
+			char entry_path[MAX_PATH_LEN + MAX_NAME_LEN] = {0};
+			snprintf (entry_path, sizeof (entry_path), "%s/%s", path, entry->d_name);
+			if (entry->d_name[0] != '.')
+				unlink (entry_path);
+		}
+
+	closedir (dir);
+	rmdir (path);
+}
+
+static void
+prepare_options (options_t options[static 1], const char database[MAX_PATH_LEN], const char migrations[MAX_PATH_LEN])
+{
+	memset (options, 0, sizeof (options_t));
+	snprintf (options->database, MAX_PATH_LEN, "%s", database);
+	snprintf (options->migrations, MAX_PATH_LEN, "%s", migrations);
+	snprintf (options->structure, MAX_PATH_LEN, "%s.sql", database);
+}
+
+static int
+bench_backup (bench_t bench[static 1], const char large[MAX_PATH_LEN])
+{
+	int err = 0;
+	char copy[MAX_PATH_LEN] = {0};
+	struct timespec start = {0};
+
+	snprintf (copy, MAX_PATH_LEN, "%s/backup.db", bench->directory);
+	remove_database (copy);
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	err = backup_db (large, copy);
+	double seconds = elapsed_since (&start);
+
+	remove_database (copy);
+	if (!err)
+		add_result (bench, "backup_db", seconds, "large database");
+
+	return err;
+}
+
+static int
+bench_compressed_backup (bench_t bench[static 1], const char large[MAX_PATH_LEN])
+{
+	int err = 0;
+	char copy[MAX_PATH_LEN] = {0};
+	char compress[MAX_PATH_LEN] = BUILTIN_COMPRESSOR;
+	char detail[MAX_NAME_LEN] = {0};
+	backup_stats_t stats = {0};
+
+	snprintf (copy, MAX_PATH_LEN, "%s/backup.db.lz", bench->directory);
+	unlink (copy);
+
+	err = stream_backup_db (large, copy, compress, &stats);
+
+	unlink (copy);
+	if (err)
+		return err;
+
+	snprintf (detail, MAX_NAME_LEN, "large database, ratio %.2f, %.1f MB/s", stats.stored_bytes > 0 ? (double) stats.bytes / (double) stats.stored_bytes : 0, stats.seconds > 0 ? (double) stats.bytes / stats.seconds / (1024 * 1024) : 0);
+	add_result (bench, "stream_backup_db_builtin", stats.seconds, detail);
+
+	return err;
+}
+
+static int
+bench_migrate (bench_t bench[static 1], const char schema[MAX_PATH_LEN], const char migrations[MAX_PATH_LEN])
+{
+	int err = 0;
+	char database[MAX_PATH_LEN] = {0};
+	options_t options = {0};
+	struct timespec start = {0};
+
+	snprintf (database, MAX_PATH_LEN, "%s/migrate.db", bench->directory);
+	remove_database (database);
+
+	err = backup_db (schema, database);
+	if (err)
+		goto teardown;
+
+	prepare_options (&options, database, migrations);
+
+	int saved = silence_stdout ();
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	err = migrate (&options);
+	double seconds = elapsed_since (&start);
+	close_db ();
+	restore_stdout (saved);
+
+	if (!err)
+		add_result (bench, "migrate", seconds, "tiny migrations on large schema");
+
+	teardown:
+	remove_database (database);
+	return err;
+}
+
+/*
+ * The last migration fails at runtime (not in preflight, which has no
+ * data), so this measures a backup, the migrations, and the restoration.
+ */
+static int
+bench_restore (bench_t bench[static 1], const char large[MAX_PATH_LEN])
+{
+	int err = 0;
+	char database[MAX_PATH_LEN] = {0};
+	char migrations[MAX_PATH_LEN] = {0};
+	options_t options = {0};
+	struct timespec start = {0};
+
+	snprintf (database, MAX_PATH_LEN, "%s/restore.db", bench->directory);
+	snprintf (migrations, MAX_PATH_LEN, "%s/restore-migrations", bench->directory);
+	remove_database (database);
+
+	if (mkdir (migrations, 0755) != 0 && errno != EEXIST)
+		{
+			err = 1;
+			fprintf (stderr, "bench.c: bench_restore(): can't create directory: %s\n", migrations);
+			goto teardown;
+		}
+
+	err = write_migration (migrations, "1-update.sql", "UPDATE blobs SET data = zeroblob(16) WHERE id % 100 = 0;\n");
+	err = err || write_migration (migrations, "2-fail.sql", "INSERT INTO blobs(id) VALUES (1);\n");
+	err = err || backup_db (large, database);
+	if (err)
+		goto teardown;
+
+	prepare_options (&options, database, migrations);
+
+	int saved = silence_stdout ();
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	int migrate_err = migrate (&options);
+	double seconds = elapsed_since (&start);
+	close_db ();
+	restore_stdout (saved);
+
+	if (!migrate_err)
+		{
+			err = 1;
+			fprintf (stderr, "bench.c: bench_restore(): the failing migration succeeded.\n");
+			goto teardown;
+		}
+
+	add_result (bench, "migrate_restore_on_failure", seconds, "large database, backup included");
+
+	teardown:
+	remove_database (database);
+	remove_directory (migrations);
+	return err;
+}
+
+static int
+bench_recreate (bench_t bench[static 1], const char wide[MAX_PATH_LEN])
+{
+	int err = 0;
+	char migrations[MAX_PATH_LEN] = {0};
+	options_t options = {0};
+	struct timespec start = {0};
+
+	snprintf (migrations, MAX_PATH_LEN, "%s/recreate-migrations", bench->directory);
+
+	prepare_options (&options, wide, migrations);
+	snprintf (options.migration_name, MAX_NAME_LEN, "recreate_wide");
+	snprintf (options.recreate, MAX_NAME_LEN, "wide");
+
+	int saved = silence_stdout ();
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	err = generate_migration (&options);
+	double seconds = elapsed_since (&start);
+	close_db ();
+	restore_stdout (saved);
+
+	if (!err)
+		add_result (bench, "generate_recreate", seconds, "wide table with indexes and triggers");
+
+	remove_directory (migrations);
+	return err;
+}
+
+static int
+bench_dump_structure (bench_t bench[static 1], const char schema[MAX_PATH_LEN])
+{
+	int err = 0;
+	char structure[MAX_PATH_LEN] = {0};
+	char no_init[MAX_PATH_LEN] = {0};
+	struct timespec start = {0};
+
+	snprintf (structure, MAX_PATH_LEN, "%s/structure.sql", bench->directory);
+
+	err = open_db (schema, no_init);
+	if (err)
+		goto teardown;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	err = dump_structure (structure, "");
+	double seconds = elapsed_since (&start);
+
+	if (!err)
+		add_result (bench, "dump_structure", seconds, "large schema");
+
+	teardown:
+	close_db ();
+	unlink (structure);
+	return err;
+}
+
+static int
+write_results (const bench_t bench[static 1])
+{
+	FILE *file = fopen (bench->output, "w");
+	if (!file)
+		{
+			fprintf (stderr, "bench.c: write_results(): can't open output file: %s\n", bench->output);
+			return 1;
+		}
+
+	fprintf (file, "# exodus bench, scale %g\n", bench->scale);
+	for (size_t i = 0; i < bench->results_len; i++)
+		fprintf (file, "%s\t%.6f\t%s\n", bench->results[i].name, bench->results[i].seconds, bench->results[i].detail);
+
+	return fclose (file) != 0;
+}
+
+static int
+parse_options (int argc, char **argv, bench_t bench[static 1])
+{
+	bench->scale = 0.01;
+	snprintf (bench->directory, sizeof (bench->directory), "./build/bench");
+	snprintf (bench->output, MAX_PATH_LEN, "./build/bench.tsv");
+
+	for (int i = 1; i < argc; i++)
+		{
+			if (strncmp (argv[i], "--scale", 20) == 0 && i + 1 < argc)
+				bench->scale = strtod (argv[++i], NULL);
+			else if (strncmp (argv[i], "--directory", 20) == 0 && i + 1 < argc)
+				snprintf (bench->directory, sizeof (bench->directory), "%s", argv[++i]);
+			else if (strncmp (argv[i], "--output", 20) == 0 && i + 1 < argc)
+				snprintf (bench->output, MAX_PATH_LEN, "%s", argv[++i]);
+			else
+				{
+					fprintf (stderr, "%s [--scale <factor>] [--directory <fixtures directory>] [--output <results file>]\n", argv[0]);
+					return 1;
+				}
+		}
+
+	if (bench->scale <= 0)
+		{
+			fprintf (stderr, "Scale must be positive.\n");
+			return 1;
+		}
+
+	return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+	int err = 0;
+	bench_t bench = {0};
+	char large[MAX_PATH_LEN] = {0};
+	char wide[MAX_PATH_LEN] = {0};
+	char schema[MAX_PATH_LEN] = {0};
+	char migrations[MAX_PATH_LEN] = {0};
+
+	err = parse_options (argc, argv, &bench);
+	if (err)
+		goto teardown;
+
+	if (mkdir (bench.directory, 0755) != 0 && errno != EEXIST)
+		{
+			err = 1;
+			fprintf (stderr, "bench.c: main(): can't create directory: %s\n", bench.directory);
+			goto teardown;
+		}
+
+	fixture_path (large, &bench, "large", ".db");
+	fixture_path (wide, &bench, "wide", ".db");
+	fixture_path (schema, &bench, "schema", ".db");
+	fixture_path (migrations, &bench, "migrations", "");
+
+	err = ensure_fixture (&bench, large, generate_large_database);
+	err = err || ensure_fixture (&bench, wide, generate_wide_table);
+	err = err || ensure_fixture (&bench, schema, generate_large_schema);
+	err = err || ensure_fixture (&bench, migrations, generate_tiny_migrations);
+	if (err)
+		{
+			fprintf (stderr, "bench.c: main(): can't generate fixtures.\n");
+			goto teardown;
+		}
+
+	err = bench_backup (&bench, large);
+	err = err || bench_compressed_backup (&bench, large);
+	err = err || bench_migrate (&bench, schema, migrations);
+	err = err || bench_restore (&bench, large);
+	err = err || bench_recreate (&bench, wide);
+	err = err || bench_dump_structure (&bench, schema);
+	if (err)
+		{
+			fprintf (stderr, "bench.c: main(): benchmark failed.\n");
+			goto teardown;
+		}
+
+	err = write_results (&bench);
+	if (err)
+		{
+			fprintf (stderr, "bench.c: main(): can't write results.\n");
+			goto teardown;
+		}
+
+	fprintf (stderr, "Results written to %s\n", bench.output);
+
+	teardown:
+	return err;
+}
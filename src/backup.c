@@ -0,0 +1,1008 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "backup.h"
+#include "database.h"
+#include "estimate.h"
+#include "hash.h"
+#include "progress.h"
+
+/*
+ * Streamed backups.
+ *
+ * Instead of copying the database page by page through SQLite, the database
+ * file is read as is while a read transaction prevents other connections
+ * from writing it, and written through a sink: either the built-in
+ * compressor, or a compressor command (like `zstd -q`) reading the database
+ * on its standard input and writing the backup on its standard output.
+ * Backups are restored by streaming them back through the same sink, the
+ * command being then called with `-d`.
+ */
+
+#define BUILTIN_EXTENSION ".lz"
+#define COMMAND_EXTENSION ".z"
+
+/*
+ * The built-in compressor is a minimal LZ77, in the spirit of LZ4: it's
+ * meant to be fast enough not to slow down backups, while getting rid of
+ * the empty space and repetitions of database pages.
+ *
+ * A backup starts with `LZ_MAGIC`, followed by blocks of at most
+ * `BACKUP_CHUNK_SIZE` bytes, each prefixed with its size and its compressed
+ * size (equal if it's stored as is), as little endian 32 bits integers. An
+ * empty block ends the backup, followed by the hash of the database.
+ *
+ * A compressed block is a list of sequences: a token whose high and low
+ * nibbles are the number of literals and the match length (minus
+ * `LZ_MIN_MATCH`), the literals, then the offset of the match as a 16 bits
+ * little endian integer. Nibbles of 15 are followed by bytes added to them,
+ * until one isn't 255. The last sequence only has literals.
+ */
+#define LZ_MAGIC "EXODUSZ1"
+#define LZ_MAGIC_LEN 8
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 8
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+enum {
+	SINK_FILE,
+	SINK_BUILTIN,
+	SINK_COMMAND,
+};
+
+typedef struct {
+	int kind;
+	int file_fd;
+	int pipe_fd;
+	pid_t pid;
+	const char *command;
+	unsigned char *block;
+	uint64_t hash;
+} backup_sink_t;
+
+static uint32_t
+read_u32 (const unsigned char *bytes)
+{
+	return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+static void
+write_u32 (unsigned char *bytes, uint32_t value)
+{
+	bytes[0] = value & 0xff;
+	bytes[1] = (value >> 8) & 0xff;
+	bytes[2] = (value >> 16) & 0xff;
+	bytes[3] = (value >> 24) & 0xff;
+}
+
+static unsigned char *
+lz_write_length (unsigned char *out, size_t len)
+{
+	while (len >= 255)
+		{
+			*out++ = 255;
+			len -= 255;
+		}
+
+	*out++ = (unsigned char) len;
+	return out;
+}
+
+/*
+ * Writes a sequence, or only literals if `match_len` is 0.
+ */
+static unsigned char *
+lz_write_sequence (unsigned char *out, const unsigned char *literals, size_t literals_len, size_t offset, size_t match_len)
+{
+	unsigned char *token = out++;
+	*token = (unsigned char) ((literals_len < 15 ? literals_len : 15) << 4);
+	if (literals_len >= 15)
+		out = lz_write_length (out, literals_len - 15);
+
+	memcpy (out, literals, literals_len);
+	out += literals_len;
+
+	if (match_len == 0)
+		return out;
+
+	*out++ = offset & 0xff;
+	*out++ = (offset >> 8) & 0xff;
+
+	size_t extra = match_len - LZ_MIN_MATCH;
+	*token |= (unsigned char) (extra < 15 ? extra : 15);
+	if (extra >= 15)
+		out = lz_write_length (out, extra - 15);
+
+	return out;
+}
+
+/*
+ * Compresses `in` into `out`, which must hold `LZ_BOUND(len)` bytes, and
+ * returns the compressed size.
+ */
+static size_t
+lz_compress (const unsigned char *in, size_t len, unsigned char *out)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = {0};
+	unsigned char *end = out;
+	size_t anchor = 0;
+	size_t pos = 0;
+
+	if (len > LZ_LAST_LITERALS + LZ_MIN_MATCH)
+		{
+			// Matches stop before the last literals, which keeps reads within the block.
+			size_t limit = len - LZ_LAST_LITERALS;
+
+			while (pos < limit)
+				{
+					uint32_t sequence = read_u32 (in + pos);
+					uint32_t slot = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+					size_t candidate = table[slot];
+					table[slot] = (uint32_t) pos;
+
+					if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || read_u32 (in + candidate) != sequence)
+						{
+							// Goes faster through data which doesn't compress, like random blobs.
+							pos += 1 + ((pos - anchor) >> 6);
+							continue;
+						}
+
+					size_t match_len = LZ_MIN_MATCH;
+					while (pos + match_len < limit && in[candidate + match_len] == in[pos + match_len])
+						match_len++;
+
+					end = lz_write_sequence (end, in + anchor, pos - anchor, pos - candidate, match_len);
+					pos += match_len;
+					anchor = pos;
+				}
+		}
+
+	end = lz_write_sequence (end, in + anchor, len - anchor, 0, 0);
+	return (size_t) (end - out);
+}
+
+static int
+lz_read_length (const unsigned char **in, const unsigned char *end, size_t len[static 1])
+{
+	unsigned char byte = 0;
+
+	do
+		{
+			if (*in >= end)
+				return 1;
+
+			byte = *(*in)++;
+			*len += byte;
+		}
+	while (byte == 255);
+
+	return 0;
+}
+
+/*
+ * Decompresses a block, which must decompress to exactly `out_len` bytes.
+ * Corrupted blocks are reported as errors, never read or written out of
+ * bounds.
+ */
+static int
+lz_decompress (const unsigned char *in, size_t len, unsigned char *out, size_t out_len)
+{
+	const unsigned char *end = in + len;
+	unsigned char *current = out;
+	unsigned char *out_end = out + out_len;
+
+	while (in < end)
+		{
+			unsigned char token = *in++;
+
+			size_t literals_len = token >> 4;
+			if (literals_len == 15 && lz_read_length (&in, end, &literals_len))
+				return 1;
+
+			if ((size_t) (end - in) < literals_len || (size_t) (out_end - current) < literals_len)
+				return 1;
+
+			memcpy (current, in, literals_len);
+			current += literals_len;
+			in += literals_len;
+
+			if (in == end)
+				break;
+
+			if (end - in < 2)
+				return 1;
+
+			size_t offset = (size_t) in[0] | (size_t) in[1] << 8;
+			in += 2;
+
+			size_t match_len = token & 15;
+			if (match_len == 15 && lz_read_length (&in, end, &match_len))
+				return 1;
+			match_len += LZ_MIN_MATCH;
+
+			if (offset == 0 || offset > (size_t) (current - out) || (size_t) (out_end - current) < match_len)
+				return 1;
+
+			// Matches can overlap what they produce, so they're copied byte by byte.
+			const unsigned char *match = current - offset;
+			for (size_t i = 0; i < match_len; i++)
+				current[i] = match[i];
+			current += match_len;
+		}
+
+	return current == out_end ? 0 : 1;
+}
+
+static int
+write_all (int fd, const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+
+	while (len > 0)
+		{
+			ssize_t written = write (fd, bytes, len);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return 1;
+
+			bytes += written;
+			len -= (size_t) written;
+		}
+
+	return 0;
+}
+
+/*
+ * Reads up to `len` bytes, only returning less at the end of the file, or
+ * -1 on error.
+ */
+static ssize_t
+read_all (int fd, void *data, size_t len)
+{
+	unsigned char *bytes = data;
+	size_t total = 0;
+
+	while (total < len)
+		{
+			ssize_t got = read (fd, bytes + total, len - total);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got < 0)
+				return -1;
+			if (got == 0)
+				break;
+
+			total += (size_t) got;
+		}
+
+	return (ssize_t) total;
+}
+
+static int
+fsync_directory (const char path[MAX_PATH_LEN])
+{
+	char directory[MAX_PATH_LEN] = {0};
+	snprintf (directory, MAX_PATH_LEN, "%s", path);
+
+	int fd = open (dirname (directory), O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	int err = fsync (fd) != 0;
+	close (fd);
+	return err;
+}
+
+/*
+ * Runs `command` through the shell, with the given standard input and
+ * output.
+ */
+static int
+spawn_command (pid_t pid[static 1], const char command[static 1], int input_fd, int output_fd)
+{
+	*pid = fork ();
+	if (*pid < 0)
+		return 1;
+
+	if (*pid == 0)
+		{
+			if (dup2 (input_fd, STDIN_FILENO) < 0 || dup2 (output_fd, STDOUT_FILENO) < 0)
+				_exit (127);
+
+			execl ("/bin/sh", "sh", "-c", command, (char *) NULL);
+			_exit (127);
+		}
+
+	return 0;
+}
+
+static int
+wait_command (pid_t pid, const char command[static 1])
+{
+	int status = 0;
+
+	while (waitpid (pid, &status, 0) < 0)
+		{
+			if (errno != EINTR)
+				{
+					fprintf (stderr, "backup.c: wait_command(): can't wait for command: %s\n", command);
+					return 1;
+				}
+		}
+
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		{
+			fprintf (stderr, "backup.c: wait_command(): command failed: %s\n", command);
+			return 1;
+		}
+
+	return 0;
+}
+
+static int
+open_sink (backup_sink_t sink[static 1], const char path[MAX_PATH_LEN], const char compress[MAX_PATH_LEN])
+{
+	int err = 0;
+	int pipe_fds[2] = { -1, -1 };
+
+	sink->kind = compress[0] == 0 ? SINK_FILE : strncmp (compress, BUILTIN_COMPRESSOR, MAX_PATH_LEN) == 0 ? SINK_BUILTIN : SINK_COMMAND;
+	sink->hash = HASH_SEED;
+
+	sink->file_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (sink->file_fd < 0)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: open_sink(): can't open backup file: %s\n", path);
+			goto teardown;
+		}
+
+	if (sink->kind == SINK_BUILTIN)
+		{
+			sink->block = malloc (8 + LZ_BOUND (BACKUP_CHUNK_SIZE));
+			if (!sink->block)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: open_sink(): out of memory.\n");
+					goto teardown;
+				}
+
+			err = write_all (sink->file_fd, LZ_MAGIC, LZ_MAGIC_LEN);
+			if (err)
+				{
+					fprintf (stderr, "backup.c: open_sink(): can't write backup file: %s\n", path);
+					goto teardown;
+				}
+		}
+
+	if (sink->kind == SINK_COMMAND)
+		{
+			if (pipe (pipe_fds) != 0)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: open_sink(): can't create pipe.\n");
+					goto teardown;
+				}
+
+			fcntl (pipe_fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl (pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+			err = spawn_command (&sink->pid, compress, pipe_fds[0], sink->file_fd);
+			if (err)
+				{
+					fprintf (stderr, "backup.c: open_sink(): can't start compressor: %s\n", compress);
+					goto teardown;
+				}
+
+			sink->command = compress;
+			sink->pipe_fd = pipe_fds[1];
+			pipe_fds[1] = -1;
+		}
+
+	teardown:
+	if (pipe_fds[0] >= 0) close (pipe_fds[0]);
+	if (pipe_fds[1] >= 0) close (pipe_fds[1]);
+	return err;
+}
+
+/*
+ * Writes a chunk of at most `BACKUP_CHUNK_SIZE` bytes of the database.
+ */
+static int
+write_sink (backup_sink_t sink[static 1], const unsigned char *data, size_t len)
+{
+	sink->hash = hash_bytes (sink->hash, data, len);
+
+	if (sink->kind == SINK_FILE)
+		return write_all (sink->file_fd, data, len);
+
+	if (sink->kind == SINK_COMMAND)
+		return write_all (sink->pipe_fd, data, len);
+
+	size_t packed_len = lz_compress (data, len, sink->block + 8);
+	if (packed_len >= len)
+		{
+			packed_len = len;
+			memcpy (sink->block + 8, data, len);
+		}
+
+	write_u32 (sink->block, (uint32_t) len);
+	write_u32 (sink->block + 4, (uint32_t) packed_len);
+	return write_all (sink->file_fd, sink->block, 8 + packed_len);
+}
+
+/*
+ * Ends the backup, waiting for the compressor to exit, and syncs it to
+ * disk. The sink is closed even on errors.
+ */
+static int
+close_sink (backup_sink_t sink[static 1])
+{
+	int err = 0;
+
+	if (sink->kind == SINK_BUILTIN && sink->file_fd >= 0 && sink->block)
+		{
+			unsigned char trailer[16] = {0};
+			for (int i = 0; i < 8; i++)
+				trailer[8 + i] = (sink->hash >> (8 * i)) & 0xff;
+
+			err = write_all (sink->file_fd, trailer, sizeof (trailer));
+		}
+
+	if (sink->pipe_fd >= 0)
+		{
+			close (sink->pipe_fd);
+			sink->pipe_fd = -1;
+		}
+
+	if (sink->pid > 0)
+		{
+			err = wait_command (sink->pid, sink->command) || err;
+			sink->pid = 0;
+		}
+
+	if (sink->file_fd >= 0)
+		{
+			err = fsync (sink->file_fd) != 0 || err;
+			err = close (sink->file_fd) != 0 || err;
+			sink->file_fd = -1;
+		}
+
+	if (sink->block) free (sink->block);
+	sink->block = NULL;
+
+	return err;
+}
+
+/*
+ * Blocks `SIGPIPE` in this thread, so that a compressor exiting early makes
+ * writes fail instead of killing us.
+ */
+static void
+block_sigpipe (sigset_t previous[static 1])
+{
+	sigset_t set;
+	sigemptyset (&set);
+	sigaddset (&set, SIGPIPE);
+	pthread_sigmask (SIG_BLOCK, &set, previous);
+}
+
+static void
+release_sigpipe (const sigset_t previous[static 1])
+{
+	sigset_t set;
+	struct timespec no_wait = {0};
+
+	sigemptyset (&set);
+	sigaddset (&set, SIGPIPE);
+
+	// Discards any SIGPIPE raised meanwhile, which would be delivered when unblocked.
+	if (!sigismember (previous, SIGPIPE))
+		while (sigtimedwait (&set, NULL, &no_wait) == SIGPIPE)
+			;
+
+	pthread_sigmask (SIG_SETMASK, previous, NULL);
+}
+
+static int
+build_backup_path (char path[MAX_PATH_LEN], const char database[MAX_PATH_LEN], const char suffix[static 1], const char extension[static 1], const char backup_dir[MAX_PATH_LEN])
+{
+	char name[MAX_PATH_LEN] = {0};
+	int written = 0;
+
+	snprintf (name, MAX_PATH_LEN, "%s", database);
+
+	if (backup_dir[0] != 0)
+		written = snprintf (path, MAX_PATH_LEN, "%s/%s%s%s", backup_dir, basename (name), suffix, extension);
+	else
+		written = snprintf (path, MAX_PATH_LEN, "%s%s%s", database, suffix, extension);
+
+	if (written >= MAX_PATH_LEN)
+		{
+			fprintf (stderr, "backup.c: build_backup_path(): truncated backup path: %s\n", path);
+			return 1;
+		}
+
+	return 0;
+}
+
+/*
+ * Builds the path of a backup of `database`, like `.prev` or `.failed`: in
+ * `--backup-dir` if given, or else next to the database, with an extension
+ * when it's compressed.
+ */
+int
+backup_file_path (char path[MAX_PATH_LEN], const char database[MAX_PATH_LEN], const char suffix[static 1], const options_t options[static 1])
+{
+	const char *extension = options->compress[0] == 0 ? "" : strncmp (options->compress, BUILTIN_COMPRESSOR, MAX_PATH_LEN) == 0 ? BUILTIN_EXTENSION : COMMAND_EXTENSION;
+	return build_backup_path (path, database, suffix, extension, options->backup_dir);
+}
+
+/*
+ * Streams a snapshot of the database at `src` through a sink (see
+ * `compress`) into `dest`, which is only replaced once the backup is
+ * complete.
+ *
+ * The database is read while holding a read transaction. In WAL mode, the
+ * WAL is checkpointed first, and must still be empty once the transaction
+ * started, since the database file alone is then the snapshot.
+ */
+int
+stream_backup_db (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN], const char compress[MAX_PATH_LEN], backup_stats_t stats[static 1])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	bool in_transaction = false;
+	bool sigpipe_blocked = false;
+	int src_fd = -1;
+	unsigned char *chunk = NULL;
+	backup_sink_t sink = { .file_fd = -1, .pipe_fd = -1 };
+	sigset_t previous_mask;
+	char tmp_path[MAX_PATH_LEN] = {0};
+	char wal_path[MAX_PATH_LEN] = {0};
+	char value[MAX_NAME_LEN] = {0};
+	struct stat st = {0};
+	struct timespec start = {0};
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	*stats = (backup_stats_t) {0};
+
+	int written = snprintf (tmp_path, MAX_PATH_LEN, "%s.tmp", dest);
+	written = written < MAX_PATH_LEN ? snprintf (wal_path, MAX_PATH_LEN, "%s-wal", src) : written;
+	if (written >= MAX_PATH_LEN)
+		{
+			tmp_path[0] = 0;
+			err = 1;
+			fprintf (stderr, "backup.c: stream_backup_db(): truncated path: %s\n", dest);
+			goto teardown;
+		}
+
+	// Not read only, since checkpointing writes to the database file.
+	int rc = sqlite3_open_v2 (src, &conn, SQLITE_OPEN_READWRITE, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: stream_backup_db(): can't open database %s\n", src);
+			goto teardown;
+		}
+	sqlite3_busy_timeout (conn, 5000);
+
+	err = query_pragma (conn, "PRAGMA journal_mode", value);
+	if (err)
+		goto teardown;
+
+	bool wal = strncmp (value, "wal", 4) == 0;
+	if (wal)
+		{
+			err = db_exec_on (conn, "PRAGMA wal_checkpoint(TRUNCATE)");
+			if (err)
+				{
+					fprintf (stderr, "backup.c: stream_backup_db(): can't checkpoint database.\n");
+					goto teardown;
+				}
+		}
+
+	err = db_exec_on (conn, "BEGIN; SELECT count(*) FROM sqlite_schema");
+	if (err)
+		{
+			fprintf (stderr, "backup.c: stream_backup_db(): can't lock database.\n");
+			goto teardown;
+		}
+
+	in_transaction = true;
+
+	if (wal && stat (wal_path, &st) == 0 && st.st_size > 0)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: stream_backup_db(): other connections are writing to %s, its WAL can't be checkpointed.\n", src);
+			goto teardown;
+		}
+
+	err = query_pragma (conn, "PRAGMA page_size", value);
+	sqlite3_int64 page_size = strtoll (value, NULL, 10);
+	err = err || query_pragma (conn, "PRAGMA page_count", value);
+	sqlite3_int64 page_count = strtoll (value, NULL, 10);
+	if (err)
+		goto teardown;
+
+	src_fd = open (src, O_RDONLY | O_CLOEXEC);
+	chunk = malloc (BACKUP_CHUNK_SIZE);
+	if (src_fd < 0 || !chunk)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: stream_backup_db(): can't read database %s\n", src);
+			goto teardown;
+		}
+
+	err = open_sink (&sink, tmp_path, compress);
+	if (err)
+		goto teardown;
+
+	block_sigpipe (&previous_mask);
+	sigpipe_blocked = true;
+
+	sqlite3_int64 total = page_size * page_count;
+	for (sqlite3_int64 offset = 0; offset < total; offset += BACKUP_CHUNK_SIZE)
+		{
+			size_t len = total - offset < BACKUP_CHUNK_SIZE ? (size_t) (total - offset) : BACKUP_CHUNK_SIZE;
+			if (pread (src_fd, chunk, len, (off_t) offset) != (ssize_t) len)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: stream_backup_db(): can't read database %s\n", src);
+					goto teardown;
+				}
+
+			err = write_sink (&sink, chunk, len);
+			if (err)
+				{
+					fprintf (stderr, "backup.c: stream_backup_db(): can't write backup %s\n", tmp_path);
+					goto teardown;
+				}
+		}
+
+	stats->bytes = total;
+	stats->hash = sink.hash;
+
+	err = close_sink (&sink);
+	if (err)
+		{
+			fprintf (stderr, "backup.c: stream_backup_db(): can't finish backup %s\n", tmp_path);
+			goto teardown;
+		}
+
+	if (rename (tmp_path, dest) != 0 || fsync_directory (dest) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: stream_backup_db(): can't move backup to %s\n", dest);
+			goto teardown;
+		}
+
+	if (stat (dest, &st) == 0)
+		stats->stored_bytes = (sqlite3_int64) st.st_size;
+
+	stats->seconds = elapsed_since (&start);
+
+	teardown:
+	if (err && sink.file_fd >= 0) close_sink (&sink);
+	if (err && tmp_path[0] != 0) unlink (tmp_path);
+	if (sigpipe_blocked) release_sigpipe (&previous_mask);
+	if (src_fd >= 0) close (src_fd);
+	if (chunk) free (chunk);
+	if (in_transaction) db_exec_on (conn, "COMMIT");
+	if (conn) sqlite3_close (conn);
+	return err;
+}
+
+static int
+write_decoded (int out_fd, backup_stats_t decoded[static 1], const unsigned char *data, size_t len)
+{
+	decoded->hash = hash_bytes (decoded->hash, data, len);
+	decoded->bytes += (sqlite3_int64) len;
+
+	if (out_fd >= 0)
+		return write_all (out_fd, data, len);
+
+	return 0;
+}
+
+static int
+decode_builtin (int in_fd, int out_fd, backup_stats_t decoded[static 1])
+{
+	int err = 0;
+	unsigned char header[8] = {0};
+	unsigned char *packed = malloc (LZ_BOUND (BACKUP_CHUNK_SIZE));
+	unsigned char *block = malloc (BACKUP_CHUNK_SIZE);
+
+	if (!packed || !block)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: decode_builtin(): out of memory.\n");
+			goto teardown;
+		}
+
+	if (read_all (in_fd, header, LZ_MAGIC_LEN) != LZ_MAGIC_LEN || memcmp (header, LZ_MAGIC, LZ_MAGIC_LEN) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: decode_builtin(): not a backup made by the built-in compressor.\n");
+			goto teardown;
+		}
+
+	while (1)
+		{
+			if (read_all (in_fd, header, 8) != 8)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: decode_builtin(): backup is truncated.\n");
+					goto teardown;
+				}
+
+			uint32_t len = read_u32 (header);
+			uint32_t packed_len = read_u32 (header + 4);
+
+			if (len == 0 && packed_len == 0)
+				break;
+
+			if (len > BACKUP_CHUNK_SIZE || packed_len > len || read_all (in_fd, packed, packed_len) != (ssize_t) packed_len)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: decode_builtin(): backup is corrupted or truncated.\n");
+					goto teardown;
+				}
+
+			if (packed_len == len)
+				memcpy (block, packed, len);
+			else if (lz_decompress (packed, packed_len, block, len))
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: decode_builtin(): backup is corrupted.\n");
+					goto teardown;
+				}
+
+			err = write_decoded (out_fd, decoded, block, len);
+			if (err)
+				{
+					fprintf (stderr, "backup.c: decode_builtin(): can't write restored database.\n");
+					goto teardown;
+				}
+		}
+
+	uint64_t hash = 0;
+	if (read_all (in_fd, header, 8) != 8)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: decode_builtin(): backup is truncated.\n");
+			goto teardown;
+		}
+
+	for (int i = 0; i < 8; i++)
+		hash |= (uint64_t) header[i] << (8 * i);
+
+	if (hash != decoded->hash)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: decode_builtin(): backup is corrupted, its hash doesn't match.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (packed) free (packed);
+	if (block) free (block);
+	return err;
+}
+
+/*
+ * Reads `in_fd` to its end, as a plain copy or through the decompressor
+ * command.
+ */
+static int
+decode_stream (int in_fd, int out_fd, const char compress[MAX_PATH_LEN], backup_stats_t decoded[static 1])
+{
+	int err = 0;
+	int pipe_fds[2] = { -1, -1 };
+	int source_fd = in_fd;
+	pid_t pid = 0;
+	char command[MAX_PATH_LEN + 4] = {0};
+	unsigned char *chunk = malloc (BACKUP_CHUNK_SIZE);
+
+	if (!chunk)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: decode_stream(): out of memory.\n");
+			goto teardown;
+		}
+
+	if (compress[0] != 0)
+		{
+			snprintf (command, sizeof (command), "%s -d", compress);
+
+			if (pipe (pipe_fds) != 0)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: decode_stream(): can't create pipe.\n");
+					goto teardown;
+				}
+
+			fcntl (pipe_fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl (pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+			err = spawn_command (&pid, command, in_fd, pipe_fds[1]);
+			if (err)
+				{
+					fprintf (stderr, "backup.c: decode_stream(): can't start decompressor: %s\n", command);
+					goto teardown;
+				}
+
+			close (pipe_fds[1]);
+			pipe_fds[1] = -1;
+			source_fd = pipe_fds[0];
+		}
+
+	while (1)
+		{
+			ssize_t got = read_all (source_fd, chunk, BACKUP_CHUNK_SIZE);
+			if (got < 0)
+				{
+					err = 1;
+					fprintf (stderr, "backup.c: decode_stream(): can't read backup.\n");
+					goto teardown;
+				}
+
+			if (got == 0)
+				break;
+
+			err = write_decoded (out_fd, decoded, chunk, (size_t) got);
+			if (err)
+				{
+					fprintf (stderr, "backup.c: decode_stream(): can't write restored database.\n");
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (pipe_fds[0] >= 0) close (pipe_fds[0]);
+	if (pipe_fds[1] >= 0) close (pipe_fds[1]);
+	if (pid > 0) err = wait_command (pid, command) || err;
+	if (chunk) free (chunk);
+	return err;
+}
+
+/*
+ * Decodes the backup at `path` into `out_fd`, or only hashes it if
+ * `out_fd` is negative.
+ */
+static int
+decode_backup (const char path[MAX_PATH_LEN], const char compress[MAX_PATH_LEN], int out_fd, backup_stats_t decoded[static 1])
+{
+	int err = 0;
+
+	*decoded = (backup_stats_t) { .hash = HASH_SEED };
+
+	int in_fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0)
+		{
+			fprintf (stderr, "backup.c: decode_backup(): can't open backup: %s\n", path);
+			return 1;
+		}
+
+	if (strncmp (compress, BUILTIN_COMPRESSOR, MAX_PATH_LEN) == 0)
+		err = decode_builtin (in_fd, out_fd, decoded);
+	else
+		err = decode_stream (in_fd, out_fd, compress, decoded);
+
+	close (in_fd);
+	return err;
+}
+
+/*
+ * Checks the backup decodes back to the snapshot which was streamed.
+ */
+int
+verify_stream_backup (const char path[MAX_PATH_LEN], const char compress[MAX_PATH_LEN], const backup_stats_t stats[static 1])
+{
+	backup_stats_t decoded = {0};
+
+	int err = decode_backup (path, compress, -1, &decoded);
+	if (err)
+		{
+			fprintf (stderr, "backup.c: verify_stream_backup(): can't decode backup: %s\n", path);
+			return 1;
+		}
+
+	if (decoded.bytes != stats->bytes || decoded.hash != stats->hash)
+		{
+			fprintf (stderr, "backup.c: verify_stream_backup(): backup %s doesn't match the database (%lld bytes instead of %lld).\n", path, (long long) decoded.bytes, (long long) stats->bytes);
+			return 1;
+		}
+
+	return 0;
+}
+
+/*
+ * Restores a streamed backup over the database at `dest`.
+ *
+ * The backup is decoded as `.restoring` in `--backup-dir` if given, where
+ * `check_disk_space()` reserves room for it, then copied over the database
+ * through SQLite: replacing the file would leave other connections, even
+ * idle ones, with a handle on the old inode.
+ */
+int
+stream_restore_db (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN], const options_t options[static 1])
+{
+	int err = 0;
+	int out_fd = -1;
+	backup_stats_t decoded = {0};
+	char restoring_path[MAX_PATH_LEN] = {0};
+	struct stat st = {0};
+
+	err = build_backup_path (restoring_path, dest, ".restoring", "", options->backup_dir);
+	if (err)
+		{
+			restoring_path[0] = 0;
+			fprintf (stderr, "backup.c: stream_restore_db(): can't build path of decoded backup.\n");
+			goto teardown;
+		}
+
+	out_fd = open (restoring_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out_fd < 0)
+		{
+			err = 1;
+			fprintf (stderr, "backup.c: stream_restore_db(): can't open %s\n", restoring_path);
+			goto teardown;
+		}
+
+	if (stat (dest, &st) == 0)
+		fchmod (out_fd, st.st_mode & 07777);
+
+	err = decode_backup (src, options->compress, out_fd, &decoded);
+	if (err)
+		{
+			fprintf (stderr, "backup.c: stream_restore_db(): can't decode backup: %s\n", src);
+			goto teardown;
+		}
+
+	if (fsync (out_fd) != 0 || close (out_fd) != 0)
+		{
+			out_fd = -1;
+			err = 1;
+			fprintf (stderr, "backup.c: stream_restore_db(): can't write %s\n", restoring_path);
+			goto teardown;
+		}
+
+	out_fd = -1;
+
+	err = backup_db (restoring_path, dest);
+	if (err)
+		fprintf (stderr, "backup.c: stream_restore_db(): can't copy %s to %s\n", restoring_path, dest);
+
+	teardown:
+	if (out_fd >= 0) close (out_fd);
+	if (restoring_path[0] != 0) unlink (restoring_path);
+	return err;
+}
+
+void
+print_backup_stats (const backup_stats_t stats[static 1])
+{
+	char bytes[32] = {0};
+	char stored_bytes[32] = {0};
+	char throughput[32] = {0};
+
+	format_size (bytes, stats->bytes);
+	format_size (stored_bytes, stats->stored_bytes);
+	format_size (throughput, stats->seconds > 0 ? (sqlite3_int64) ((double) stats->bytes / stats->seconds) : 0);
+
+	printf ("Backup: %s stored in %s (ratio %.1f), %.3fs (%s/s).\n", bytes, stored_bytes, stats->stored_bytes > 0 ? (double) stats->bytes / (double) stats->stored_bytes : 0, stats->seconds, throughput);
+}
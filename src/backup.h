@@ -0,0 +1,24 @@
+#ifndef _BACKUP_H_
+#define _BACKUP_H_
+
+#include <sqlite3.h>
+#include <stdint.h>
+#include "main.h"
+
+#define BUILTIN_COMPRESSOR "builtin"
+#define BACKUP_CHUNK_SIZE (1 << 20)
+
+typedef struct {
+	sqlite3_int64 bytes;
+	sqlite3_int64 stored_bytes;
+	uint64_t hash;
+	double seconds;
+} backup_stats_t;
+
+int backup_file_path (char path[MAX_PATH_LEN], const char database[MAX_PATH_LEN], const char suffix[static 1], const options_t options[static 1]);
+int stream_backup_db (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN], const char compress[MAX_PATH_LEN], backup_stats_t stats[static 1]);
+int verify_stream_backup (const char path[MAX_PATH_LEN], const char compress[MAX_PATH_LEN], const backup_stats_t stats[static 1]);
+int stream_restore_db (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN], const options_t options[static 1]);
+void print_backup_stats (const backup_stats_t stats[static 1]);
+
+#endif
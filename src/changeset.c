@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "database.h"
+#include "changeset.h"
+
+#define BEFORE_SCHEMA "exodus_before"
+
+/*
+ * Starts recording the changes made through the main connection to every
+ * table. Only tables with a primary key are recorded, so the changeset is
+ * dropped when the migration writes an other one (see `finish_capture()`).
+ */
+int
+start_capture (sqlite3_session *session[static 1])
+{
+	int err = 0;
+
+	int rc = sqlite3session_create (db, "main", session);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: start_capture(): can't create session: %s\n", sqlite3_errstr (rc));
+			goto teardown;
+		}
+
+	rc = sqlite3session_attach (*session, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: start_capture(): can't attach tables to session: %s\n", sqlite3_errstr (rc));
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+static int
+has_primary_key (bool has[static 1], const char schema[static 1], const char table[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT count(*) FROM pragma_table_info(?, ?) WHERE pk > 0";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: has_primary_key(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, table, -1, NULL);
+	sqlite3_bind_text (stmt, 2, schema, -1, NULL);
+
+	rc = sqlite3_step (stmt);
+	if (rc != SQLITE_ROW)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: has_primary_key(): error while performing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	*has = sqlite3_column_int (stmt, 0) > 0;
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+static void
+warn_unrecorded (const char table[static 1])
+{
+	fprintf (stderr, "Warning: table %s has no primary key and was written, no changeset recorded.\n", table);
+}
+
+/*
+ * Stops recording, and retrieves the changeset.
+ *
+ * The session ignores tables without a primary key, so when the `manifest`
+ * lists one as written, the changeset would silently miss those writes: it's
+ * left empty instead, and rolling back will require a down migration.
+ *
+ * Caller must free `changeset` with `sqlite3_free()`.
+ */
+int
+finish_capture (sqlite3_session *session, const manifest_t *manifest, changeset_t changeset[static 1])
+{
+	int err = 0;
+
+	for (size_t i = 0; manifest && i < manifest->objects_len; i++)
+		{
+			const touched_object_t *object = &manifest->objects[i];
+			if (!object->written || object->dropped || strcmp (object->type, "table") != 0)
+				continue;
+
+			bool has = false;
+			err = has_primary_key (&has, "main", object->name);
+			if (err)
+				{
+					fprintf (stderr, "changeset.c: finish_capture(): can't read primary key of table %s.\n", object->name);
+					goto teardown;
+				}
+
+			if (!has)
+				{
+					warn_unrecorded (object->name);
+					goto teardown;
+				}
+		}
+
+	int rc = sqlite3session_changeset (session, &changeset->size, &changeset->data);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: finish_capture(): can't generate changeset: %s\n", sqlite3_errstr (rc));
+			goto teardown;
+		}
+
+	teardown:
+	sqlite3session_delete (session);
+	return err;
+}
+
+/*
+ * Tells if the rows of a table without primary key differ from the copy of
+ * the database made before the migration. Such tables are rowid tables, so
+ * comparing rowids and values finds every change.
+ */
+static int
+has_changed (bool changed[static 1], const char table[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	char *query = sqlite3_mprintf ("SELECT EXISTS (SELECT rowid, * FROM main.\"%w\" EXCEPT SELECT rowid, * FROM " BEFORE_SCHEMA ".\"%w\") OR EXISTS (SELECT rowid, * FROM " BEFORE_SCHEMA ".\"%w\" EXCEPT SELECT rowid, * FROM main.\"%w\")", table, table, table, table);
+	if (!query)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: has_changed(): out of memory.\n");
+			goto teardown;
+		}
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: has_changed(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	rc = sqlite3_step (stmt);
+	if (rc != SQLITE_ROW)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: has_changed(): error while performing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	*changed = sqlite3_column_int (stmt, 0) != 0;
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	if (query) sqlite3_free (query);
+	return err;
+}
+
+/*
+ * Computes the changeset between a copy of the database made before a
+ * migration and the main database, for migrations which didn't go through
+ * our connection (executables). As with `finish_capture()`, no changeset is
+ * returned when a table without primary key was written.
+ *
+ * Caller must free `changeset` with `sqlite3_free()`.
+ */
+int
+diff_capture (changeset_t changeset[static 1], const char before_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	bool attached = false;
+	sqlite3_session *session = NULL;
+	sqlite3_stmt *stmt = NULL;
+	char *attach = NULL;
+	char query[BUFSIZ] = "SELECT m.name FROM main.sqlite_schema AS m JOIN " BEFORE_SCHEMA ".sqlite_schema AS b USING (type, name) WHERE m.type = 'table' AND m.name NOT LIKE 'sqlite_%' AND m.name != 'migrations'";
+
+	attach = sqlite3_mprintf ("ATTACH %Q AS " BEFORE_SCHEMA, before_path);
+	if (!attach)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: diff_capture(): out of memory.\n");
+			goto teardown;
+		}
+
+	err = db_exec (attach);
+	if (err)
+		{
+			fprintf (stderr, "changeset.c: diff_capture(): can't attach database copy: %s\n", before_path);
+			goto teardown;
+		}
+
+	attached = true;
+
+	err = start_capture (&session);
+	if (err)
+		{
+			fprintf (stderr, "changeset.c: diff_capture(): can't start session.\n");
+			goto teardown;
+		}
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: diff_capture(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *table = (const char *) sqlite3_column_text (stmt, 0);
+					char *diff_err = NULL;
+
+					bool has = false;
+					bool changed = false;
+					err = has_primary_key (&has, "main", table);
+					if (!err && !has)
+						err = has_changed (&changed, table);
+
+					if (err)
+						{
+							fprintf (stderr, "changeset.c: diff_capture(): can't compare table %s.\n", table);
+							goto teardown;
+						}
+
+					if (changed)
+						{
+							warn_unrecorded (table);
+							goto teardown;
+						}
+
+					rc = sqlite3session_diff (session, BEFORE_SCHEMA, table, &diff_err);
+					if (rc != SQLITE_OK)
+						{
+							err = 1;
+							fprintf (stderr, "changeset.c: diff_capture(): can't diff table %s: %s\n", table, diff_err ? diff_err : sqlite3_errstr (rc));
+							sqlite3_free (diff_err);
+							goto teardown;
+						}
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "changeset.c: diff_capture(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	sqlite3_finalize (stmt);
+	stmt = NULL;
+
+	err = finish_capture (session, NULL, changeset);
+	session = NULL;
+	if (err)
+		{
+			fprintf (stderr, "changeset.c: diff_capture(): can't generate changeset.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	if (session) sqlite3session_delete (session);
+	if (attached) db_exec ("DETACH " BEFORE_SCHEMA);
+	if (attach) sqlite3_free (attach);
+	return err;
+}
+
+static const char *
+conflict_name (int conflict)
+{
+	switch (conflict)
+		{
+			case SQLITE_CHANGESET_DATA: return "row was modified";
+			case SQLITE_CHANGESET_NOTFOUND: return "row not found";
+			case SQLITE_CHANGESET_CONFLICT: return "row already exists";
+			case SQLITE_CHANGESET_CONSTRAINT: return "constraint violation";
+			case SQLITE_CHANGESET_FOREIGN_KEY: return "foreign key violation";
+			default: return "unknown conflict";
+		}
+}
+
+/*
+ * Any conflict means the database doesn't hold the data the changeset was
+ * recorded against, so we report it and abort: the whole changeset is then
+ * rolled back.
+ */
+static int
+abort_on_conflict (void *context, int conflict, sqlite3_changeset_iter *iter)
+{
+	int *conflicts = context;
+	const char *table = NULL;
+	int columns = 0;
+	int operation = 0;
+
+	(*conflicts)++;
+
+	if (conflict != SQLITE_CHANGESET_FOREIGN_KEY && sqlite3changeset_op (iter, &table, &columns, &operation, NULL) == SQLITE_OK)
+		fprintf (stderr, "Conflict on table %s (%s): %s.\n", table, operation == SQLITE_INSERT ? "insert" : operation == SQLITE_DELETE ? "delete" : "update", conflict_name (conflict));
+	else
+		fprintf (stderr, "Conflict: %s.\n", conflict_name (conflict));
+
+	return SQLITE_CHANGESET_ABORT;
+}
+
+/*
+ * Applies a changeset to the main database. Nothing is applied if any
+ * conflict happens.
+ */
+int
+apply_changeset (const changeset_t changeset[static 1])
+{
+	int err = 0;
+	int conflicts = 0;
+
+	int rc = sqlite3changeset_apply (db, changeset->size, changeset->data, NULL, abort_on_conflict, &conflicts);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: apply_changeset(): can't apply changeset (%d conflicts): %s\n", conflicts, sqlite3_errstr (rc));
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Retrieves the changeset recorded for a migration in the migrations table
+ * of an other database. `changeset->data` is left NULL if there is none.
+ *
+ * Caller must free `changeset` with `sqlite3_free()`.
+ */
+int
+find_recorded_changeset (changeset_t changeset[static 1], sqlite3 *conn, const char migration_name[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT changeset FROM migrations WHERE name = ? AND changeset IS NOT NULL";
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "changeset.c: find_recorded_changeset(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, migration_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					int size = sqlite3_column_bytes (stmt, 0);
+					changeset->data = sqlite3_malloc (size > 0 ? size : 1);
+					if (!changeset->data)
+						{
+							err = 1;
+							fprintf (stderr, "changeset.c: find_recorded_changeset(): out of memory.\n");
+							goto teardown;
+						}
+
+					if (size > 0)
+						memcpy (changeset->data, sqlite3_column_blob (stmt, 0), size);
+					changeset->size = size;
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "changeset.c: find_recorded_changeset(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+void
+free_changeset (changeset_t changeset[static 1])
+{
+	if (changeset->data) sqlite3_free (changeset->data);
+	changeset->data = NULL;
+	changeset->size = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _CHANGESET_H_
+#define _CHANGESET_H_
+
+#include <sqlite3.h>
+#include "main.h"
+#include "manifest.h"
+
+typedef struct {
+	void *data;
+	int size;
+} changeset_t;
+
+int start_capture (sqlite3_session *session[static 1]);
+int finish_capture (sqlite3_session *session, const manifest_t *manifest, changeset_t changeset[static 1]);
+int diff_capture (changeset_t changeset[static 1], const char before_path[MAX_PATH_LEN]);
+int apply_changeset (const changeset_t changeset[static 1]);
+int find_recorded_changeset (changeset_t changeset[static 1], sqlite3 *conn, const char migration_name[static 1]);
+void free_changeset (changeset_t changeset[static 1]);
+
+#endif
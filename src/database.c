@@ -1,24 +1,50 @@
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "backup.h"
 #include "database.h"
+#include "hash.h"
 #include "main.h"
+#include "progress.h"
 
 sqlite3 *db = NULL;
+static void **plugins = NULL;
+static size_t plugins_len = 0;
 
+bool
+file_exists (const char *path)
+{
+	struct stat st;
+	if (stat (path, &st) == 0)
+		return true;
+
+	return false;
+}
+
+/*
+ * Reads the whole file.
+ *
+ * Caller must free `content`.
+ */
 static int
-exec_init (const char init_path[MAX_PATH_LEN])
+read_file (char *content[static 1], const char path[MAX_PATH_LEN])
 {
 	int err = 0;
 	FILE *file = NULL;
-	char *sql = NULL;
 
-	file = fopen (init_path, "r");
+	file = fopen (path, "r");
 	if (!file)
 		{
 			err = 1;
-			fprintf (stderr, "database.c: exec_init(): can't read init file.\n");
+			fprintf (stderr, "database.c: read_file(): can't open file: %s\n", path);
 			goto teardown;
 		}
 
@@ -28,29 +54,47 @@ exec_init (const char init_path[MAX_PATH_LEN])
 	if (size < 0)
 		{
 			err = 1;
-			fprintf (stderr, "database.c: exec_init(): error while reading init file.\n");
+			fprintf (stderr, "database.c: read_file(): error while reading file: %s\n", path);
 			goto teardown;
 		}
 
 	fseek (file, 0, SEEK_SET);
 
-	sql = calloc (1, size + 1);
-	if (!sql)
+	*content = calloc (1, size + 1);
+	if (!*content)
 		{
 			err = 1;
-			fprintf (stderr, "database.c: exec_init(): out of memory.\n");
+			fprintf (stderr, "database.c: read_file(): out of memory.\n");
 			goto teardown;
 		}
 
-	size_t read = fread (sql, 1, size, file);
+	size_t read = fread (*content, 1, size, file);
 	if (read != (size_t) size)
 		{
 			err = 1;
-			fprintf (stderr, "database.c: exec_init(): could not read the whole init file: %s\n", init_path);
+			fprintf (stderr, "database.c: read_file(): could not read the whole file: %s\n", path);
 			goto teardown;
 		}
 
-	err = db_exec (sql);
+	teardown:
+	if (file) fclose (file);
+	return err;
+}
+
+static int
+exec_init (sqlite3 *conn, const char init_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	char *sql = NULL;
+
+	err = read_file (&sql, init_path);
+	if (err)
+		{
+			fprintf (stderr, "database.c: exec_init(): can't read init file.\n");
+			goto teardown;
+		}
+
+	err = db_exec_on (conn, sql);
 	if (err)
 		{
 			fprintf (stderr, "database.c: exec_init(): could not execute SQL from init file: %s\n", init_path);
@@ -58,7 +102,6 @@ exec_init (const char init_path[MAX_PATH_LEN])
 		}
 
 	teardown:
-	if (file) fclose (file);
 	if (sql) free (sql);
 	return err;
 }
@@ -70,12 +113,21 @@ exec_init (const char init_path[MAX_PATH_LEN])
  */
 int
 db_exec (const char *query)
+{
+	return db_exec_on (db, query);
+}
+
+/*
+ * Same as `db_exec()`, on an other connection than the main one.
+ */
+int
+db_exec_on (sqlite3 *conn, const char *query)
 {
 	int err = 0;
 	int rc = 0;
 	char *sql_err = NULL;
 
-	rc = sqlite3_exec (db, query, NULL, NULL, &sql_err);
+	rc = sqlite3_exec (conn, query, NULL, NULL, &sql_err);
 	if (rc != SQLITE_OK)
 		{
 			err = 1;
@@ -109,7 +161,7 @@ open_db (const char db_file[MAX_PATH_LEN], const char init_path[MAX_PATH_LEN])
 
 	if (init_path[0] != 0)
 		{
-			err = exec_init (init_path);
+			err = exec_init (db, init_path);
 			if (err)
 				{
 					fprintf (stderr, "database.c: open_db(): can't initialize connection.\n");
@@ -121,10 +173,38 @@ open_db (const char db_file[MAX_PATH_LEN], const char init_path[MAX_PATH_LEN])
 	return err;
 }
 
+/*
+ * Plugins may register functions or hooks on our connection, so they stay
+ * loaded until it's closed. If we can't remember one, it stays loaded for
+ * good.
+ */
+void
+hold_plugin (void *handle)
+{
+	void **grown = realloc (plugins, sizeof (void *) * (plugins_len + 1));
+	if (!grown)
+		return;
+
+	plugins = grown;
+	plugins[plugins_len++] = handle;
+}
+
 void
 close_db ()
 {
-	if (db) sqlite3_close (db);
+	int rc = db ? sqlite3_close (db) : SQLITE_OK;
+	db = NULL;
+
+	// A connection which failed to close may still call into plugins.
+	if (rc != SQLITE_OK)
+		return;
+
+	for (size_t i = 0; i < plugins_len; i++)
+		dlclose (plugins[i]);
+
+	free (plugins);
+	plugins = NULL;
+	plugins_len = 0;
 }
 
 int
@@ -194,3 +274,654 @@ backup_db (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN])
 	if (dest_db) sqlite3_close (dest_db);
 	return err;
 }
+
+// Bytes of the database header which the backup legitimately changes: the
+// file format versions (kept from a previous backup in WAL mode), the file
+// change counter, the schema cookie and the version-valid-for number.
+static const int changed_header_ranges[][2] = { { 18, 2 }, { 24, 4 }, { 40, 4 }, { 92, 4 } };
+
+typedef struct {
+	int src_fd;
+	int dest_fd;
+	sqlite3_int64 page_size;
+	sqlite3_int64 first_page;
+	sqlite3_int64 end_page;
+	sqlite3_int64 mismatch;
+	bool failed;
+} page_range_t;
+
+/*
+ * Compares the hashes of pages `[first_page, end_page[` of both files, and
+ * records the first page which differs.
+ */
+static void *
+compare_page_range (void *context)
+{
+	page_range_t *range = context;
+	unsigned char *src_page = malloc (range->page_size);
+	unsigned char *dest_page = malloc (range->page_size);
+
+	if (!src_page || !dest_page)
+		{
+			range->failed = true;
+			goto teardown;
+		}
+
+	for (sqlite3_int64 page = range->first_page; page < range->end_page; page++)
+		{
+			off_t offset = (off_t) ((page - 1) * range->page_size);
+			if (pread (range->src_fd, src_page, range->page_size, offset) != range->page_size || pread (range->dest_fd, dest_page, range->page_size, offset) != range->page_size)
+				{
+					range->failed = true;
+					goto teardown;
+				}
+
+			if (page == 1)
+				for (size_t i = 0; i < sizeof (changed_header_ranges) / sizeof (changed_header_ranges[0]); i++)
+					{
+						memset (src_page + changed_header_ranges[i][0], 0, changed_header_ranges[i][1]);
+						memset (dest_page + changed_header_ranges[i][0], 0, changed_header_ranges[i][1]);
+					}
+
+			if (hash_bytes (HASH_SEED, src_page, range->page_size) != hash_bytes (HASH_SEED, dest_page, range->page_size))
+				{
+					range->mismatch = page;
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (src_page) free (src_page);
+	if (dest_page) free (dest_page);
+	return NULL;
+}
+
+/*
+ * Retrieves the first column of the first row returned by a query, like a
+ * pragma value.
+ */
+int
+query_pragma (sqlite3 *conn, const char query[static 1], char value[MAX_NAME_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	value[0] = 0;
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: query_pragma(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					if (value[0] == 0)
+						snprintf (value, MAX_NAME_LEN, "%s", (const char *) sqlite3_column_text (stmt, 0));
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "database.c: query_pragma(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Runs `PRAGMA quick_check` on the backup, for databases in WAL mode, whose
+ * file doesn't hold the pages still in the WAL.
+ */
+static int
+quick_check_backup (const char dest[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	char result[MAX_NAME_LEN] = {0};
+
+	int rc = sqlite3_open_v2 (dest, &conn, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: quick_check_backup(): can't open backup %s\n", dest);
+			goto teardown;
+		}
+
+	err = query_pragma (conn, "PRAGMA quick_check", result);
+	if (err)
+		goto teardown;
+
+	if (strncmp (result, "ok", 3) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: quick_check_backup(): backup %s is corrupted: %s\n", dest, result);
+			goto teardown;
+		}
+
+	teardown:
+	if (conn) sqlite3_close (conn);
+	return err;
+}
+
+/*
+ * Checks the backup holds the same pages as the database, by comparing
+ * hashes of page ranges on several threads. The database is kept in a read
+ * transaction meanwhile, so that it can't change under us. Databases in WAL
+ * mode get a `PRAGMA quick_check` of the backup instead.
+ */
+int
+verify_backup (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	bool in_transaction = false;
+	int src_fd = -1;
+	int dest_fd = -1;
+	char value[MAX_NAME_LEN] = {0};
+	page_range_t ranges[VERIFY_MAX_THREADS] = {0};
+	pthread_t threads[VERIFY_MAX_THREADS] = {0};
+	bool started[VERIFY_MAX_THREADS] = {0};
+	struct stat st = {0};
+
+	int rc = sqlite3_open_v2 (src, &conn, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: verify_backup(): can't open database %s\n", src);
+			goto teardown;
+		}
+	sqlite3_busy_timeout (conn, 5000);
+
+	err = query_pragma (conn, "PRAGMA journal_mode", value);
+	if (err)
+		goto teardown;
+
+	if (strncmp (value, "wal", 4) == 0)
+		{
+			err = quick_check_backup (dest);
+			goto teardown;
+		}
+
+	err = db_exec_on (conn, "BEGIN; SELECT count(*) FROM sqlite_schema");
+	if (err)
+		{
+			fprintf (stderr, "database.c: verify_backup(): can't lock database.\n");
+			goto teardown;
+		}
+
+	in_transaction = true;
+
+	err = query_pragma (conn, "PRAGMA page_size", value);
+	sqlite3_int64 page_size = strtoll (value, NULL, 10);
+	err = err || query_pragma (conn, "PRAGMA page_count", value);
+	sqlite3_int64 page_count = strtoll (value, NULL, 10);
+	if (err)
+		goto teardown;
+
+	src_fd = open (src, O_RDONLY);
+	dest_fd = open (dest, O_RDONLY);
+	if (src_fd < 0 || dest_fd < 0 || fstat (dest_fd, &st) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: verify_backup(): can't open database files.\n");
+			goto teardown;
+		}
+
+	if ((sqlite3_int64) st.st_size != page_count * page_size)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: verify_backup(): backup %s has %lld bytes instead of %lld.\n", dest, (long long) st.st_size, (long long) (page_count * page_size));
+			goto teardown;
+		}
+
+	long online = sysconf (_SC_NPROCESSORS_ONLN);
+	sqlite3_int64 threads_len = online < 1 ? 1 : online > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : online;
+	if (threads_len > page_count)
+		threads_len = page_count > 0 ? page_count : 1;
+
+	for (sqlite3_int64 i = 0; i < threads_len; i++)
+		{
+			ranges[i].src_fd = src_fd;
+			ranges[i].dest_fd = dest_fd;
+			ranges[i].page_size = page_size;
+			ranges[i].first_page = 1 + page_count * i / threads_len;
+			ranges[i].end_page = 1 + page_count * (i + 1) / threads_len;
+
+			started[i] = pthread_create (&threads[i], NULL, compare_page_range, &ranges[i]) == 0;
+			if (!started[i])
+				compare_page_range (&ranges[i]);
+		}
+
+	for (sqlite3_int64 i = 0; i < threads_len; i++)
+		{
+			if (started[i])
+				pthread_join (threads[i], NULL);
+
+			if (ranges[i].failed)
+				{
+					err = 1;
+					fprintf (stderr, "database.c: verify_backup(): can't read pages %lld to %lld.\n", (long long) ranges[i].first_page, (long long) ranges[i].end_page - 1);
+				}
+			else if (ranges[i].mismatch)
+				{
+					err = 1;
+					fprintf (stderr, "database.c: verify_backup(): backup %s differs from database at page %lld.\n", dest, (long long) ranges[i].mismatch);
+				}
+		}
+
+	teardown:
+	if (src_fd >= 0) close (src_fd);
+	if (dest_fd >= 0) close (dest_fd);
+	if (in_transaction) db_exec_on (conn, "COMMIT");
+	if (conn) sqlite3_close (conn);
+	return err;
+}
+
+static void *
+run_background_backup (void *context)
+{
+	background_backup_t *backup = context;
+	struct timespec start = {0};
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	if (backup->compress[0] != 0)
+		backup->err = stream_backup_db (backup->src, backup->dest, backup->compress, &backup->stats);
+	else
+		{
+			backup->err = backup_db (backup->src, backup->dest);
+
+			struct stat st = {0};
+			if (stat (backup->dest, &st) == 0)
+				backup->stats.bytes = backup->stats.stored_bytes = (sqlite3_int64) st.st_size;
+		}
+
+	struct timespec now = {0};
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	backup->seconds = elapsed_since (&start);
+
+	if (backup->verify && !backup->err)
+		{
+			if (backup->compress[0] != 0)
+				backup->err = verify_stream_backup (backup->dest, backup->compress, &backup->stats);
+			else
+				backup->err = verify_backup (backup->src, backup->dest);
+
+			backup->verify_seconds = elapsed_since (&now);
+		}
+
+	return NULL;
+}
+
+/*
+ * Starts backing up `src` to `dest` in a thread, with its own connections,
+ * streamed through `backup->compress` if set, then verifying the backup if
+ * `backup->verify` is set. If SQLite wasn't built thread safe or the thread
+ * can't be created, the backup is made right away instead.
+ *
+ * Caller must call `finish_background_backup()` before writing to `src`.
+ */
+int
+start_background_backup (background_backup_t backup[static 1], const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN])
+{
+	snprintf (backup->src, MAX_PATH_LEN, "%s", src);
+	snprintf (backup->dest, MAX_PATH_LEN, "%s", dest);
+	backup->err = 0;
+
+	if (sqlite3_threadsafe () && pthread_create (&backup->thread, NULL, run_background_backup, backup) == 0)
+		{
+			backup->running = true;
+			return 0;
+		}
+
+	run_background_backup (backup);
+	return backup->err;
+}
+
+/*
+ * Waits for the backup to be done, if it's still running, and returns its
+ * result.
+ */
+int
+finish_background_backup (background_backup_t backup[static 1])
+{
+	if (backup->running)
+		{
+			pthread_join (backup->thread, NULL);
+			backup->running = false;
+		}
+
+	return backup->err;
+}
+
+/*
+ * Executes a statement coming from a schema dump.
+ *
+ * Dumps of `sqlite_schema` contain internal tables (like `sqlite_sequence`)
+ * which can't be created manually, and shadow tables of virtual tables,
+ * which are already created along with their virtual table (and are the only
+ * ones dumped with a single quoted name). Those are ignored.
+ */
+int
+exec_schema_statement (sqlite3 *conn, const char statement[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	int rc = sqlite3_prepare_v2 (conn, statement, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			const char *message = sqlite3_errmsg (conn);
+			if (strstr (message, "reserved for internal use"))
+				goto teardown;
+
+			if (strstr (message, "already exists") && strncmp (statement, "CREATE TABLE '", 14) == 0)
+				goto teardown;
+
+			err = 1;
+			fprintf (stderr, "database.c: exec_schema_statement(): error while preparing query: %s\n", message);
+			goto teardown;
+		}
+
+	while (stmt)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				continue;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "database.c: exec_schema_statement(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Executes a schema dump, statement by statement.
+ */
+static int
+exec_schema (sqlite3 *conn, char sql[static 1])
+{
+	int err = 0;
+	char *start = sql;
+
+	for (char *end = strchr (start, ';'); end; end = strchr (end + 1, ';'))
+		{
+			char next = end[1];
+			end[1] = 0;
+			bool complete = sqlite3_complete (start);
+
+			if (complete)
+				{
+					start += strspn (start, " \t\r\n");
+					if (*start)
+						err = exec_schema_statement (conn, start);
+				}
+
+			end[1] = next;
+
+			if (err)
+				{
+					fprintf (stderr, "database.c: exec_schema(): can't execute statement.\n");
+					goto teardown;
+				}
+
+			if (complete)
+				start = end + 1;
+		}
+
+	start += strspn (start, " \t\r\n");
+	if (*start)
+		{
+			err = exec_schema_statement (conn, start);
+			if (err)
+				{
+					fprintf (stderr, "database.c: exec_schema(): can't execute last statement.\n");
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+int
+load_schema (sqlite3 *conn, const char schema_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	char *sql = NULL;
+
+	err = read_file (&sql, schema_path);
+	if (err)
+		{
+			fprintf (stderr, "database.c: load_schema(): can't read schema file: %s\n", schema_path);
+			goto teardown;
+		}
+
+	err = exec_schema (conn, sql);
+	if (err)
+		{
+			fprintf (stderr, "database.c: load_schema(): can't execute schema file: %s\n", schema_path);
+			goto teardown;
+		}
+
+	teardown:
+	if (sql) free (sql);
+	return err;
+}
+
+/*
+ * Opens an in-memory database and loads a schema file (like the structure
+ * file) in it.
+ *
+ * Caller must close the connection.
+ */
+int
+open_schema_db (sqlite3 *conn[static 1], const char schema_path[MAX_PATH_LEN])
+{
+	int err = 0;
+
+	err = sqlite3_open (":memory:", conn);
+	if (err)
+		{
+			fprintf (stderr, "database.c: open_schema_db(): can't open in-memory database.\n");
+			goto teardown;
+		}
+
+	err = load_schema (*conn, schema_path);
+	if (err)
+		{
+			fprintf (stderr, "database.c: open_schema_db(): can't load schema file: %s\n", schema_path);
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Opens the main connection on an in-memory database holding the schema from
+ * the structure file, so that we can inspect the schema without touching
+ * the real database.
+ */
+int
+open_structure_db (const char structure_path[MAX_PATH_LEN], const char init_path[MAX_PATH_LEN])
+{
+	int err = 0;
+
+	err = sqlite3_open (":memory:", &db);
+	if (err)
+		{
+			fprintf (stderr, "database.c: open_structure_db(): can't open in-memory database.\n");
+			goto teardown;
+		}
+
+	if (init_path[0] != 0)
+		{
+			err = exec_init (db, init_path);
+			if (err)
+				{
+					fprintf (stderr, "database.c: open_structure_db(): can't initialize connection.\n");
+					goto teardown;
+				}
+		}
+
+	err = load_schema (db, structure_path);
+	if (err)
+		{
+			fprintf (stderr, "database.c: open_structure_db(): can't load structure file: %s\n", structure_path);
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Opens an in-memory database with the same schema as the main one, and
+ * no data.
+ *
+ * Caller must close the connection.
+ */
+int
+open_schema_copy (sqlite3 *conn[static 1], const char init_path[MAX_PATH_LEN])
+{
+	int err = 0;
+
+	err = sqlite3_open (":memory:", conn);
+	if (err)
+		{
+			fprintf (stderr, "database.c: open_schema_copy(): can't open in-memory database.\n");
+			goto teardown;
+		}
+
+	if (init_path[0] != 0)
+		{
+			err = exec_init (*conn, init_path);
+			if (err)
+				{
+					fprintf (stderr, "database.c: open_schema_copy(): can't initialize connection.\n");
+					goto teardown;
+				}
+		}
+
+	err = copy_schema (db, *conn);
+	if (err)
+		{
+			fprintf (stderr, "database.c: open_schema_copy(): can't copy schema.\n");
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Copies the schema (and only the schema) of a database to an other one.
+ */
+int
+copy_schema (sqlite3 *from, sqlite3 *to)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT sql FROM sqlite_schema WHERE sql IS NOT NULL ORDER BY rowid";
+
+	int rc = sqlite3_prepare_v2 (from, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: copy_schema(): error while preparing query: %s\n", sqlite3_errmsg (from));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *sql = (const char *) sqlite3_column_text (stmt, 0);
+					err = exec_schema_statement (to, sql);
+					if (err)
+						{
+							fprintf (stderr, "database.c: copy_schema(): can't copy statement: %s\n", sql);
+							goto teardown;
+						}
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "database.c: copy_schema(): error while performing query: %s\n", sqlite3_errmsg (from));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Writes the schema of a database as SQL statements, in creation order.
+ *
+ * The `migrations` table is left out when `include_migrations` is false,
+ * for dumps loaded in databases where exodus already created it.
+ */
+int
+dump_schema (sqlite3 *conn, FILE *file, bool include_migrations)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT sql FROM sqlite_schema WHERE sql IS NOT NULL AND (? OR name != 'migrations') ORDER BY rowid";
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "database.c: dump_schema(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	sqlite3_bind_int (stmt, 1, include_migrations);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *sql = (const char *) sqlite3_column_text (stmt, 0);
+					fprintf (file, "%s;\n\n", sql);
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "database.c: dump_schema(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
@@ -1,15 +1,47 @@
 #ifndef _DATABASE_H_
 #define _DATABASE_H_
 
+#include <pthread.h>
 #include <sqlite3.h>
+#include <stdio.h>
 #include "main.h"
+#include "backup.h"
+
+#define VERIFY_MAX_THREADS 8
+
+typedef struct {
+	char src[MAX_PATH_LEN];
+	char dest[MAX_PATH_LEN];
+	pthread_t thread;
+	bool running;
+	bool verify;
+	char compress[MAX_PATH_LEN];
+	int err;
+	double seconds;
+	double verify_seconds;
+	backup_stats_t stats;
+} background_backup_t;
 
 extern sqlite3 *db;
+bool file_exists (const char *path);
 int db_exec (const char *query);
+int db_exec_on (sqlite3 *conn, const char *query);
 int open_db (const char db_path[MAX_PATH_LEN], const char init_path[MAX_PATH_LEN]);
+void hold_plugin (void *handle);
 void close_db ();
 int reopen_db (const char db_file[MAX_PATH_LEN], const char init_path[MAX_PATH_LEN]);
+int query_pragma (sqlite3 *conn, const char query[static 1], char value[MAX_NAME_LEN]);
 int backup_db (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN]);
+int verify_backup (const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN]);
+int start_background_backup (background_backup_t backup[static 1], const char src[MAX_PATH_LEN], const char dest[MAX_PATH_LEN]);
+int finish_background_backup (background_backup_t backup[static 1]);
+int exec_schema_statement (sqlite3 *conn, const char statement[static 1]);
+int load_schema (sqlite3 *conn, const char schema_path[MAX_PATH_LEN]);
+int open_schema_db (sqlite3 *conn[static 1], const char schema_path[MAX_PATH_LEN]);
+int open_structure_db (const char structure_path[MAX_PATH_LEN], const char init_path[MAX_PATH_LEN]);
+int open_schema_copy (sqlite3 *conn[static 1], const char init_path[MAX_PATH_LEN]);
+int copy_schema (sqlite3 *from, sqlite3 *to);
+int dump_schema (sqlite3 *conn, FILE *file, bool include_migrations);
 
 #endif
 
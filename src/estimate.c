@@ -0,0 +1,439 @@
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+#include "main.h"
+#include "database.h"
+#include "estimate.h"
+#include "progress.h"
+
+#define SAMPLE_ROWS 10000
+
+void
+format_size (char formatted[32], sqlite3_int64 bytes)
+{
+	const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+	double size = (double) bytes;
+	size_t unit = 0;
+
+	while (size >= 1024 && unit < sizeof (units) / sizeof (units[0]) - 1)
+		{
+			size /= 1024;
+			unit++;
+		}
+
+	snprintf (formatted, 32, "%.1f %s", size, units[unit]);
+}
+
+static int
+count_rows (sqlite3_int64 rows[static 1], const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char *query = sqlite3_mprintf ("SELECT count(*) FROM \"%w\"", table_name);
+	if (!query)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: count_rows(): out of memory.\n");
+			goto teardown;
+		}
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: count_rows(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*rows = sqlite3_column_int64 (stmt, 0);
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "estimate.c: count_rows(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	if (query) sqlite3_free (query);
+
+	return err;
+}
+
+/*
+ * Retrieves the size of the table and of its indexes from the dbstat
+ * virtual table.
+ */
+static int
+find_object_sizes (recreate_estimate_t estimate[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT s.type, s.name, d.pageno, d.pgsize FROM sqlite_schema AS s, dbstat AS d WHERE s.tbl_name = ? AND s.type IN ('table', 'index') AND d.name = s.name AND d.aggregate = TRUE ORDER BY s.name";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: find_object_sizes(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, estimate->table, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *type = (const char *) sqlite3_column_text (stmt, 0);
+					const char *name = (const char *) sqlite3_column_text (stmt, 1);
+					object_size_t *size = &estimate->table_size;
+
+					if (strncmp (type, "index", 10) == 0)
+						{
+							estimate->indexes_len++;
+							estimate->indexes = realloc (estimate->indexes, sizeof (object_size_t) * estimate->indexes_len);
+							if (!estimate->indexes)
+								{
+									err = 1;
+									fprintf (stderr, "estimate.c: find_object_sizes(): out of memory.\n");
+									goto teardown;
+								}
+
+							size = &estimate->indexes[estimate->indexes_len - 1];
+						}
+
+					snprintf (size->name, MAX_NAME_LEN, "%s", name);
+					size->pages = sqlite3_column_int64 (stmt, 2);
+					size->bytes = sqlite3_column_int64 (stmt, 3);
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "estimate.c: find_object_sizes(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+/*
+ * Measures copy throughput by copying a sample of the table in a temporary
+ * table, which is rolled back afterward.
+ */
+static int
+measure_copy_throughput (recreate_estimate_t estimate[static 1])
+{
+	int err = 0;
+	bool in_savepoint = false;
+	char *copy = NULL;
+
+	if (estimate->rows == 0 || estimate->table_size.bytes == 0)
+		goto teardown;
+
+	copy = sqlite3_mprintf ("CREATE TEMP TABLE exodus_estimate AS SELECT * FROM \"%w\" LIMIT %d", estimate->table, SAMPLE_ROWS);
+	if (!copy)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: measure_copy_throughput(): out of memory.\n");
+			goto teardown;
+		}
+
+	err = db_exec ("SAVEPOINT exodus_estimate");
+	if (err)
+		{
+			fprintf (stderr, "estimate.c: measure_copy_throughput(): can't start savepoint.\n");
+			goto teardown;
+		}
+
+	in_savepoint = true;
+
+	struct timespec start = {0};
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	err = db_exec (copy);
+	if (err)
+		{
+			fprintf (stderr, "estimate.c: measure_copy_throughput(): can't copy sample rows.\n");
+			goto teardown;
+		}
+
+	double elapsed = elapsed_since (&start);
+	sqlite3_int64 sample_rows = estimate->rows < SAMPLE_ROWS ? estimate->rows : SAMPLE_ROWS;
+	double sample_bytes = (double) estimate->table_size.bytes * (double) sample_rows / (double) estimate->rows;
+
+	if (elapsed > 0)
+		{
+			estimate->bytes_per_second = sample_bytes / elapsed;
+			estimate->seconds = (double) recreate_copy_bytes (estimate) / estimate->bytes_per_second;
+		}
+
+	teardown:
+	if (in_savepoint)
+		{
+			int rollback_err = db_exec ("ROLLBACK TO exodus_estimate; RELEASE exodus_estimate");
+			if (rollback_err)
+				{
+					err = rollback_err;
+					fprintf (stderr, "estimate.c: measure_copy_throughput(): can't rollback sample copy.\n");
+				}
+		}
+
+	if (copy) sqlite3_free (copy);
+
+	return err;
+}
+
+/*
+ * Estimates the cost of recreating a table: its row count, the size of the
+ * table and its indexes, and how long copying them is expected to take.
+ *
+ * Caller must call `free_recreate_estimate()` on the estimate.
+ */
+int
+estimate_recreate (recreate_estimate_t estimate[static 1], const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+
+	snprintf (estimate->table, MAX_NAME_LEN, "%s", table_name);
+
+	err = count_rows (&estimate->rows, table_name);
+	if (err)
+		{
+			fprintf (stderr, "estimate.c: estimate_recreate(): can't count rows.\n");
+			goto teardown;
+		}
+
+	err = find_object_sizes (estimate);
+	if (err)
+		{
+			fprintf (stderr, "estimate.c: estimate_recreate(): can't find table and indexes sizes.\n");
+			goto teardown;
+		}
+
+	err = measure_copy_throughput (estimate);
+	if (err)
+		{
+			fprintf (stderr, "estimate.c: estimate_recreate(): can't measure copy throughput.\n");
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Bytes written when copying the table and rebuilding its indexes.
+ */
+sqlite3_int64
+recreate_copy_bytes (const recreate_estimate_t estimate[static 1])
+{
+	sqlite3_int64 bytes = estimate->table_size.bytes;
+	for (size_t i = 0; i < estimate->indexes_len; i++)
+		bytes += estimate->indexes[i].bytes;
+
+	return bytes;
+}
+
+void
+print_recreate_estimate (const recreate_estimate_t estimate[static 1])
+{
+	char formatted[32] = {0};
+
+	format_size (formatted, estimate->table_size.bytes);
+	printf ("Recreating table %s: %lld rows, %lld pages (%s).\n", estimate->table, (long long) estimate->rows, (long long) estimate->table_size.pages, formatted);
+
+	for (size_t i = 0; i < estimate->indexes_len; i++)
+		{
+			format_size (formatted, estimate->indexes[i].bytes);
+			printf ("  index %s: %lld pages (%s).\n", estimate->indexes[i].name, (long long) estimate->indexes[i].pages, formatted);
+		}
+
+	if (estimate->bytes_per_second > 0)
+		{
+			format_size (formatted, (sqlite3_int64) estimate->bytes_per_second);
+			printf ("  estimated duration: %.1fs (measured copy throughput: %s/s).\n", estimate->seconds, formatted);
+		}
+}
+
+void
+free_recreate_estimate (recreate_estimate_t estimate[static 1])
+{
+	if (estimate->indexes) free (estimate->indexes);
+	estimate->indexes = NULL;
+	estimate->indexes_len = 0;
+}
+
+/*
+ * Checks there is enough free space for a migration.
+ *
+ * We need room for the `.prev` backup, for the `.failed` copy if the
+ * migration fails, and for `copy_bytes` of recreated tables, which are
+ * written once in the database and once in the journal. Backups go to
+ * `backup_dir` if given, which may be on an other filesystem. The size of
+ * compressed backups isn't known beforehand, so they aren't counted: the
+ * backup fails before any migration starts if it doesn't fit. Restoring one
+ * decodes it there first, which needs the size of the database.
+ */
+int
+check_disk_space (const char database[MAX_PATH_LEN], const char backup_dir[MAX_PATH_LEN], bool compressed, sqlite3_int64 copy_bytes, bool verbose, bool enough[static 1])
+{
+	int err = 0;
+	char directory[MAX_PATH_LEN] = {0};
+	struct stat st = {0};
+	struct stat directory_st = {0};
+	struct stat backup_st = {0};
+	struct statvfs vfs = {0};
+	struct statvfs backup_vfs = {0};
+
+	if (stat (database, &st) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: check_disk_space(): can't stat database: %s\n", database);
+			goto teardown;
+		}
+
+	snprintf (directory, MAX_PATH_LEN, "%s", database);
+	if (statvfs (dirname (directory), &vfs) != 0 || stat (directory, &directory_st) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: check_disk_space(): can't retrieve filesystem statistics for: %s\n", database);
+			goto teardown;
+		}
+
+	sqlite3_int64 database_bytes = (sqlite3_int64) st.st_size;
+	sqlite3_int64 backup_bytes = compressed ? database_bytes : database_bytes + (database_bytes + copy_bytes);
+	sqlite3_int64 available = (sqlite3_int64) vfs.f_bavail * (sqlite3_int64) vfs.f_frsize;
+	sqlite3_int64 needed = copy_bytes * 2;
+	sqlite3_int64 backup_available = available;
+	bool separate = false;
+
+	if (backup_dir[0] != 0)
+		{
+			if (statvfs (backup_dir, &backup_vfs) != 0 || stat (backup_dir, &backup_st) != 0)
+				{
+					err = 1;
+					fprintf (stderr, "estimate.c: check_disk_space(): can't retrieve filesystem statistics for: %s\n", backup_dir);
+					goto teardown;
+				}
+
+			separate = backup_st.st_dev != directory_st.st_dev;
+			backup_available = (sqlite3_int64) backup_vfs.f_bavail * (sqlite3_int64) backup_vfs.f_frsize;
+		}
+
+	if (!separate)
+		needed += backup_bytes;
+
+	*enough = available >= needed && (!separate || backup_available >= backup_bytes);
+
+	if (verbose || !*enough)
+		{
+			char formatted[32] = {0};
+
+			if (compressed)
+				{
+					format_size (formatted, database_bytes);
+					printf ("Disk space needed: backup and failed copy compressed (not counted), decoded backup to restore %s", formatted);
+				}
+			else
+				{
+					format_size (formatted, database_bytes);
+					printf ("Disk space needed: backup %s", formatted);
+					format_size (formatted, database_bytes + copy_bytes);
+					printf (", failed copy %s", formatted);
+				}
+
+			if (separate)
+				{
+					format_size (formatted, backup_available);
+					printf (" (in %s, available: %s)", backup_dir, formatted);
+				}
+
+			format_size (formatted, copy_bytes * 2);
+			printf (", tables copy and journal %s", formatted);
+			format_size (formatted, needed);
+			printf (", total %s", formatted);
+			format_size (formatted, available);
+			printf (" (available: %s).\n", formatted);
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Writes one line per table and index with its entries (rows for tables),
+ * pages, bytes and unused bytes, from the dbstat virtual table. Lines are
+ * sorted by name and tab separated, so that files of successive releases
+ * can be compared with diff. This reads every page of the database.
+ *
+ * Only leaf cells of rowid tables are rows, while every cell of an index
+ * (or a WITHOUT ROWID table) is an entry.
+ */
+int
+write_table_stats (FILE *file)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT s.type, s.name, s.tbl_name, "
+		"sum(CASE WHEN d.pagetype = 'leaf' OR s.type = 'index' OR s.sql LIKE '%WITHOUT ROWID%' THEN d.ncell ELSE 0 END), "
+		"sum(d.pagetype != 'overflow' OR d.pagetype IS NULL), count(*), sum(d.pgsize), sum(d.unused) "
+		"FROM sqlite_schema AS s JOIN dbstat AS d ON d.name = s.name WHERE s.type IN ('table', 'index') GROUP BY s.name ORDER BY s.name";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "estimate.c: write_table_stats(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	fprintf (file, "# type\tname\ttable\tentries\tpages\toverflow_pages\tbytes\tunused_bytes\n");
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					sqlite3_int64 btree_pages = sqlite3_column_int64 (stmt, 4);
+					sqlite3_int64 pages = sqlite3_column_int64 (stmt, 5);
+
+					fprintf (file, "%s\t%s\t%s\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+							(const char *) sqlite3_column_text (stmt, 0), (const char *) sqlite3_column_text (stmt, 1), (const char *) sqlite3_column_text (stmt, 2),
+							(long long) sqlite3_column_int64 (stmt, 3), (long long) pages, (long long) (pages - btree_pages),
+							(long long) sqlite3_column_int64 (stmt, 6), (long long) sqlite3_column_int64 (stmt, 7));
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "estimate.c: write_table_stats(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
@@ -0,0 +1,34 @@
+#ifndef _ESTIMATE_H_
+#define _ESTIMATE_H_
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include "main.h"
+
+#define RECREATE_MARKER "-- exodus:recreate "
+
+typedef struct {
+	char name[MAX_NAME_LEN];
+	sqlite3_int64 pages;
+	sqlite3_int64 bytes;
+} object_size_t;
+
+typedef struct {
+	char table[MAX_NAME_LEN];
+	sqlite3_int64 rows;
+	object_size_t table_size;
+	object_size_t *indexes;
+	size_t indexes_len;
+	double bytes_per_second;
+	double seconds;
+} recreate_estimate_t;
+
+void format_size (char formatted[32], sqlite3_int64 bytes);
+int estimate_recreate (recreate_estimate_t estimate[static 1], const char table_name[MAX_NAME_LEN]);
+sqlite3_int64 recreate_copy_bytes (const recreate_estimate_t estimate[static 1]);
+void print_recreate_estimate (const recreate_estimate_t estimate[static 1]);
+void free_recreate_estimate (recreate_estimate_t estimate[static 1]);
+int write_table_stats (FILE *file);
+int check_disk_space (const char database[MAX_PATH_LEN], const char backup_dir[MAX_PATH_LEN], bool compressed, sqlite3_int64 copy_bytes, bool verbose, bool enough[static 1]);
+
+#endif
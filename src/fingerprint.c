@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "database.h"
+#include "fingerprint.h"
+#include "hash.h"
+#include "progress.h"
+
+#define SCHEMA_QUERY "SELECT type, name, tbl_name, sql FROM sqlite_schema WHERE name != 'migrations' AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\'"
+
+static bool
+is_word_char (char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '$' || (unsigned char) c >= 0x80;
+}
+
+/*
+ * Hashes SQL code with whitespace outside of quotes ignored, except for a
+ * single space between two words, so that reformatting a statement doesn't
+ * change the fingerprint.
+ */
+static uint64_t
+hash_normalized_sql (uint64_t hash, const char *sql)
+{
+	char quote = 0;
+	char previous = 0;
+	bool pending_space = false;
+
+	for (const char *c = sql; *c; c++)
+		{
+			bool space = *c == ' ' || *c == '\t' || *c == '\n' || *c == '\r' || *c == '\f' || *c == '\v';
+
+			if (!quote && space)
+				{
+					pending_space = true;
+					continue;
+				}
+
+			if (pending_space && is_word_char (previous) && is_word_char (*c))
+				hash = hash_bytes (hash, " ", 1);
+			pending_space = false;
+
+			if (quote && *c == quote)
+				quote = 0;
+			else if (!quote && (*c == '\'' || *c == '"' || *c == '`'))
+				quote = *c;
+			else if (!quote && *c == '[')
+				quote = ']';
+
+			hash = hash_bytes (hash, c, 1);
+			previous = *c;
+		}
+
+	return hash_bytes (hash, "", 1);
+}
+
+static uint64_t
+hash_schema_row (uint64_t hash, sqlite3_stmt *stmt)
+{
+	for (int i = 0; i < 3; i++)
+		hash = hash_string (hash, (const char *) sqlite3_column_text (stmt, i));
+
+	const char *sql = (const char *) sqlite3_column_text (stmt, 3);
+	return hash_normalized_sql (hash, sql ? sql : "");
+}
+
+/*
+ * Computes a fingerprint of the schema: a hash of every object in
+ * `sqlite_schema`, sorted by type and name so that the order in which they
+ * were created doesn't matter. The migrations table and SQLite's internal
+ * tables are left out, as exodus and SQLite change them on their own.
+ */
+int
+schema_fingerprint (uint64_t fingerprint[static 1], sqlite3 *conn)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = SCHEMA_QUERY " ORDER BY type, name";
+
+	*fingerprint = HASH_SEED;
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: schema_fingerprint(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*fingerprint = hash_schema_row (*fingerprint, stmt);
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "fingerprint.c: schema_fingerprint(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Reads the fingerprint written on the first line of the structure file.
+ * `fingerprint` is left empty if there is none, like in structure files
+ * dumped by older versions.
+ */
+int
+read_structure_fingerprint (char fingerprint[HASH_HEX_LEN], const char structure_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	char line[BUFSIZ] = {0};
+	size_t prefix_len = strlen (FINGERPRINT_PREFIX);
+
+	fingerprint[0] = 0;
+
+	FILE *file = fopen (structure_path, "r");
+	if (!file)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: read_structure_fingerprint(): can't open structure file: %s\n", structure_path);
+			goto teardown;
+		}
+
+	if (fgets (line, BUFSIZ, file) && strncmp (line, FINGERPRINT_PREFIX, prefix_len) == 0 && strcspn (line + prefix_len, "\r\n") == HASH_HEX_LEN - 1)
+		{
+			memcpy (fingerprint, line + prefix_len, HASH_HEX_LEN - 1);
+			fingerprint[HASH_HEX_LEN - 1] = 0;
+		}
+
+	teardown:
+	if (file) fclose (file);
+	return err;
+}
+
+/*
+ * Prints the objects of `from` which are missing from `to` or have a
+ * different definition there. Definitions are compared the same way they
+ * are fingerprinted.
+ */
+static int
+print_schema_differences (sqlite3 *from, sqlite3 *to, const char *missing, bool report_different)
+{
+	int err = 0;
+	sqlite3_stmt *objects = NULL;
+	sqlite3_stmt *lookup = NULL;
+	char objects_query[BUFSIZ] = SCHEMA_QUERY " ORDER BY type, name";
+	char lookup_query[BUFSIZ] = SCHEMA_QUERY " AND type = ? AND name = ?";
+
+	int rc = sqlite3_prepare_v2 (from, objects_query, -1, &objects, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2 (to, lookup_query, -1, &lookup, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: print_schema_differences(): error while preparing query: %s\n", sqlite3_errmsg (lookup ? from : to));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (objects);
+			if (s == SQLITE_ROW)
+				{
+					const char *type = (const char *) sqlite3_column_text (objects, 0);
+					const char *name = (const char *) sqlite3_column_text (objects, 1);
+
+					sqlite3_reset (lookup);
+					sqlite3_bind_text (lookup, 1, type, -1, NULL);
+					sqlite3_bind_text (lookup, 2, name, -1, NULL);
+
+					int l = sqlite3_step (lookup);
+					if (l == SQLITE_DONE)
+						printf ("  %s %s %s\n", missing, type, name);
+					else if (l == SQLITE_ROW)
+						{
+							if (report_different && hash_schema_row (HASH_SEED, objects) != hash_schema_row (HASH_SEED, lookup))
+								printf ("  different %s %s\n", type, name);
+						}
+					else
+						{
+							err = 1;
+							fprintf (stderr, "fingerprint.c: print_schema_differences(): error while performing query: %s\n", sqlite3_errmsg (to));
+							goto teardown;
+						}
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "fingerprint.c: print_schema_differences(): error while performing query: %s\n", sqlite3_errmsg (from));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (objects) sqlite3_finalize (objects);
+	if (lookup) sqlite3_finalize (lookup);
+	return err;
+}
+
+/*
+ * Checks the schema of `conn` against the structure file. Only the first
+ * line of the structure file is read, unless the schema doesn't match: the
+ * structure file is then loaded in memory to print which objects differ.
+ */
+int
+check_schema_fingerprint (bool matches[static 1], sqlite3 *conn, const char structure_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *expected = NULL;
+	uint64_t fingerprint = 0;
+	uint64_t expected_fingerprint = 0;
+	char hex[HASH_HEX_LEN] = {0};
+	char expected_hex[HASH_HEX_LEN] = {0};
+
+	err = read_structure_fingerprint (expected_hex, structure_path);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: check_schema_fingerprint(): can't read structure fingerprint.\n");
+			goto teardown;
+		}
+
+	err = schema_fingerprint (&fingerprint, conn);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: check_schema_fingerprint(): can't compute schema fingerprint.\n");
+			goto teardown;
+		}
+
+	hash_to_hex (hex, fingerprint);
+	*matches = strncmp (hex, expected_hex, HASH_HEX_LEN) == 0;
+	if (*matches)
+		goto teardown;
+
+	err = open_schema_db (&expected, structure_path);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: check_schema_fingerprint(): can't load structure file: %s\n", structure_path);
+			goto teardown;
+		}
+
+	// Structure files without fingerprint are compared the slow way.
+	if (expected_hex[0] == 0)
+		{
+			err = schema_fingerprint (&expected_fingerprint, expected);
+			if (err)
+				{
+					fprintf (stderr, "fingerprint.c: check_schema_fingerprint(): can't compute structure fingerprint.\n");
+					goto teardown;
+				}
+
+			*matches = fingerprint == expected_fingerprint;
+			if (*matches)
+				goto teardown;
+
+			hash_to_hex (expected_hex, expected_fingerprint);
+		}
+
+	printf ("Schema fingerprint %s doesn't match %s from %s:\n", hex, expected_hex, structure_path);
+
+	err = print_schema_differences (expected, conn, "missing", true);
+	if (!err)
+		err = print_schema_differences (conn, expected, "unexpected", false);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: check_schema_fingerprint(): can't compare schemas.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (expected) sqlite3_close (expected);
+	return err;
+}
+
+/*
+ * Reads the fingerprint recorded in the migrations table after the last
+ * migration. `fingerprint` is left empty if there is none.
+ */
+static int
+read_recorded_fingerprint (char fingerprint[HASH_HEX_LEN], sqlite3 *conn)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT fingerprint FROM migrations WHERE fingerprint IS NOT NULL ORDER BY name DESC LIMIT 1";
+
+	fingerprint[0] = 0;
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: read_recorded_fingerprint(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				snprintf (fingerprint, HASH_HEX_LEN, "%s", (const char *) sqlite3_column_text (stmt, 0));
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "fingerprint.c: read_recorded_fingerprint(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Without a structure file (like on servers which only get the database),
+ * checks the schema against the fingerprint recorded by the last migration,
+ * which catches changes made outside of migrations.
+ */
+static int
+check_recorded_fingerprint (bool matches[static 1], sqlite3 *conn)
+{
+	int err = 0;
+	uint64_t fingerprint = 0;
+	char hex[HASH_HEX_LEN] = {0};
+	char recorded[HASH_HEX_LEN] = {0};
+
+	err = read_recorded_fingerprint (recorded, conn);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: check_recorded_fingerprint(): can't read recorded fingerprint.\n");
+			goto teardown;
+		}
+
+	if (recorded[0] == 0)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: check_recorded_fingerprint(): no structure file and no fingerprint recorded in the migrations table.\n");
+			goto teardown;
+		}
+
+	err = schema_fingerprint (&fingerprint, conn);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: check_recorded_fingerprint(): can't compute schema fingerprint.\n");
+			goto teardown;
+		}
+
+	hash_to_hex (hex, fingerprint);
+	*matches = strncmp (hex, recorded, HASH_HEX_LEN) == 0;
+	if (!*matches)
+		printf ("Schema fingerprint %s doesn't match %s recorded by the last migration.\n", hex, recorded);
+
+	teardown:
+	return err;
+}
+
+/*
+ * Checks the database schema matches the structure file, or the migrations
+ * table if there is no structure file, without writing anything, so that it
+ * can run each time an application starts.
+ */
+int
+verify (options_t *options)
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	bool matches = false;
+	bool from_structure = access (options->structure, F_OK) == 0;
+	struct timespec start = {0};
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	int rc = sqlite3_open_v2 (options->database, &conn, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: verify(): can't open database: %s\n", options->database);
+			goto teardown;
+		}
+
+	if (from_structure)
+		err = check_schema_fingerprint (&matches, conn, options->structure);
+	else
+		err = check_recorded_fingerprint (&matches, conn);
+	if (err)
+		{
+			fprintf (stderr, "fingerprint.c: verify(): can't check schema fingerprint.\n");
+			goto teardown;
+		}
+
+	if (!matches)
+		{
+			err = 1;
+			fprintf (stderr, "fingerprint.c: verify(): database schema doesn't match %s.\n", from_structure ? "structure file" : "migrations table");
+			goto teardown;
+		}
+
+	printf ("Schema matches %s (checked in %.3fms).\n", from_structure ? options->structure : "migrations table", elapsed_since (&start) * 1000);
+
+	teardown:
+	if (conn) sqlite3_close (conn);
+	return err;
+}
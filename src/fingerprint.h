@@ -0,0 +1,16 @@
+#ifndef _FINGERPRINT_H_
+#define _FINGERPRINT_H_
+
+#include <sqlite3.h>
+#include <stdint.h>
+#include "main.h"
+#include "hash.h"
+
+#define FINGERPRINT_PREFIX "-- exodus schema fingerprint: "
+
+int schema_fingerprint (uint64_t fingerprint[static 1], sqlite3 *conn);
+int read_structure_fingerprint (char fingerprint[HASH_HEX_LEN], const char structure_path[MAX_PATH_LEN]);
+int check_schema_fingerprint (bool matches[static 1], sqlite3 *conn, const char structure_path[MAX_PATH_LEN]);
+int verify (options_t *options);
+
+#endif
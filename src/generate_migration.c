@@ -1,19 +1,23 @@
+#include <ctype.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "main.h"
 #include "database.h"
+#include "estimate.h"
 
 #define ROTATE_TEMPLATE "\n\
 ALTER TABLE %s RENAME TO %s_old;\n\
 \n\
 %s;\n\
 \n\
-INSERT INTO %s SELECT * FROM %s_old ORDER BY rowid;\n\
+INSERT INTO %s%s SELECT %s FROM %s_old ORDER BY %s;\n\
 DROP TABLE %s_old;\n\
 \n"
 
@@ -22,6 +26,29 @@ typedef struct {
 	char sql[MAX_OBJECT_LEN];
 } database_object_t;
 
+typedef struct {
+	char type[16];
+	char name[MAX_NAME_LEN];
+} schema_entry_t;
+
+typedef struct {
+	char name[MAX_NAME_LEN];
+	char *definition;
+	char *normalized;
+} column_definition_t;
+
+typedef struct {
+	column_definition_t *columns;
+	size_t columns_len;
+	char *constraints;
+	char *options;
+} table_definition_t;
+
+typedef struct {
+	char from[MAX_NAME_LEN];
+	char to[MAX_NAME_LEN];
+} column_rename_t;
+
 static int
 add_to_string (char *content[static 1], const char adding[static 1], size_t total_max)
 {
@@ -105,22 +132,28 @@ generate_filename (char filename[MAX_PATH_LEN], options_t *options)
 	return err;
 }
 
+/*
+ * Retrieves the SQL code of an object. `sql` is left NULL if it doesn't exist.
+ *
+ * Caller must free `sql`.
+ */
 static int
-find_table_sql (char *sql[static 1], const char table_name[MAX_NAME_LEN])
+find_object_sql_if_exists (sqlite3 *conn, char *sql[static 1], const char type[static 1], const char name[MAX_NAME_LEN])
 {
 	int err = 0;
 	sqlite3_stmt *stmt = NULL;
-	char query[BUFSIZ] = "SELECT sql FROM sqlite_schema WHERE type='table' AND name = ?";
+	char query[BUFSIZ] = "SELECT sql FROM sqlite_schema WHERE type = ? AND name = ?";
 
-	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
 	if (rc != SQLITE_OK)
 		{
 			err = 1;
-			fprintf (stderr, "generate_migration.c: find_table_sql(): error while preparing query : %s\n", sqlite3_errmsg (db));
+			fprintf (stderr, "generate_migration.c: find_object_sql_if_exists(): error while preparing query : %s\n", sqlite3_errmsg (conn));
 			goto teardown;
 		}
 
-	sqlite3_bind_text (stmt, 1, table_name, -1, NULL);
+	sqlite3_bind_text (stmt, 1, type, -1, NULL);
+	sqlite3_bind_text (stmt, 2, name, -1, NULL);
 
 	while (1)
 		{
@@ -132,7 +165,7 @@ find_table_sql (char *sql[static 1], const char table_name[MAX_NAME_LEN])
 					if (strnlen (code, MAX_OBJECT_LEN) > MAX_OBJECT_LEN - 1)
 						{
 							err = 1;
-							fprintf (stderr, "generate_migration.c: find_table_sql(): table code exceeds allowed size of %d bytes.\n", MAX_OBJECT_LEN);
+							fprintf (stderr, "generate_migration.c: find_object_sql_if_exists(): object code exceeds allowed size of %d bytes.\n", MAX_OBJECT_LEN);
 							goto teardown;
 						}
 
@@ -140,7 +173,7 @@ find_table_sql (char *sql[static 1], const char table_name[MAX_NAME_LEN])
 					if (!*sql)
 						{
 							err = 1;
-							fprintf (stderr, "generate_migration.c: find_table_sql(): out of memory.\n");
+							fprintf (stderr, "generate_migration.c: find_object_sql_if_exists(): out of memory.\n");
 							goto teardown;
 						}
 					snprintf (*sql, strlen (code) + 1, "%s", code);
@@ -150,15 +183,232 @@ find_table_sql (char *sql[static 1], const char table_name[MAX_NAME_LEN])
 			else
 				{
 					err = 1;
-					fprintf (stderr, "generate_migration.c: find_table_sql(): error while performing query : %s\n", sqlite3_errmsg (db));
+					fprintf (stderr, "generate_migration.c: find_object_sql_if_exists(): error while performing query : %s\n", sqlite3_errmsg (conn));
 					goto teardown;
 				}
 		}
 
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+static int
+find_object_sql (sqlite3 *conn, char *sql[static 1], const char type[static 1], const char name[MAX_NAME_LEN])
+{
+	int err = 0;
+
+	err = find_object_sql_if_exists (conn, sql, type, name);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: find_object_sql(): can't retrieve object's SQL code.\n");
+			goto teardown;
+		}
+
 	if (!*sql)
 		{
 			err = 1;
-			fprintf (stderr, "generate_migration.c: find_table_sql(): no such table: %s\n", table_name);
+			fprintf (stderr, "generate_migration.c: find_object_sql(): no such %s: %s\n", type, name);
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+static int
+is_without_rowid (bool without_rowid[static 1], const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT wr FROM pragma_table_list WHERE schema = 'main' AND name = ?";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: is_without_rowid(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, table_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*without_rowid = sqlite3_column_int (stmt, 0) != 0;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: is_without_rowid(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+/*
+ * Checks if the table has an INTEGER PRIMARY KEY, which makes it an alias
+ * for the rowid: in that case, rows keep their rowid when copied, and their
+ * physical order can't be changed.
+ */
+static int
+has_rowid_alias (bool has_alias[static 1], const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT count(*) = 1 AND sum(upper(type) = 'INTEGER') = 1 FROM pragma_table_info(?) WHERE pk > 0";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: has_rowid_alias(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, table_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*has_alias = sqlite3_column_int (stmt, 0) != 0;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: has_rowid_alias(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+/*
+ * Appends the key columns from the query results to the ORDER BY clause.
+ *
+ * The query must return the column name as first column, and optionally
+ * a boolean telling if the column is sorted in descending order as second
+ * column. `found` is set if at least one column was returned.
+ */
+static int
+collect_order_columns (char order[MAX_OBJECT_LEN], sqlite3_stmt *stmt, bool found[static 1])
+{
+	int err = 0;
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *column = (const char *) sqlite3_column_text (stmt, 0);
+					if (!column)
+						{
+							err = 1;
+							fprintf (stderr, "generate_migration.c: collect_order_columns(): index uses expressions, please provide a list of columns to --order-by instead.\n");
+							goto teardown;
+						}
+
+					bool desc = sqlite3_column_count (stmt) > 1 && sqlite3_column_int (stmt, 1);
+					size_t order_len = strnlen (order, MAX_OBJECT_LEN);
+					sqlite3_snprintf (MAX_OBJECT_LEN - order_len, order + order_len, "%s\"%w\"%s", *found ? ", " : "", column, desc ? " DESC" : "");
+					if (strnlen (order, MAX_OBJECT_LEN) >= MAX_OBJECT_LEN - 1)
+						{
+							err = 1;
+							fprintf (stderr, "generate_migration.c: collect_order_columns(): ORDER BY clause too long.\n");
+							goto teardown;
+						}
+
+					*found = true;
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: collect_order_columns(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+static int
+find_primary_key_order (char order[MAX_OBJECT_LEN], const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+	bool found = false;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT name FROM pragma_table_info(?) WHERE pk > 0 ORDER BY pk";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: find_primary_key_order(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, table_name, -1, NULL);
+
+	err = collect_order_columns (order, stmt, &found);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: find_primary_key_order(): can't retrieve primary key columns.\n");
+			goto teardown;
+		}
+
+	if (!found)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: find_primary_key_order(): no primary key found for table: %s\n", table_name);
+			goto teardown;
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+static int
+find_index_order (char order[MAX_OBJECT_LEN], bool found[static 1], const char table_name[MAX_NAME_LEN], const char index_name[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT x.name, x.desc FROM sqlite_schema AS s, pragma_index_xinfo(s.name) AS x WHERE s.type = 'index' AND s.name = ? AND s.tbl_name = ? AND x.key = 1 ORDER BY x.seqno";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: find_index_order(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, index_name, -1, NULL);
+	sqlite3_bind_text (stmt, 2, table_name, -1, NULL);
+
+	err = collect_order_columns (order, stmt, found);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: find_index_order(): can't retrieve index columns.\n");
 			goto teardown;
 		}
 
@@ -168,6 +418,77 @@ find_table_sql (char *sql[static 1], const char table_name[MAX_NAME_LEN])
 	return err;
 }
 
+/*
+ * Finds in which order rows should be copied to the new table.
+ *
+ * When `order_by` is provided, it's either the name of an index on the
+ * table, in which case we cluster rows following its key, or a list of
+ * columns used as is. Otherwise, WITHOUT ROWID tables are copied in
+ * primary key order, and other tables in rowid order. Inserting rows in
+ * the b-tree key order makes the insertion sequential, and leaves the
+ * pages of the new table clustered.
+ */
+static int
+find_copy_order (char order[MAX_OBJECT_LEN], const char table_name[MAX_NAME_LEN], const char order_by[static 1])
+{
+	int err = 0;
+	bool without_rowid = false;
+
+	err = is_without_rowid (&without_rowid, table_name);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: find_copy_order(): can't check if table has a rowid.\n");
+			goto teardown;
+		}
+
+	if (order_by[0] != 0)
+		{
+			bool has_alias = false;
+			if (!without_rowid)
+				{
+					err = has_rowid_alias (&has_alias, table_name);
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: find_copy_order(): can't check if table has an INTEGER PRIMARY KEY.\n");
+							goto teardown;
+						}
+				}
+
+			if (without_rowid || has_alias)
+				fprintf (stderr, "Warning: rows of %s are stored in primary key order, --order-by will only change the insertion order.\n", table_name);
+
+			bool found = false;
+			err = find_index_order (order, &found, table_name, order_by);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: find_copy_order(): can't retrieve index order.\n");
+					goto teardown;
+				}
+
+			if (!found)
+				snprintf (order, MAX_OBJECT_LEN, "%s", order_by);
+
+			goto teardown;
+		}
+
+	if (without_rowid)
+		{
+			err = find_primary_key_order (order, table_name);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: find_copy_order(): can't retrieve primary key order.\n");
+					goto teardown;
+				}
+
+			goto teardown;
+		}
+
+	snprintf (order, MAX_OBJECT_LEN, "rowid");
+
+	teardown:
+	return err;
+}
+
 static int
 find_triggers (database_object_t **triggers, const char table_name[MAX_NAME_LEN], size_t *len)
 {
@@ -468,13 +789,20 @@ write_drop_objects (char **content, database_object_t *triggers, size_t triggers
 	return err;
 }
 
+/*
+ * Writes the statements copying the table to a new one.
+ *
+ * `insert_columns` is the (parenthesized) list of columns to insert into in
+ * the new table, and `select_columns` the matching list of columns to read
+ * from the old one. Use an empty string and `*` to copy all columns as is.
+ */
 static int
-write_table_rotation (char **content, const char table_sql[static 1], const char table_name[static 1])
+write_table_rotation (char **content, const char table_sql[static 1], const char table_name[static 1], const char insert_columns[static 1], const char select_columns[static 1], const char order[static 1])
 {
 	int err = 0;
 
 	char rotation_statement[MAX_OBJECT_LEN] = {0};
-	int written = snprintf (rotation_statement, MAX_OBJECT_LEN, ROTATE_TEMPLATE, table_name, table_name, table_sql, table_name, table_name, table_name);
+	int written = snprintf (rotation_statement, MAX_OBJECT_LEN, ROTATE_TEMPLATE, table_name, table_name, table_sql, table_name, insert_columns, select_columns, table_name, order, table_name);
 	if (written >= MAX_OBJECT_LEN)
 		{
 			err = 1;
@@ -557,14 +885,26 @@ write_recreate_objects (char **content, database_object_t *triggers, size_t trig
 }
 
 static int
-recreate_table_migration (char **content, const char table_name[MAX_NAME_LEN])
+recreate_table_migration (char **content, const char table_name[MAX_NAME_LEN], const char order_by[MAX_NAME_LEN])
 {
 	int err = 0;
 	char *table_sql = NULL;
+	char order[MAX_OBJECT_LEN] = {0};
 	database_object_t *triggers = NULL;
 	database_object_t *views = NULL;
 	database_object_t *indexes = NULL;
 
+	// The marker lets `migrate` know it will have to copy this table.
+	char marker[MAX_NAME_LEN + 32] = {0};
+	snprintf (marker, MAX_NAME_LEN + 32, "%s%s\n", RECREATE_MARKER, table_name);
+
+	err = add_to_string (content, marker, MAX_FILE_LEN);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_migration(): can't add recreate marker.\n");
+			goto teardown;
+		}
+
 	// We need legacy_alter_table to prevent renaming foreign keys when renaming the table
 	const char *pragmas = "PRAGMA foreign_keys = OFF;\nPRAGMA legacy_alter_table = ON;\n";
 
@@ -575,13 +915,20 @@ recreate_table_migration (char **content, const char table_name[MAX_NAME_LEN])
 			goto teardown;
 		}
 
-	err = find_table_sql (&table_sql, table_name);
+	err = find_object_sql (db, &table_sql, "table", table_name);
 	if (err)
 		{
 			fprintf (stderr, "generate_migration.c: recreate_table_migration(): can't retrieve table's SQL code.\n");
 			goto teardown;
 		}
 
+	err = find_copy_order (order, table_name, order_by);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_migration(): can't find in which order to copy rows.\n");
+			goto teardown;
+		}
+
 	size_t triggers_len = 0;
 	err = find_triggers (&triggers, table_name, &triggers_len);
 	if (err)
@@ -613,7 +960,7 @@ recreate_table_migration (char **content, const char table_name[MAX_NAME_LEN])
 			goto teardown;
 		}
 
-	err = write_table_rotation (content, table_sql, table_name);
+	err = write_table_rotation (content, table_sql, table_name, "", "*", order);
 	if (err)
 		{
 			fprintf (stderr, "generate_migration.c: recreate_table_migration(): can't write table rotation statements.\n");
@@ -635,35 +982,1506 @@ recreate_table_migration (char **content, const char table_name[MAX_NAME_LEN])
 	return err;
 }
 
-static int
-raw_migration (char **content)
+/*
+ * Finds where the quoted identifier or string starting at `start` ends.
+ *
+ * Returns the position of the closing quote, or of the end of the string if
+ * it's not closed.
+ */
+static size_t
+skip_quoted (const char sql[static 1], size_t start)
 {
-	int err = 0;
+	char closing = sql[start] == '[' ? ']' : sql[start];
+	size_t i = start + 1;
 
-	const char *raw_content = "-- Your SQL\n";
-
-	*content = calloc (1, strlen (raw_content) + 1);
-	if (!*content)
+	while (sql[i])
 		{
-			err = 1;
-			fprintf (stderr, "generate_migration.c: raw_migration(): can't allocate memory.\n");
-			goto teardown;
+			if (sql[i] == closing)
+				{
+					if (closing != ']' && sql[i + 1] == closing)
+						{
+							i += 2;
+							continue;
+						}
+
+					break;
+				}
+
+			i++;
 		}
 
-	snprintf (*content, strlen (raw_content) + 1, "%s", raw_content);
+	return i;
+}
 
-	teardown:
-	return err;
+static bool
+is_quote (char c)
+{
+	return c == '\'' || c == '"' || c == '`' || c == '[';
 }
 
-static int
-save_migration (char *content, const char filename[MAX_PATH_LEN])
+/*
+ * Replaces comments with spaces.
+ *
+ * Caller must free the result.
+ */
+static char *
+strip_sql_comments (const char sql[static 1])
 {
-	int err = 0;
-	FILE *file = NULL;
+	char *stripped = strdup (sql);
+	if (!stripped)
+		return NULL;
 
-	file = fopen (filename, "w");
-	if (!file)
+	for (size_t i = 0; stripped[i]; i++)
+		{
+			if (is_quote (stripped[i]))
+				{
+					i = skip_quoted (stripped, i);
+					if (!stripped[i])
+						break;
+
+					continue;
+				}
+
+			if (stripped[i] == '-' && stripped[i + 1] == '-')
+				{
+					while (stripped[i] && stripped[i] != '\n')
+						stripped[i++] = ' ';
+
+					if (!stripped[i])
+						break;
+
+					continue;
+				}
+
+			if (stripped[i] == '/' && stripped[i + 1] == '*')
+				{
+					while (stripped[i] && !(stripped[i] == '*' && stripped[i + 1] == '/'))
+						stripped[i++] = ' ';
+
+					if (!stripped[i])
+						break;
+
+					stripped[i++] = ' ';
+					stripped[i] = ' ';
+				}
+		}
+
+	return stripped;
+}
+
+/*
+ * Normalizes SQL code so two definitions can be compared: comments are
+ * removed, whitespace is collapsed and dropped around punctuation, and
+ * everything out of quotes is lowercased.
+ *
+ * Caller must free the result.
+ */
+static char *
+normalize_sql (const char sql[static 1])
+{
+	char *stripped = strip_sql_comments (sql);
+	if (!stripped)
+		return NULL;
+
+	char *normalized = calloc (1, strlen (stripped) + 1);
+	if (!normalized)
+		{
+			free (stripped);
+			return NULL;
+		}
+
+	size_t len = 0;
+	bool pending_space = false;
+
+	for (size_t i = 0; stripped[i]; i++)
+		{
+			char c = stripped[i];
+
+			if (isspace ((unsigned char) c))
+				{
+					pending_space = true;
+					continue;
+				}
+
+			if (pending_space && len > 0 && !strchr ("(),;", c) && !strchr ("(,", normalized[len - 1]))
+				normalized[len++] = ' ';
+
+			pending_space = false;
+
+			if (is_quote (c))
+				{
+					size_t end = skip_quoted (stripped, i);
+					size_t quoted_len = stripped[end] ? end - i + 1 : end - i;
+					memcpy (normalized + len, stripped + i, quoted_len);
+					len += quoted_len;
+					i += quoted_len - 1;
+					continue;
+				}
+
+			normalized[len++] = (char) tolower ((unsigned char) c);
+		}
+
+	while (len > 0 && (normalized[len - 1] == ';' || normalized[len - 1] == ' '))
+		len--;
+
+	normalized[len] = 0;
+
+	free (stripped);
+	return normalized;
+}
+
+static void
+free_table_definition (table_definition_t definition[static 1])
+{
+	for (size_t i = 0; i < definition->columns_len; i++)
+		{
+			if (definition->columns[i].definition) free (definition->columns[i].definition);
+			if (definition->columns[i].normalized) free (definition->columns[i].normalized);
+		}
+
+	if (definition->columns) free (definition->columns);
+	if (definition->constraints) free (definition->constraints);
+	if (definition->options) free (definition->options);
+	*definition = (table_definition_t) {0};
+}
+
+/*
+ * Adds a column definition or a table constraint found in the body of a
+ * CREATE TABLE statement.
+ */
+static int
+add_table_segment (table_definition_t definition[static 1], const char segment[static 1], size_t segment_len)
+{
+	int err = 0;
+	char *text = NULL;
+	char name[MAX_NAME_LEN] = {0};
+	size_t name_end = 0;
+
+	while (segment_len > 0 && isspace ((unsigned char) *segment))
+		{
+			segment++;
+			segment_len--;
+		}
+
+	while (segment_len > 0 && isspace ((unsigned char) segment[segment_len - 1]))
+		segment_len--;
+
+	text = strndup (segment, segment_len);
+	if (!text)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: add_table_segment(): out of memory.\n");
+			goto teardown;
+		}
+
+	bool quoted = is_quote (text[0]);
+	if (quoted)
+		{
+			name_end = skip_quoted (text, 0);
+			snprintf (name, MAX_NAME_LEN, "%.*s", (int) (name_end - 1), text + 1);
+			if (text[name_end])
+				name_end++;
+		}
+	else
+		{
+			while (text[name_end] && (isalnum ((unsigned char) text[name_end]) || text[name_end] == '_' || text[name_end] == '$' || (unsigned char) text[name_end] >= 0x80))
+				name_end++;
+
+			snprintf (name, MAX_NAME_LEN, "%.*s", (int) name_end, text);
+		}
+
+	const char *constraint_keywords[] = { "constraint", "primary", "unique", "check", "foreign" };
+	for (size_t i = 0; !quoted && i < sizeof (constraint_keywords) / sizeof (constraint_keywords[0]); i++)
+		{
+			if (sqlite3_stricmp (name, constraint_keywords[i]) != 0)
+				continue;
+
+			char *normalized = normalize_sql (text);
+			if (!normalized)
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: add_table_segment(): out of memory.\n");
+					goto teardown;
+				}
+
+			err = add_to_string (&definition->constraints, normalized, MAX_FILE_LEN);
+			if (!err)
+				err = add_to_string (&definition->constraints, ",", MAX_FILE_LEN);
+
+			free (normalized);
+
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: add_table_segment(): can't add table constraint.\n");
+					goto teardown;
+				}
+
+			goto teardown;
+		}
+
+	definition->columns_len++;
+	definition->columns = realloc (definition->columns, sizeof (column_definition_t) * definition->columns_len);
+	if (!definition->columns)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: add_table_segment(): out of memory.\n");
+			goto teardown;
+		}
+
+	column_definition_t *column = &definition->columns[definition->columns_len - 1];
+	*column = (column_definition_t) {0};
+	snprintf (column->name, MAX_NAME_LEN, "%s", name);
+	column->normalized = normalize_sql (text + name_end);
+	column->definition = text;
+	text = NULL;
+
+	if (!column->normalized)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: add_table_segment(): out of memory.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (text) free (text);
+	return err;
+}
+
+/*
+ * Splits a CREATE TABLE statement into its column definitions, table
+ * constraints and table options.
+ *
+ * Caller must call `free_table_definition()` on the definition.
+ */
+static int
+parse_table_definition (table_definition_t definition[static 1], const char sql[static 1])
+{
+	int err = 0;
+	char *stripped = strip_sql_comments (sql);
+	if (!stripped)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: parse_table_definition(): out of memory.\n");
+			goto teardown;
+		}
+
+	size_t i = 0;
+	while (stripped[i] && stripped[i] != '(')
+		{
+			if (is_quote (stripped[i]))
+				{
+					i = skip_quoted (stripped, i);
+					if (!stripped[i])
+						break;
+				}
+
+			i++;
+		}
+
+	size_t depth = 0;
+	size_t segment_start = i + 1;
+
+	for (; stripped[i]; i++)
+		{
+			if (is_quote (stripped[i]))
+				{
+					i = skip_quoted (stripped, i);
+					if (!stripped[i])
+						break;
+
+					continue;
+				}
+
+			if (stripped[i] == '(')
+				depth++;
+			else if ((stripped[i] == ',' && depth == 1) || (stripped[i] == ')' && depth == 1))
+				{
+					err = add_table_segment (definition, stripped + segment_start, i - segment_start);
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: parse_table_definition(): can't parse table body.\n");
+							goto teardown;
+						}
+
+					segment_start = i + 1;
+
+					if (stripped[i] == ')')
+						{
+							depth = 0;
+							i++;
+							break;
+						}
+				}
+			else if (stripped[i] == ')')
+				depth--;
+		}
+
+	if (depth != 0 || definition->columns_len == 0)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: parse_table_definition(): can't parse table definition: %s\n", sql);
+			goto teardown;
+		}
+
+	definition->options = normalize_sql (stripped + i);
+	if (!definition->options)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: parse_table_definition(): out of memory.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (stripped) free (stripped);
+	return err;
+}
+
+/*
+ * Lists the objects of a database schema, in creation order.
+ *
+ * Internal objects, shadow tables and the migrations table are ignored.
+ */
+static int
+list_schema (sqlite3 *conn, schema_entry_t **entries, size_t len[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT type, name FROM sqlite_schema WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\' AND name != 'migrations' AND name NOT IN (SELECT name FROM pragma_table_list WHERE type = 'shadow') ORDER BY rowid";
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: list_schema(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					(*len)++;
+					*entries = realloc (*entries, sizeof (schema_entry_t) * *len);
+					if (!*entries)
+						{
+							err = 1;
+							fprintf (stderr, "generate_migration.c: list_schema(): out of memory.\n");
+							goto teardown;
+						}
+
+					const char *type = (const char *) sqlite3_column_text (stmt, 0);
+					const char *name = (const char *) sqlite3_column_text (stmt, 1);
+
+					if (strnlen (name, MAX_NAME_LEN) > MAX_NAME_LEN - 1)
+						{
+							err = 1;
+							fprintf (stderr, "generate_migration.c: list_schema(): object name exceeds maximum length authorized (%d bytes)\n", MAX_NAME_LEN);
+							goto teardown;
+						}
+
+					snprintf ((*entries)[*len - 1].type, sizeof ((*entries)[*len - 1].type), "%s", type);
+					snprintf ((*entries)[*len - 1].name, MAX_NAME_LEN, "%s", name);
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: list_schema(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+static bool
+has_entry (const schema_entry_t *entries, size_t len, const char type[static 1], const char name[static 1])
+{
+	for (size_t i = 0; i < len; i++)
+		if (strncmp (entries[i].type, type, sizeof (entries[i].type)) == 0 && sqlite3_stricmp (entries[i].name, name) == 0)
+			return true;
+
+	return false;
+}
+
+static int
+add_entry (schema_entry_t **entries, size_t len[static 1], const char type[static 1], const char name[static 1])
+{
+	int err = 0;
+
+	(*len)++;
+	*entries = realloc (*entries, sizeof (schema_entry_t) * *len);
+	if (!*entries)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: add_entry(): out of memory.\n");
+			goto teardown;
+		}
+
+	snprintf ((*entries)[*len - 1].type, sizeof ((*entries)[*len - 1].type), "%s", type);
+	snprintf ((*entries)[*len - 1].name, MAX_NAME_LEN, "%s", name);
+
+	teardown:
+	return err;
+}
+
+/*
+ * Compares the normalized code of an object in two databases.
+ *
+ * `same` is false if the object is missing from one of them.
+ */
+static int
+compare_object_sql (bool same[static 1], sqlite3 *a, sqlite3 *b, const char type[static 1], const char name[MAX_NAME_LEN])
+{
+	int err = 0;
+	char *sql_a = NULL;
+	char *sql_b = NULL;
+	char *normalized_a = NULL;
+	char *normalized_b = NULL;
+
+	*same = false;
+
+	err = find_object_sql (a, &sql_a, type, name);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: compare_object_sql(): can't retrieve code of %s %s.\n", type, name);
+			goto teardown;
+		}
+
+	err = find_object_sql_if_exists (b, &sql_b, type, name);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: compare_object_sql(): can't retrieve code of %s %s.\n", type, name);
+			goto teardown;
+		}
+
+	if (!sql_b)
+		goto teardown;
+
+	normalized_a = normalize_sql (sql_a);
+	normalized_b = normalize_sql (sql_b);
+	if (!normalized_a || !normalized_b)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: compare_object_sql(): out of memory.\n");
+			goto teardown;
+		}
+
+	*same = strcmp (normalized_a, normalized_b) == 0;
+
+	teardown:
+	if (sql_a) free (sql_a);
+	if (sql_b) free (sql_b);
+	if (normalized_a) free (normalized_a);
+	if (normalized_b) free (normalized_b);
+	return err;
+}
+
+/*
+ * Adds a statement to a section of the migration, after making sure it
+ * applies to the scratch database, which follows the migration being built.
+ */
+static int
+emit_statement (char **section, sqlite3 *scratch, const char statement[static 1])
+{
+	int err = 0;
+
+	err = db_exec_on (scratch, statement);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: emit_statement(): generated statement does not apply: %s\n", statement);
+			goto teardown;
+		}
+
+	err = add_to_string (section, statement, MAX_FILE_LEN);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: emit_statement(): can't add statement to migration.\n");
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+static int
+add_formatted (char **section, const char *format, ...)
+{
+	int err = 0;
+	va_list args;
+
+	va_start (args, format);
+	char *statement = sqlite3_vmprintf (format, args);
+	va_end (args);
+
+	if (!statement)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: add_formatted(): out of memory.\n");
+			goto teardown;
+		}
+
+	err = add_to_string (section, statement, MAX_FILE_LEN);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: add_formatted(): can't add statement.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (statement) sqlite3_free (statement);
+	return err;
+}
+
+/*
+ * Formats an identifier for a statement, quoting it only when needed.
+ *
+ * SQLite keeps the quoting used in ALTER TABLE statements in the altered
+ * table definition, so we avoid adding quotes which are not in the desired
+ * definition.
+ */
+static void
+format_identifier (char formatted[MAX_NAME_LEN * 2 + 3], const char name[MAX_NAME_LEN])
+{
+	bool bare = name[0] != 0 && !isdigit ((unsigned char) name[0]);
+	for (size_t i = 0; bare && name[i]; i++)
+		if (!isalnum ((unsigned char) name[i]) && name[i] != '_')
+			bare = false;
+
+	if (bare && sqlite3_keyword_check (name, (int) strlen (name)))
+		bare = false;
+
+	if (bare)
+		snprintf (formatted, MAX_NAME_LEN * 2 + 3, "%s", name);
+	else
+		sqlite3_snprintf (MAX_NAME_LEN * 2 + 3, formatted, "\"%w\"", name);
+}
+
+/*
+ * Renamings are guessed from the position and definition of columns, so
+ * they're commented for review in the migration.
+ */
+static int
+add_rename_comments (char **section, const char table_name[MAX_NAME_LEN], const column_rename_t *renames, size_t renames_len)
+{
+	int err = 0;
+
+	for (size_t i = 0; i < renames_len; i++)
+		{
+			err = add_formatted (section, "-- Guessed renaming of %s.%s to %s (same definition and position): if %s is a new column, %s must be dropped instead.\n", table_name, renames[i].from, renames[i].to, renames[i].to, renames[i].from);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: add_rename_comments(): can't add comment.\n");
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Finds the ALTER TABLE statements turning the current table definition into
+ * the desired one, if there are some.
+ *
+ * Columns can be added at the end of the table, dropped or renamed (when a
+ * column is replaced, at the same position, with one having the same
+ * definition, which is only a guess). Any other change, like modifying a
+ * column definition, a table constraint or reordering columns, requires
+ * recreating the table, in which case `alterable` is false. Renamed columns are returned in any case, so
+ * that their data can be copied if the table is recreated.
+ */
+static int
+plan_table_alteration (char **alters, bool alterable[static 1], column_rename_t **renames, size_t renames_len[static 1], const char table_name[MAX_NAME_LEN], const char current_sql[static 1], const char desired_sql[static 1])
+{
+	int err = 0;
+	table_definition_t current = {0};
+	table_definition_t desired = {0};
+	ssize_t *matches = NULL;
+	bool *matched = NULL;
+
+	*alterable = false;
+
+	err = parse_table_definition (&current, current_sql);
+	if (!err)
+		err = parse_table_definition (&desired, desired_sql);
+
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: plan_table_alteration(): can't parse definitions of table %s.\n", table_name);
+			goto teardown;
+		}
+
+	matches = calloc (current.columns_len, sizeof (ssize_t));
+	matched = calloc (desired.columns_len, sizeof (bool));
+	if (!matches || !matched)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: plan_table_alteration(): out of memory.\n");
+			goto teardown;
+		}
+
+	bool same_table = strcmp (current.options, desired.options) == 0;
+	if (same_table && (current.constraints || desired.constraints))
+		same_table = current.constraints && desired.constraints && strcmp (current.constraints, desired.constraints) == 0;
+
+	for (size_t i = 0; i < current.columns_len; i++)
+		{
+			matches[i] = -1;
+
+			for (size_t j = 0; j < desired.columns_len; j++)
+				{
+					if (sqlite3_stricmp (current.columns[i].name, desired.columns[j].name) != 0)
+						continue;
+
+					if (strcmp (current.columns[i].normalized, desired.columns[j].normalized) != 0)
+						same_table = false;
+
+					matches[i] = (ssize_t) j;
+					matched[j] = true;
+				}
+		}
+
+	for (size_t i = 0; i < current.columns_len; i++)
+		{
+			if (matches[i] != -1 || i >= desired.columns_len || matched[i])
+				continue;
+
+			if (strcmp (current.columns[i].normalized, desired.columns[i].normalized) != 0)
+				continue;
+
+			matches[i] = (ssize_t) i;
+			matched[i] = true;
+
+			(*renames_len)++;
+			*renames = realloc (*renames, sizeof (column_rename_t) * *renames_len);
+			if (!*renames)
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: plan_table_alteration(): out of memory.\n");
+					goto teardown;
+				}
+
+			snprintf ((*renames)[*renames_len - 1].from, MAX_NAME_LEN, "%s", current.columns[i].name);
+			snprintf ((*renames)[*renames_len - 1].to, MAX_NAME_LEN, "%s", desired.columns[i].name);
+			fprintf (stderr, "Warning: guessed that column %s.%s is renamed %s, as a column with the same definition replaces it, please review the migration.\n", table_name, current.columns[i].name, desired.columns[i].name);
+		}
+
+	if (!same_table)
+		goto teardown;
+
+	// Kept columns must stay in the same order, and new ones must be at the end.
+	size_t position = 0;
+	for (size_t i = 0; i < current.columns_len; i++)
+		{
+			if (matches[i] == -1)
+				continue;
+
+			if (matches[i] != (ssize_t) position)
+				goto teardown;
+
+			position++;
+		}
+
+	err = add_rename_comments (alters, table_name, *renames, *renames_len);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: plan_table_alteration(): can't comment column renamings.\n");
+			goto teardown;
+		}
+
+	for (size_t i = 0; i < *renames_len; i++)
+		{
+			char new_name[MAX_NAME_LEN * 2 + 3] = {0};
+			format_identifier (new_name, (*renames)[i].to);
+
+			err = add_formatted (alters, "ALTER TABLE \"%w\" RENAME COLUMN \"%w\" TO %s;\n", table_name, (*renames)[i].from, new_name);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: plan_table_alteration(): can't add column renaming.\n");
+					goto teardown;
+				}
+		}
+
+	for (size_t i = 0; i < current.columns_len; i++)
+		{
+			if (matches[i] != -1)
+				continue;
+
+			err = add_formatted (alters, "ALTER TABLE \"%w\" DROP COLUMN \"%w\";\n", table_name, current.columns[i].name);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: plan_table_alteration(): can't add column removal.\n");
+					goto teardown;
+				}
+		}
+
+	for (size_t i = position; i < desired.columns_len; i++)
+		{
+			err = add_formatted (alters, "ALTER TABLE \"%w\" ADD COLUMN %s;\n", table_name, desired.columns[i].definition);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: plan_table_alteration(): can't add column addition.\n");
+					goto teardown;
+				}
+		}
+
+	*alterable = true;
+
+	teardown:
+	free_table_definition (&current);
+	free_table_definition (&desired);
+	if (matches) free (matches);
+	if (matched) free (matched);
+	return err;
+}
+
+/*
+ * Tries to migrate a table with ALTER TABLE statements.
+ *
+ * The statements are checked against the scratch database: they must apply,
+ * and produce the desired table definition. Otherwise, `altered` is false and
+ * the table needs to be recreated.
+ */
+static int
+try_table_alteration (char **tables, bool altered[static 1], column_rename_t **renames, size_t renames_len[static 1], sqlite3 *scratch, sqlite3 *desired, const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+	char *current_sql = NULL;
+	char *desired_sql = NULL;
+	char *alters = NULL;
+	bool alterable = false;
+	bool in_savepoint = false;
+
+	*altered = false;
+
+	err = find_object_sql (db, &current_sql, "table", table_name);
+	if (!err)
+		err = find_object_sql (desired, &desired_sql, "table", table_name);
+
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: try_table_alteration(): can't retrieve definitions of table %s.\n", table_name);
+			goto teardown;
+		}
+
+	err = plan_table_alteration (&alters, &alterable, renames, renames_len, table_name, current_sql, desired_sql);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: try_table_alteration(): can't plan alteration of table %s.\n", table_name);
+			goto teardown;
+		}
+
+	if (!alterable)
+		goto teardown;
+
+	if (!alters)
+		{
+			*altered = true;
+			printf ("Table %s only differs in formatting, leaving it as is.\n", table_name);
+			goto teardown;
+		}
+
+	err = db_exec_on (scratch, "SAVEPOINT exodus_diff");
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: try_table_alteration(): can't start savepoint.\n");
+			goto teardown;
+		}
+
+	in_savepoint = true;
+
+	// Failing is an expected outcome here, so we don't use db_exec_on(), which reports errors.
+	if (sqlite3_exec (scratch, alters, NULL, NULL, NULL) == SQLITE_OK)
+		{
+			err = compare_object_sql (altered, scratch, desired, "table", table_name);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: try_table_alteration(): can't compare altered table.\n");
+					goto teardown;
+				}
+		}
+
+	if (*altered)
+		{
+			err = add_to_string (tables, alters, MAX_FILE_LEN);
+			if (!err)
+				err = add_to_string (tables, "\n", MAX_FILE_LEN);
+
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: try_table_alteration(): can't add alterations.\n");
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (in_savepoint)
+		{
+			int savepoint_err = db_exec_on (scratch, *altered ? "RELEASE exodus_diff" : "ROLLBACK TO exodus_diff; RELEASE exodus_diff");
+			if (savepoint_err)
+				{
+					err = savepoint_err;
+					fprintf (stderr, "generate_migration.c: try_table_alteration(): can't end savepoint.\n");
+				}
+		}
+
+	if (current_sql) free (current_sql);
+	if (desired_sql) free (desired_sql);
+	if (alters) free (alters);
+	return err;
+}
+
+/*
+ * Builds the lists of columns to copy when recreating a table: columns which
+ * exist in both tables, or which are renamed. Generated columns are ignored.
+ */
+static int
+find_copy_columns (char **insert_columns, char **select_columns, sqlite3 *desired, const char table_name[MAX_NAME_LEN], const column_rename_t *renames, size_t renames_len)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT name FROM pragma_table_xinfo(?) WHERE hidden NOT IN (2, 3)";
+	bool first = true;
+
+	int rc = sqlite3_prepare_v2 (desired, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: find_copy_columns(): error while preparing query: %s\n", sqlite3_errmsg (desired));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, table_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *name = (const char *) sqlite3_column_text (stmt, 0);
+					const char *source = NULL;
+
+					for (size_t i = 0; i < renames_len; i++)
+						if (sqlite3_stricmp (renames[i].to, name) == 0)
+							source = renames[i].from;
+
+					if (!source && sqlite3_table_column_metadata (db, "main", table_name, name, NULL, NULL, NULL, NULL, NULL) == SQLITE_OK)
+						source = name;
+
+					if (!source)
+						continue;
+
+					err = add_formatted (insert_columns, "%s\"%w\"", first ? "(" : ", ", name);
+					if (!err)
+						err = add_formatted (select_columns, "%s\"%w\"", first ? "" : ", ", source);
+
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: find_copy_columns(): can't add column.\n");
+							goto teardown;
+						}
+
+					first = false;
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: find_copy_columns(): error while performing query: %s\n", sqlite3_errmsg (desired));
+					goto teardown;
+				}
+		}
+
+	if (first)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: find_copy_columns(): no column to copy for table %s.\n", table_name);
+			goto teardown;
+		}
+
+	err = add_to_string (insert_columns, ")", MAX_FILE_LEN);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: find_copy_columns(): can't close columns list.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Recreates a table with its desired definition, copying the data of the
+ * columns it keeps.
+ *
+ * Triggers, views and indexes using that table are dropped (unless they
+ * already are), and added to `rebuilt` so that they are recreated from the
+ * desired schema.
+ */
+static int
+recreate_table_from_desired (char **tables, schema_entry_t **rebuilt, size_t rebuilt_len[static 1], sqlite3 *scratch, sqlite3 *desired, const char table_name[MAX_NAME_LEN], const column_rename_t *renames, size_t renames_len)
+{
+	int err = 0;
+	char *desired_sql = NULL;
+	char *insert_columns = NULL;
+	char *select_columns = NULL;
+	char *rotation = NULL;
+	char order[MAX_OBJECT_LEN] = {0};
+	database_object_t *triggers = NULL;
+	database_object_t *views = NULL;
+	database_object_t *indexes = NULL;
+	size_t triggers_len = 0;
+	size_t views_len = 0;
+	size_t indexes_len = 0;
+
+	err = find_object_sql (desired, &desired_sql, "table", table_name);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't retrieve desired table's SQL code.\n");
+			goto teardown;
+		}
+
+	err = find_copy_columns (&insert_columns, &select_columns, desired, table_name, renames, renames_len);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't find columns to copy.\n");
+			goto teardown;
+		}
+
+	err = find_copy_order (order, table_name, "");
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't find in which order to copy rows.\n");
+			goto teardown;
+		}
+
+	err = find_triggers (&triggers, table_name, &triggers_len);
+	if (!err)
+		err = find_views (&views, table_name, &views_len);
+	if (!err)
+		err = find_indexes (&indexes, table_name, &indexes_len);
+
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't retrieve objects using the table.\n");
+			goto teardown;
+		}
+
+	struct { database_object_t *objects; size_t len; const char *type; const char *keyword; } dependents[] = {
+		{ triggers, triggers_len, "trigger", "TRIGGER" },
+		{ views, views_len, "view", "VIEW" },
+		{ indexes, indexes_len, "index", "INDEX" },
+	};
+
+	for (size_t i = 0; i < sizeof (dependents) / sizeof (dependents[0]); i++)
+		{
+			for (size_t j = 0; j < dependents[i].len; j++)
+				{
+					if (has_entry (*rebuilt, *rebuilt_len, dependents[i].type, dependents[i].objects[j].name))
+						continue;
+
+					char *drop = sqlite3_mprintf ("DROP %s IF EXISTS \"%w\";\n", dependents[i].keyword, dependents[i].objects[j].name);
+					if (!drop)
+						{
+							err = 1;
+							fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): out of memory.\n");
+							goto teardown;
+						}
+
+					err = emit_statement (tables, scratch, drop);
+					sqlite3_free (drop);
+
+					if (!err)
+						err = add_entry (rebuilt, rebuilt_len, dependents[i].type, dependents[i].objects[j].name);
+
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't drop %s %s.\n", dependents[i].type, dependents[i].objects[j].name);
+							goto teardown;
+						}
+				}
+		}
+
+	err = add_rename_comments (tables, table_name, renames, renames_len);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't comment column renamings.\n");
+			goto teardown;
+		}
+
+	err = write_table_rotation (&rotation, desired_sql, table_name, insert_columns, select_columns, order);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't write table rotation statements.\n");
+			goto teardown;
+		}
+
+	// We need legacy_alter_table to prevent renaming foreign keys when renaming the table
+	err = emit_statement (tables, scratch, "PRAGMA legacy_alter_table = ON;\n");
+	if (!err)
+		err = emit_statement (tables, scratch, rotation);
+	if (!err)
+		err = emit_statement (tables, scratch, "PRAGMA legacy_alter_table = OFF;\n\n");
+
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: recreate_table_from_desired(): can't add table rotation.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (desired_sql) free (desired_sql);
+	if (insert_columns) free (insert_columns);
+	if (select_columns) free (select_columns);
+	if (rotation) free (rotation);
+	if (triggers) free (triggers);
+	if (views) free (views);
+	if (indexes) free (indexes);
+	return err;
+}
+
+/*
+ * Checks the migration turns the current schema into the desired one, and
+ * warns about every object which doesn't match.
+ */
+static int
+verify_diff_result (sqlite3 *scratch, sqlite3 *desired)
+{
+	int err = 0;
+	schema_entry_t *result_entries = NULL;
+	schema_entry_t *desired_entries = NULL;
+	size_t result_len = 0;
+	size_t desired_len = 0;
+
+	err = list_schema (scratch, &result_entries, &result_len);
+	if (!err)
+		err = list_schema (desired, &desired_entries, &desired_len);
+
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: verify_diff_result(): can't list schemas.\n");
+			goto teardown;
+		}
+
+	for (size_t i = 0; i < desired_len; i++)
+		{
+			bool same = false;
+
+			if (has_entry (result_entries, result_len, desired_entries[i].type, desired_entries[i].name))
+				{
+					err = compare_object_sql (&same, desired, scratch, desired_entries[i].type, desired_entries[i].name);
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: verify_diff_result(): can't compare %s %s.\n", desired_entries[i].type, desired_entries[i].name);
+							goto teardown;
+						}
+				}
+
+			if (!same)
+				fprintf (stderr, "Warning: %s %s won't exactly match the desired schema, please review the migration.\n", desired_entries[i].type, desired_entries[i].name);
+		}
+
+	for (size_t i = 0; i < result_len; i++)
+		if (!has_entry (desired_entries, desired_len, result_entries[i].type, result_entries[i].name))
+			fprintf (stderr, "Warning: %s %s is not in the desired schema but will remain, please review the migration.\n", result_entries[i].type, result_entries[i].name);
+
+	teardown:
+	if (result_entries) free (result_entries);
+	if (desired_entries) free (desired_entries);
+	return err;
+}
+
+/*
+ * Generates the cheapest migration turning the current schema into the one
+ * described in the `desired_path` SQL file.
+ *
+ * Triggers, views and indexes which changed are dropped and recreated, tables
+ * are altered when SQLite supports it, and recreated otherwise. Every
+ * statement is applied on a scratch copy of the current schema as the
+ * migration is built, which tells if an alteration works, and allows to
+ * verify the result. A changed virtual table is an error, since its data
+ * can only be migrated manually.
+ */
+static int
+diff_migration (char **content, schema_entry_t **recreated, size_t recreated_len[static 1], const char desired_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3 *desired = NULL;
+	sqlite3 *scratch = NULL;
+	schema_entry_t *current_entries = NULL;
+	schema_entry_t *desired_entries = NULL;
+	schema_entry_t *rebuilt = NULL;
+	size_t current_len = 0;
+	size_t desired_len = 0;
+	size_t rebuilt_len = 0;
+	char *drops = NULL;
+	char *tables = NULL;
+	char *creates = NULL;
+
+	err = open_schema_db (&desired, desired_path);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: diff_migration(): can't load desired schema.\n");
+			goto teardown;
+		}
+
+	err = sqlite3_open (":memory:", &scratch);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: diff_migration(): can't open scratch database.\n");
+			goto teardown;
+		}
+
+	err = copy_schema (db, scratch);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: diff_migration(): can't copy current schema to scratch database.\n");
+			goto teardown;
+		}
+
+	err = list_schema (db, &current_entries, &current_len);
+	if (!err)
+		err = list_schema (desired, &desired_entries, &desired_len);
+
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: diff_migration(): can't list schemas.\n");
+			goto teardown;
+		}
+
+	// Drop triggers, then views, then indexes which changed or were removed.
+	const char *dependent_types[] = { "trigger", "view", "index" };
+	const char *dependent_keywords[] = { "TRIGGER", "VIEW", "INDEX" };
+	for (size_t t = 0; t < sizeof (dependent_types) / sizeof (dependent_types[0]); t++)
+		{
+			for (size_t i = 0; i < current_len; i++)
+				{
+					if (strncmp (current_entries[i].type, dependent_types[t], sizeof (current_entries[i].type)) != 0)
+						continue;
+
+					bool same = false;
+					err = compare_object_sql (&same, db, desired, current_entries[i].type, current_entries[i].name);
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: diff_migration(): can't compare %s %s.\n", current_entries[i].type, current_entries[i].name);
+							goto teardown;
+						}
+
+					if (same)
+						continue;
+
+					char *drop = sqlite3_mprintf ("DROP %s IF EXISTS \"%w\";\n", dependent_keywords[t], current_entries[i].name);
+					if (!drop)
+						{
+							err = 1;
+							fprintf (stderr, "generate_migration.c: diff_migration(): out of memory.\n");
+							goto teardown;
+						}
+
+					err = emit_statement (&drops, scratch, drop);
+					sqlite3_free (drop);
+
+					if (!err)
+						err = add_entry (&rebuilt, &rebuilt_len, current_entries[i].type, current_entries[i].name);
+
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: diff_migration(): can't drop %s %s.\n", current_entries[i].type, current_entries[i].name);
+							goto teardown;
+						}
+				}
+		}
+
+	// Create new tables, and alter or recreate the ones which changed.
+	for (size_t i = 0; i < desired_len; i++)
+		{
+			if (strncmp (desired_entries[i].type, "table", sizeof (desired_entries[i].type)) != 0)
+				continue;
+
+			const char *name = desired_entries[i].name;
+
+			if (!has_entry (current_entries, current_len, "table", name))
+				{
+					char *table_sql = NULL;
+					err = find_object_sql (desired, &table_sql, "table", name);
+					if (!err)
+						err = add_formatted (&table_sql, ";\n\n");
+					if (!err)
+						err = emit_statement (&tables, scratch, table_sql);
+
+					if (table_sql) free (table_sql);
+
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: diff_migration(): can't create table %s.\n", name);
+							goto teardown;
+						}
+
+					continue;
+				}
+
+			bool same = false;
+			err = compare_object_sql (&same, db, desired, "table", name);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't compare table %s.\n", name);
+					goto teardown;
+				}
+
+			if (same)
+				continue;
+
+			char *table_sql = NULL;
+			err = find_object_sql (desired, &table_sql, "table", name);
+			bool is_virtual = !err && sqlite3_strnicmp (table_sql, "CREATE VIRTUAL", 14) == 0;
+			if (table_sql) free (table_sql);
+
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't retrieve SQL code of table %s.\n", name);
+					goto teardown;
+				}
+
+			if (is_virtual)
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: diff_migration(): virtual table %s changed, it must be migrated manually.\n", name);
+					goto teardown;
+				}
+
+			bool altered = false;
+			column_rename_t *renames = NULL;
+			size_t renames_len = 0;
+
+			err = try_table_alteration (&tables, &altered, &renames, &renames_len, scratch, desired, name);
+			if (!err && !altered)
+				{
+					err = recreate_table_from_desired (&tables, &rebuilt, &rebuilt_len, scratch, desired, name, renames, renames_len);
+					if (!err)
+						err = add_entry (recreated, recreated_len, "table", name);
+				}
+
+			if (renames) free (renames);
+
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't migrate table %s.\n", name);
+					goto teardown;
+				}
+		}
+
+	// Drop removed tables.
+	for (size_t i = 0; i < current_len; i++)
+		{
+			if (strncmp (current_entries[i].type, "table", sizeof (current_entries[i].type)) != 0)
+				continue;
+
+			if (has_entry (desired_entries, desired_len, "table", current_entries[i].name))
+				continue;
+
+			char *drop = sqlite3_mprintf ("DROP TABLE \"%w\";\n\n", current_entries[i].name);
+			if (!drop)
+				{
+					err = 1;
+					fprintf (stderr, "generate_migration.c: diff_migration(): out of memory.\n");
+					goto teardown;
+				}
+
+			err = emit_statement (&tables, scratch, drop);
+			sqlite3_free (drop);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't drop table %s.\n", current_entries[i].name);
+					goto teardown;
+				}
+		}
+
+	// Create indexes, views and triggers which are new, or were dropped.
+	for (size_t i = 0; i < desired_len; i++)
+		{
+			if (strncmp (desired_entries[i].type, "table", sizeof (desired_entries[i].type)) == 0)
+				continue;
+
+			bool same = false;
+			if (!has_entry (rebuilt, rebuilt_len, desired_entries[i].type, desired_entries[i].name))
+				{
+					err = compare_object_sql (&same, desired, db, desired_entries[i].type, desired_entries[i].name);
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: diff_migration(): can't compare %s %s.\n", desired_entries[i].type, desired_entries[i].name);
+							goto teardown;
+						}
+				}
+
+			if (same)
+				continue;
+
+			char *create = NULL;
+			err = find_object_sql (desired, &create, desired_entries[i].type, desired_entries[i].name);
+			if (!err)
+				err = add_formatted (&create, ";\n\n");
+			if (!err)
+				err = emit_statement (&creates, scratch, create);
+
+			if (create) free (create);
+
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't create %s %s.\n", desired_entries[i].type, desired_entries[i].name);
+					goto teardown;
+				}
+		}
+
+	err = verify_diff_result (scratch, desired);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: diff_migration(): can't verify migration.\n");
+			goto teardown;
+		}
+
+	if (!drops && !tables && !creates)
+		{
+			printf ("No difference found with %s.\n", desired_path);
+			err = add_formatted (content, "-- No difference found with %s.\n", desired_path);
+			goto teardown;
+		}
+
+	for (size_t i = 0; i < *recreated_len; i++)
+		{
+			err = add_formatted (content, "%s%s\n", RECREATE_MARKER, (*recreated)[i].name);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't add recreate marker.\n");
+					goto teardown;
+				}
+		}
+
+	if (*recreated_len > 0)
+		{
+			err = add_to_string (content, "\n", MAX_FILE_LEN);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't add markers.\n");
+					goto teardown;
+				}
+		}
+
+	char *sections[] = { drops, tables, creates };
+	for (size_t i = 0; i < sizeof (sections) / sizeof (sections[0]); i++)
+		{
+			if (!sections[i])
+				continue;
+
+			err = add_to_string (content, sections[i], MAX_FILE_LEN);
+			if (!err && i == 0)
+				err = add_to_string (content, "\n", MAX_FILE_LEN);
+
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: diff_migration(): can't assemble migration.\n");
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (desired) sqlite3_close (desired);
+	if (scratch) sqlite3_close (scratch);
+	if (current_entries) free (current_entries);
+	if (desired_entries) free (desired_entries);
+	if (rebuilt) free (rebuilt);
+	if (drops) free (drops);
+	if (tables) free (tables);
+	if (creates) free (creates);
+	return err;
+}
+
+/*
+ * Opens the database to read the schema from, or an in-memory copy of the
+ * structure file with `--from-structure`.
+ */
+static int
+open_generation_db (options_t *options)
+{
+	if (options->from_structure)
+		return open_structure_db (options->structure, options->init);
+
+	return open_db (options->database, options->init);
+}
+
+static int
+report_recreate_impact (options_t *options, const char table_name[MAX_NAME_LEN])
+{
+	int err = 0;
+	bool enough = false;
+	recreate_estimate_t estimate = {0};
+
+	if (options->from_structure)
+		{
+			printf ("Recreating table %s: no size estimate, the schema was loaded from %s.\n", table_name, options->structure);
+			goto teardown;
+		}
+
+	err = estimate_recreate (&estimate, table_name);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: report_recreate_impact(): can't estimate table recreation cost.\n");
+			goto teardown;
+		}
+
+	print_recreate_estimate (&estimate);
+
+	err = check_disk_space (options->database, options->backup_dir, options->compress[0] != 0, recreate_copy_bytes (&estimate), true, &enough);
+	if (err)
+		{
+			fprintf (stderr, "generate_migration.c: report_recreate_impact(): can't check disk space.\n");
+			goto teardown;
+		}
+
+	if (!enough)
+		fprintf (stderr, "Warning: there is currently not enough free disk space to apply this migration.\n");
+
+	teardown:
+	free_recreate_estimate (&estimate);
+	return err;
+}
+
+static int
+raw_migration (char **content)
+{
+	int err = 0;
+
+	const char *raw_content = "-- Your SQL\n";
+
+	*content = calloc (1, strlen (raw_content) + 1);
+	if (!*content)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: raw_migration(): can't allocate memory.\n");
+			goto teardown;
+		}
+
+	snprintf (*content, strlen (raw_content) + 1, "%s", raw_content);
+
+	teardown:
+	return err;
+}
+
+static int
+save_migration (char *content, const char filename[MAX_PATH_LEN])
+{
+	int err = 0;
+	FILE *file = NULL;
+
+	file = fopen (filename, "w");
+	if (!file)
 		{
 			err = 1;
 			fprintf (stderr, "generate_migration.c: save_migration(): can't open file for writing: %s\n", filename);
@@ -684,6 +2502,29 @@ generate_migration (options_t *options)
 	int err = 0;
 	char filename[MAX_PATH_LEN] = {0};
 	char *content = NULL;
+	schema_entry_t *recreated = NULL;
+	size_t recreated_len = 0;
+
+	if (options->diff[0] != 0 && options->recreate[0] != 0)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: generate_migration(): --diff and --recreate can't be used together.\n");
+			goto teardown;
+		}
+
+	if (options->from_structure && options->recreate[0] == 0 && options->diff[0] == 0)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: generate_migration(): --from-structure can only be used with --recreate or --diff.\n");
+			goto teardown;
+		}
+
+	if (options->order_by[0] != 0 && options->recreate[0] == 0)
+		{
+			err = 1;
+			fprintf (stderr, "generate_migration.c: generate_migration(): --order-by can only be used with --recreate.\n");
+			goto teardown;
+		}
 
 	err = ensure_migration_directory_exists (options);
 	if (err)
@@ -701,19 +2542,52 @@ generate_migration (options_t *options)
 
 	if (options->recreate[0] != 0)
 		{
-			err = open_db (options->database, options->init);
+			err = open_generation_db (options);
 			if (err)
 				{
 					fprintf (stderr, "generate_migration.c: generate_migration(): can't open database.\n");
 					goto teardown;
 				}
 
-			err = recreate_table_migration (&content, options->recreate);
+			err = recreate_table_migration (&content, options->recreate, options->order_by);
 			if (err)
 				{
 					fprintf (stderr, "generate_migration.c: generate_migration(): can't generate table recreation migration.\n");
 					goto teardown;
 				}
+
+			err = report_recreate_impact (options, options->recreate);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: generate_migration(): can't report table recreation impact.\n");
+					goto teardown;
+				}
+		}
+	else if (options->diff[0] != 0)
+		{
+			err = open_generation_db (options);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: generate_migration(): can't open database.\n");
+					goto teardown;
+				}
+
+			err = diff_migration (&content, &recreated, &recreated_len, options->diff);
+			if (err)
+				{
+					fprintf (stderr, "generate_migration.c: generate_migration(): can't generate migration from schema difference.\n");
+					goto teardown;
+				}
+
+			for (size_t i = 0; i < recreated_len; i++)
+				{
+					err = report_recreate_impact (options, recreated[i].name);
+					if (err)
+						{
+							fprintf (stderr, "generate_migration.c: generate_migration(): can't report table recreation impact.\n");
+							goto teardown;
+						}
+				}
 		}
 	else
 		{
@@ -734,5 +2608,6 @@ generate_migration (options_t *options)
 
 	teardown:
 	if (content) free (content);
+	if (recreated) free (recreated);
 	return err;
 }
@@ -0,0 +1,76 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+#include "hash.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+/*
+ * 64 bits FNV-1a. This is not a cryptographic hash, it is only meant to
+ * detect changes in files we produced or consume ourselves.
+ */
+uint64_t
+hash_bytes (uint64_t hash, const void *bytes, size_t len)
+{
+	const unsigned char *b = bytes;
+	for (size_t i = 0; i < len; i++)
+		{
+			hash ^= b[i];
+			hash *= FNV_PRIME;
+		}
+
+	return hash;
+}
+
+/*
+ * Hashes a string including its terminating null byte, so that
+ * concatenated strings don't collide ("ab" + "c" vs "a" + "bc").
+ */
+uint64_t
+hash_string (uint64_t hash, const char string[static 1])
+{
+	return hash_bytes (hash, string, strlen (string) + 1);
+}
+
+int
+hash_file (uint64_t hash[static 1], const char path[MAX_PATH_LEN])
+{
+	int err = 0;
+	char buffer[BUFSIZ] = {0};
+
+	FILE *file = fopen (path, "rb");
+	if (!file)
+		{
+			err = 1;
+			fprintf (stderr, "hash.c: hash_file(): can't open file: %s\n", path);
+			goto teardown;
+		}
+
+	while (1)
+		{
+			size_t read = fread (buffer, 1, BUFSIZ, file);
+			*hash = hash_bytes (*hash, buffer, read);
+
+			if (read < BUFSIZ)
+				break;
+		}
+
+	if (ferror (file))
+		{
+			err = 1;
+			fprintf (stderr, "hash.c: hash_file(): error while reading file: %s\n", path);
+			goto teardown;
+		}
+
+	teardown:
+	if (file) fclose (file);
+	return err;
+}
+
+void
+hash_to_hex (char hex[HASH_HEX_LEN], uint64_t hash)
+{
+	snprintf (hex, HASH_HEX_LEN, "%016" PRIx64, hash);
+}
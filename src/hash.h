@@ -0,0 +1,16 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "main.h"
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+#define HASH_HEX_LEN 17
+
+uint64_t hash_bytes (uint64_t hash, const void *bytes, size_t len);
+uint64_t hash_string (uint64_t hash, const char string[static 1]);
+int hash_file (uint64_t hash[static 1], const char path[MAX_PATH_LEN]);
+void hash_to_hex (char hex[HASH_HEX_LEN], uint64_t hash);
+
+#endif
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "main.h"
+#include "database.h"
+#include "integrity.h"
+#include "manifest.h"
+#include "progress.h"
+#include "report.h"
+
+#define MAX_REPORTED_PROBLEMS 10
+
+typedef struct {
+	char (*names)[MAX_NAME_LEN];
+	size_t names_len;
+} table_list_t;
+
+static int
+add_table (table_list_t tables[static 1], const char *name)
+{
+	for (size_t i = 0; i < tables->names_len; i++)
+		if (strncmp (tables->names[i], name, MAX_NAME_LEN) == 0)
+			return 0;
+
+	char (*names)[MAX_NAME_LEN] = realloc (tables->names, sizeof (tables->names[0]) * (tables->names_len + 1));
+	if (!names)
+		{
+			fprintf (stderr, "integrity.c: add_table(): out of memory.\n");
+			return 1;
+		}
+
+	tables->names = names;
+	snprintf (tables->names[tables->names_len++], MAX_NAME_LEN, "%s", name);
+
+	return 0;
+}
+
+/*
+ * Adds to `tables` the table named `name`, or the table of the index named
+ * `name`, if it still exists. Dropped objects have nothing left to check,
+ * but a table dropped then recreated under the same name has.
+ */
+static int
+add_existing_table (table_list_t tables[static 1], sqlite3_stmt *stmt, const char *name)
+{
+	int err = 0;
+
+	sqlite3_reset (stmt);
+	sqlite3_bind_text (stmt, 1, name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					err = add_table (tables, (const char *) sqlite3_column_text (stmt, 0));
+					if (err)
+						goto teardown;
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "integrity.c: add_existing_table(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Lists the tables modified by the run, and the tables with foreign keys
+ * referencing them or a table it dropped, whose rows may have lost their
+ * parent.
+ */
+static int
+find_modified_tables (table_list_t tables[static 1], const run_report_t report[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *existing = NULL;
+	sqlite3_stmt *children = NULL;
+	char existing_query[BUFSIZ] = "SELECT tbl_name FROM sqlite_schema WHERE name = ? AND type IN ('table', 'index') AND tbl_name NOT LIKE 'sqlite_%' AND sql NOT LIKE 'CREATE VIRTUAL%'";
+	char children_query[BUFSIZ] = "SELECT DISTINCT s.name FROM sqlite_schema AS s, pragma_foreign_key_list(s.name) AS f WHERE s.type = 'table' AND f.\"table\" = ? COLLATE NOCASE";
+
+	int rc = sqlite3_prepare_v2 (db, existing_query, -1, &existing, NULL);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_prepare_v2 (db, children_query, -1, &children, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "integrity.c: find_modified_tables(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	for (size_t i = 0; i < report->migrations_len; i++)
+		{
+			const manifest_t *manifest = &report->migrations[i].manifest;
+			for (size_t j = 0; j < manifest->objects_len; j++)
+				{
+					err = add_existing_table (tables, existing, manifest->objects[j].name);
+					if (err)
+						goto teardown;
+				}
+		}
+
+	size_t modified_len = tables->names_len;
+	for (size_t i = 0; i < modified_len; i++)
+		{
+			// Copied, since adding children may move the list.
+			char parent[MAX_NAME_LEN] = {0};
+			snprintf (parent, MAX_NAME_LEN, "%s", tables->names[i]);
+
+			err = add_existing_table (tables, children, parent);
+			if (err)
+				goto teardown;
+		}
+
+	// Children of a dropped table lost all their parent rows, even though it isn't in the list.
+	for (size_t i = 0; i < report->migrations_len; i++)
+		{
+			const manifest_t *manifest = &report->migrations[i].manifest;
+			for (size_t j = 0; j < manifest->objects_len; j++)
+				{
+					const touched_object_t *object = &manifest->objects[j];
+					if (!object->dropped || strcmp (object->type, "table") != 0)
+						continue;
+
+					err = add_existing_table (tables, children, object->name);
+					if (err)
+						goto teardown;
+				}
+		}
+
+	teardown:
+	if (existing) sqlite3_finalize (existing);
+	if (children) sqlite3_finalize (children);
+	return err;
+}
+
+/*
+ * Runs a check query, which yields problems as rows, except for a single
+ * "ok" row. Prints the first problems, and counts them.
+ */
+static int
+run_check (sqlite3_int64 problems[static 1], const char query[static 1], const char *table)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "integrity.c: run_check(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	if (table)
+		sqlite3_bind_text (stmt, 1, table, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *problem = (const char *) sqlite3_column_text (stmt, 0);
+					if (strncmp (problem ? problem : "", "ok", 3) == 0)
+						continue;
+
+					if (*problems < MAX_REPORTED_PROBLEMS)
+						fprintf (stderr, "  %s\n", problem ? problem : "");
+					(*problems)++;
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "integrity.c: run_check(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+// WITHOUT ROWID tables have no rowid to name the faulty row with.
+#define FOREIGN_KEY_CHECK "SELECT format('%s %s references missing row in %s (foreign key %d)', \"table\", ifnull('row ' || rowid, 'row'), parent, fkid) FROM pragma_foreign_key_check"
+#define QUICK_CHECK "SELECT quick_check FROM pragma_quick_check"
+
+/*
+ * Checks foreign keys and structure of a table and its indexes, or of the
+ * whole database when `table` is NULL.
+ */
+static int
+verify_table (bool valid[static 1], const char *table)
+{
+	int err = 0;
+	sqlite3_int64 problems = 0;
+	struct timespec start = {0};
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	err = run_check (&problems, table ? FOREIGN_KEY_CHECK "(?)" : FOREIGN_KEY_CHECK, table);
+	double foreign_keys_seconds = elapsed_since (&start);
+	if (err)
+		{
+			fprintf (stderr, "integrity.c: verify_table(): can't check foreign keys.\n");
+			goto teardown;
+		}
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	err = run_check (&problems, table ? QUICK_CHECK "(?)" : QUICK_CHECK, table);
+	double quick_check_seconds = elapsed_since (&start);
+	if (err)
+		{
+			fprintf (stderr, "integrity.c: verify_table(): can't run quick check.\n");
+			goto teardown;
+		}
+
+	printf ("Verified %s: foreign keys %.3fs, quick check %.3fs", table ? table : "whole database", foreign_keys_seconds, quick_check_seconds);
+	if (problems > 0)
+		{
+			*valid = false;
+			printf (", %lld problems", (long long) problems);
+		}
+	printf (".\n");
+
+	teardown:
+	return err;
+}
+
+/*
+ * Runs `PRAGMA foreign_key_check` and `PRAGMA quick_check` on the tables
+ * modified by the run, found in the migrations manifests. As executables
+ * have no manifest, any of them makes us verify the whole database.
+ */
+int
+verify_touched_objects (const run_report_t report[static 1])
+{
+	int err = 0;
+	bool valid = true;
+	bool whole_database = false;
+	table_list_t tables = {0};
+
+	for (size_t i = 0; i < report->migrations_len; i++)
+		if (!report->migrations[i].manifest.tracked)
+			whole_database = true;
+
+	if (whole_database)
+		{
+			err = verify_table (&valid, NULL);
+			if (err)
+				goto teardown;
+		}
+	else
+		{
+			err = find_modified_tables (&tables, report);
+			if (err)
+				{
+					fprintf (stderr, "integrity.c: verify_touched_objects(): can't find modified tables.\n");
+					goto teardown;
+				}
+
+			for (size_t i = 0; i < tables.names_len; i++)
+				{
+					err = verify_table (&valid, tables.names[i]);
+					if (err)
+						goto teardown;
+				}
+		}
+
+	if (!valid)
+		{
+			err = 1;
+			fprintf (stderr, "integrity.c: verify_touched_objects(): verification failed.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (tables.names) free (tables.names);
+	return err;
+}
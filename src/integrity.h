@@ -0,0 +1,9 @@
+#ifndef _INTEGRITY_H_
+#define _INTEGRITY_H_
+
+#include "main.h"
+#include "report.h"
+
+int verify_touched_objects (const run_report_t report[static 1]);
+
+#endif
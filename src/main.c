@@ -1,19 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 
 #include "main.h"
 #include "database.h"
+#include "fingerprint.h"
 #include "generate_migration.h"
 #include "migrate.h"
+#include "rollback.h"
+#include "squash.h"
+#include "template.h"
 
 static void
 usage (const char progname[static 1])
 {
 	printf ("\
-%s [options] generate <migration name> [--recreate <table>]\n\
-%s [options] migrate\n\
+%s [options] generate <migration name> [--recreate <table> [--order-by <index or columns>] | --diff <schema file>] [--from-structure]\n\
+%s [options] migrate [--until <migration name>] [--dry-run] [--capture] [--verify] [--verify-backup] [--backup-dir <directory>] [--compress <command | builtin>] [--changesets <database>] [--max-duration <duration> [--history <database>]] [--report <file>] [--metrics <file>] [--stats <file>]\n\
+%s [options] template\n\
+%s [options] squash --until <migration name>\n\
+%s [options] rollback <migration name | number of migrations>\n\
+%s [options] verify\n\
 \n\
 Exodus is a SQLite database migration tool.\n\
 \n\
@@ -35,6 +42,40 @@ be prefilled to:\n\
 This will allow you to change in your table things that can only be changed by\n\
 recreating it, like for example the `CHECK` constraints.\n\
 \n\
+Rows are copied in rowid order, or in primary key order for `WITHOUT ROWID`\n\
+tables. With `--order-by`, you can provide the name of an index on that table, or\n\
+a list of columns, to copy rows in that order instead. This clusters the new table\n\
+by that key, so range scans on it touch less pages afterwards. Note that tables\n\
+with an `INTEGER PRIMARY KEY` or `WITHOUT ROWID` are always stored in primary key\n\
+order.\n\
+\n\
+When generating a table recreation, exodus reports the table's row count, the\n\
+size of the table and its indexes, an estimated duration measured from copying a\n\
+sample of rows, and the disk space the migration will need. The generated\n\
+migration starts with a `-- exodus:recreate <table>` comment, which `migrate`\n\
+uses to produce the same report before applying it.\n\
+\n", progname, progname, progname, progname, progname, progname);
+
+	printf ("\
+If you specify a SQL file with the `--diff` option, exodus will load it as the\n\
+desired schema, compare it to the current one object by object, and generate the\n\
+cheapest migration to get there: triggers, views and indexes which changed are\n\
+dropped and recreated, columns are added, renamed (when a column is replaced at\n\
+the same position by one with the same definition) or dropped with `ALTER TABLE`,\n\
+and tables are only recreated when SQLite can't alter them. Renamings are only\n\
+guessed, so exodus warns about each one and comments it in the migration. Every\n\
+statement is checked against a scratch copy of the current schema as the\n\
+migration is built, and exodus warns you about anything which wouldn't match the\n\
+desired schema. Always review the generated migration: new `NOT NULL` columns,\n\
+for example, still need a default value or some data. Generation fails when a\n\
+virtual table changed, since it can only be migrated manually.\n\
+\n\
+Both `--recreate` and `--diff` read the current schema from the database. With\n\
+`--from-structure`, exodus loads the structure file in an in-memory database\n\
+instead, so generating a migration doesn't open the database at all, and works\n\
+on a machine which only has the code. The size and duration estimates are\n\
+skipped in that case, since there is no data to measure.\n\
+\n\
 When using the `migrate` subcommand, exodus will run the pending migrations on\n\
 the database. The migrations directory is determined as for `generate`. The default\n\
 database file is `./app.db`. You can change it with the `--database` option.\n\
@@ -47,6 +88,92 @@ previous database, and save the failed one as `<db name>.failed`. In case of suc
 it will dump the current structure in the structure file, which is `./structure.sql`\n\
 by default, and can be changed with the `--structure` option.\n\
 \n\
+Before doing anything, `migrate` checks there is enough free disk space for the\n\
+`.prev` backup, the `.failed` copy and the recreated tables (which are written\n\
+once in the database, and once in the journal), and refuses to start otherwise.\n\
+\n\
+Pending SQL migrations are also applied to an empty in-memory copy of the\n\
+current schema, which takes no time since there is no data in it, and `migrate`\n\
+only starts if they all apply cleanly. Foreign keys aren't enforced there, since\n\
+the rows they reference aren't copied. As executable and plugin migrations can't\n\
+be checked that way, this preflight stops at the first one. The `.prev` backup is\n\
+made by a background thread meanwhile, and the first migration waits for it.\n\
+\n");
+
+	printf ("\
+With `--verify-backup`, that thread then checks the backup before any migration\n\
+starts: the database is held in a read transaction, and its pages are compared\n\
+to the backup's by hashing page ranges on several threads (one per CPU, up to\n\
+eight). A database in WAL mode can't be compared byte for byte, so its backup\n\
+gets a `PRAGMA quick_check` instead. The run stops if the backup differs.\n\
+\n\
+Backups are full copies of the database, which may not fit on small volumes.\n\
+`--backup-dir <directory>` writes `.prev` and `.failed` in that directory\n\
+instead of next to the database, and `--compress <command | builtin>` streams\n\
+them through a compressor: `builtin` is a fast LZ77 compressor (backups end\n\
+with `.lz`), anything else is a shell command reading the database on its\n\
+standard input and writing the backup on its standard output, like `zstd -q`\n\
+or `gzip -1` (backups end with `.z`). They're restored by streaming them back\n\
+through the same command with `-d` into a `.restoring` file, next to the other\n\
+backups, then copying it into the database with SQLite: the free disk space\n\
+check reserves the size of the database for it. The database file is read\n\
+while holding a read transaction, which in WAL mode requires its WAL to be\n\
+checkpointed, so other connections can't be writing. The size of the database,\n\
+of its backup, and the backup throughput are printed, and reported as\n\
+`backup_bytes` and `backup_stored_bytes` in the JSON report. With\n\
+`--verify-backup`, compressed backups are decompressed and compared to the hash\n\
+of what was streamed.\n\
+\n\
+When a statement runs for more than a second, `migrate` displays the number of\n\
+virtual machine steps, the elapsed time and the pages written so far. `SIGINT`\n\
+(Ctrl-C) and `SIGTERM` interrupt the running statement, or are forwarded as\n\
+`SIGTERM` to executables, and the previous database is restored as when a\n\
+migration fails.\n\
+\n\
+With `--capture`, `migrate` records what each data-only migration changed as a\n\
+SQLite session changeset, stored in the `changeset` column of the migrations\n\
+table. Changes of SQL migrations are recorded as they run, while executables are\n\
+compared with a copy of the database made just before them, which costs a full\n\
+copy. Migrations which change the schema get no changeset, and neither do\n\
+migrations writing a table without primary key, which the session can't record:\n\
+exodus warns about them, and rolling them back requires a down migration. With\n\
+`--changesets <database>`, executable and plugin migrations are replaced by the\n\
+changeset recorded for them in that other database, if any, so that databases\n\
+sharing the same data don't have to recompute it. The changeset is applied with\n\
+conflict detection: if any row doesn't match what the changeset expects, the\n\
+conflicts are reported and the migration fails.\n\
+\n");
+
+	printf ("\
+When using the `rollback` subcommand, exodus reverts the given number of last\n\
+migrations, most recent first, or the given migration if it's the last one\n\
+applied, and removes them from the migrations table, in a single transaction. To\n\
+rollback an older migration, give the number of migrations applied since. A\n\
+migration is reverted by its down migration if it has one: a file named after\n\
+the migration without its `.sql` or `.so` extension, followed by `.down.sql`,\n\
+`.down.so` for a plugin, or `.down` for an executable (like\n\
+`1700000000-add_users.down.sql` for `1700000000-add_users.sql`). Down SQL files\n\
+and plugins must not start their own transaction. Down executables use their\n\
+own connection, so when some are involved, each migration is rolled back in its\n\
+own transaction.\n\
+\n\
+Migrations without a down migration are reverted by applying the inverse of the\n\
+changeset recorded with `--capture`. This only writes the rows the migration\n\
+touched, without restoring any backup, so writes made since then to other rows\n\
+are kept. If one of those rows was modified or deleted since the migration, the\n\
+conflict is reported and nothing is rolled back.\n\
+\n\
+The structure file starts with a fingerprint of the schema: a hash of every\n\
+object in `sqlite_schema` (but the migrations table), sorted by type and name and\n\
+ignoring formatting whitespace. The migrations table also records in its\n\
+`fingerprint` column the fingerprint each migration left. When using the\n\
+`verify` subcommand, exodus opens the database read only and compares its\n\
+fingerprint with the structure file's, or with the one recorded by the last\n\
+migration if there is no structure file. Only on mismatch is the structure file\n\
+loaded, to list the missing, unexpected and different objects, and the command\n\
+fails. Applications can call `check_schema_fingerprint()` on their own\n\
+connection at startup, which only costs a scan of `sqlite_schema`.\n\
+\n\
 A migration file can either be a SQL file, or an executable. Executables will be\n\
 executed once, provided they return a 0 status. Non zero status will be considered\n\
 as a failure at applying the migration. The point of running those executables is\n\
@@ -54,6 +181,32 @@ to allow your migration to compute data changes, rather than hardcoding them. Yo
 executable will be passed the database path as first parameter, but beside that,\n\
 you're on your own. It's your responsibility to make that executable connect to\n\
 the database and do whatever it wants with it.\n\
+\n");
+
+	printf ("\
+With `--timeout`, executables still running after the given duration receive\n\
+`SIGTERM`, then `SIGKILL` 5 seconds later, and the migration fails, restoring the\n\
+previous database. Executables run in their own process group, which receives\n\
+these signals, so processes they started are stopped too. `--cpu-limit` and\n\
+`--memory-limit` set the `RLIMIT_CPU` and `RLIMIT_AS` limits of their process.\n\
+After each run, `migrate` prints the same report as `--dry-run`, which also\n\
+gives for executables their user and system CPU time, peak RSS, and blocks read\n\
+and written.\n\
+\n\
+Executables can report their progress by writing lines like `<rows done> <rows\n\
+total> <message>` (with a total of 0 when unknown) on the file descriptor given\n\
+in the `EXODUS_PROGRESS_FD` environment variable, like `echo \"1000 50000 users\"\n\
+>&$EXODUS_PROGRESS_FD` in a shell script. Exodus displays the last progress with\n\
+the rate and the estimated time left, and prints it if the executable fails.\n\
+\n\
+A migration file can also be a plugin: a shared library with the `.so`\n\
+extension, exporting `int exodus_migration (sqlite3 *db, const char\n\
+*database_path)`. Exodus loads it with `dlopen()` and calls that function with\n\
+its own connection, inside a savepoint, so there is no process to start and no\n\
+schema to parse again. A non zero return value is a failure, and everything the\n\
+plugin did is rolled back. Plugins must not start or end transactions themselves\n\
+(use savepoints), and must not leave functions or hooks registered on the\n\
+connection, as the library is unloaded afterward.\n\
 \n\
 You can provide SQL code that will be called every time a connection is open\n\
 (at the start of the program and after each migration has ran, ensuring it runs once\n\
@@ -65,6 +218,82 @@ the first one existing in this list:\n\
 - $HOME/.config/exodus-init.sql\n\
 - /etc/exodus-init.sql\n\
 \n\
+When using the `template` subcommand, exodus creates the database (which must not\n\
+exist yet) fully migrated, by cloning a template database. Templates are built\n\
+once by running every migration on an empty database, and are cached under a key\n\
+computed from the name and content of the migration files and from the init\n\
+file, so that any change in migrations builds a new template. The cache directory\n\
+is `$XDG_CACHE_HOME/exodus`, `$HOME/.cache/exodus` or `/tmp/exodus`, and can be\n\
+changed with the `--cache` option. Clones share the template's blocks when the\n\
+filesystem supports reflinks, and are copied otherwise. This is meant to quickly\n\
+create databases for tests.\n\
+\n");
+
+	printf ("\
+When using the `squash` subcommand, exodus collapses every migration until the\n\
+one given with `--until` (included) into a baseline file, `baseline.sql` in the\n\
+migrations directory, and removes the squashed migration files. The baseline is\n\
+built by migrating a scratch database, and contains its schema and the names of\n\
+the migrations it replaces. `migrate` applies the baseline in a single\n\
+transaction on empty databases, then the migrations written after it, while\n\
+existing databases ignore it. Only the schema is kept: data inserted by the\n\
+squashed migrations is not part of the baseline. Make sure every database has\n\
+been migrated past the squashed migrations before removing them.\n\
+\n\
+`migrate` also accepts `--until`, to stop after the given migration.\n\
+\n\
+With `--dry-run`, `migrate` clones the database to `<db name>.dry-run` using the\n\
+same backup mechanism as for `.prev`, applies the pending migrations to the clone,\n\
+and reports for each of them the wall time, the pages written (for SQL\n\
+migrations), how much the database grew and the size the journal reached. The\n\
+real database, its migrations table and the structure file are left untouched,\n\
+and the clone is removed afterward. The journal size of executable migrations is\n\
+only known when the database uses WAL.\n\
+\n\
+With `--max-duration <duration>`, `migrate` only starts a migration if it's\n\
+expected to end within that duration from the start of the run, and stops\n\
+cleanly otherwise, listing the deferred migrations for the next window. The time\n\
+each migration takes is recorded in the `duration` column of the migrations\n\
+table, and a dry run saves what it measured in `<db name>.durations`. Expected\n\
+durations come from the last dry run if it measured the migration, or else from\n\
+the migrations table of the database given with `--history <database>` (like a\n\
+staging database which already ran them). Migrations with no known duration are\n\
+started as long as the window isn't over, with a warning naming them.\n\
+\n\
+With `--report <file>`, `migrate` also writes its run report as JSON: the time\n\
+spent backing up, restoring and dumping the structure, the database size before\n\
+and after, and for each migration its kind (sql, executable, plugin or\n\
+changeset), start time, duration, rows changed, pages written, time spent\n\
+waiting for locks, and the resource usage of executables. `--metrics <file>`\n\
+writes the same report in the OpenMetrics text format, to be collected by the\n\
+textfile collector of node_exporter. Both files are replaced atomically.\n\
+\n");
+
+	printf ("\
+For SQL, plugin and changeset migrations, `migrate` tracks which tables and\n\
+indexes were created, altered, dropped or written, with the number of rows\n\
+inserted, updated and deleted in each table (including by triggers). Rows\n\
+written to WITHOUT ROWID tables, or deleted by a `DELETE` without `WHERE`,\n\
+aren't counted, but those tables are still listed as written. This manifest is\n\
+listed under each migration in the run output and the JSON report, and stored\n\
+as JSON in the `manifest` column of the migrations table. Executables don't go\n\
+through exodus' connection, so their manifest is null.\n\
+\n\
+With `--verify`, once migrations are applied, `migrate` runs `PRAGMA\n\
+foreign_key_check` and `PRAGMA quick_check` on the tables the manifests list\n\
+(and on the tables with foreign keys referencing them, even when they were\n\
+dropped), printing how long each check took. If any executable migration ran,\n\
+the whole database is checked instead. Any problem found fails the run, and the\n\
+database is restored.\n\
+\n\
+The structure file is written to a temporary file, synced to disk, and only\n\
+moved in place if its content changed, so that it's never left half written\n\
+and unchanged schemas don't touch it. With `--stats <file>`, `migrate` also\n\
+writes, the same way, one line per table and index with its number of entries,\n\
+pages, overflow pages, bytes and unused bytes, from the `dbstat` virtual table.\n\
+This reads the whole database, but allows to follow tables growth across\n\
+releases with `diff`.\n\
+\n\
 Options can be:\n\
 \n\
 	-h, --help: display this help.\n\
@@ -72,17 +301,11 @@ Options can be:\n\
 	-m, --migrations <migrations directory>: use this directory for migrations.\n\
 	-s, --structure <structure file>: use this file for SQL structure.\n\
 	-i, --init <SQL init file>: content of this file will be executed when opening each connection.\n\
-", progname, progname);
-}
-
-static bool
-file_exists (const char *path)
-{
-	struct stat st;
-	if (stat (path, &st) == 0)
-		return true;
-
-	return false;
+	-c, --cache <cache directory>: use this directory to store templates.\n\
+	--timeout <duration>: stop executable migrations running longer than this (like 90s, 15m or 2h).\n\
+	--cpu-limit <duration>: limit the CPU time of executable migrations.\n\
+	--memory-limit <size>: limit the memory of executable migrations (like 512M or 2G).\n\
+");
 }
 
 static void
@@ -112,6 +335,82 @@ find_init_file (char init[MAX_PATH_LEN])
 	init[0] = 0;
 }
 
+static void
+find_cache_directory (char cache[MAX_PATH_LEN])
+{
+	char *xdg_cache = getenv ("XDG_CACHE_HOME");
+	if (xdg_cache && xdg_cache[0] != 0)
+		{
+			snprintf (cache, MAX_PATH_LEN, "%s/exodus", xdg_cache);
+			return;
+		}
+
+	char *home = getenv ("HOME");
+	if (home && home[0] != 0)
+		{
+			snprintf (cache, MAX_PATH_LEN, "%s/.cache/exodus", home);
+			return;
+		}
+
+	snprintf (cache, MAX_PATH_LEN, "/tmp/exodus");
+}
+
+/*
+ * Parses a number of seconds, optionally followed by an `s`, `m` or `h`
+ * unit, like `90`, `15m` or `2h`.
+ */
+static int
+parse_duration (int seconds[static 1], const char *value)
+{
+	char *unit = NULL;
+	long number = strtol (value, &unit, 10);
+	if (unit == value || number < 0)
+		return 1;
+
+	switch (*unit)
+		{
+			case 0:
+			case 's': break;
+			case 'm': number *= 60; break;
+			case 'h': number *= 60 * 60; break;
+			default: return 1;
+		}
+
+	if (*unit != 0 && unit[1] != 0)
+		return 1;
+
+	*seconds = (int) number;
+	return 0;
+}
+
+/*
+ * Parses a number of bytes, optionally followed by a `K`, `M` or `G` unit,
+ * like `512M`.
+ */
+static int
+parse_size (long long bytes[static 1], const char *value)
+{
+	char *unit = NULL;
+	long long number = strtoll (value, &unit, 10);
+	if (unit == value || number < 0)
+		return 1;
+
+	switch (*unit)
+		{
+			case 0: break;
+			case 'K': number *= 1024; break;
+			case 'M': number *= 1024 * 1024; break;
+			case 'G': number *= 1024 * 1024 * 1024; break;
+			default: return 1;
+		}
+
+	if (*unit != 0 && unit[1] != 0)
+		return 1;
+
+	*bytes = number;
+	return 0;
+}
+
 static int
 parse_options (int argc, char **argv, options_t options[static 1])
 {
@@ -183,6 +482,20 @@ parse_options (int argc, char **argv, options_t options[static 1])
 							continue;
 						}
 
+					if (strncmp (argv[i], "--cache", 20) == 0 || strncmp (argv[i], "-c", 10) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for %s.\n\n", argv[i]);
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->cache, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
 					if (strncmp (argv[i], "--recreate", 20) == 0)
 						{
 							if (argc < i + 2)
@@ -197,6 +510,260 @@ parse_options (int argc, char **argv, options_t options[static 1])
 							continue;
 						}
 
+					if (strncmp (argv[i], "--diff", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --diff.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->diff, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--order-by", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --order-by.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->order_by, MAX_NAME_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--dry-run", 20) == 0)
+						{
+							options->dry_run = true;
+							continue;
+						}
+
+					if (strncmp (argv[i], "--capture", 20) == 0)
+						{
+							options->capture = true;
+							continue;
+						}
+
+					if (strncmp (argv[i], "--verify-backup", 20) == 0)
+						{
+							options->verify_backup = true;
+							continue;
+						}
+
+					if (strncmp (argv[i], "--verify", 20) == 0)
+						{
+							options->verify = true;
+							continue;
+						}
+
+					if (strncmp (argv[i], "--changesets", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --changesets.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->changesets, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--timeout", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --timeout.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							err = parse_duration (&options->timeout, argv[++i]);
+							if (err)
+								{
+									fprintf (stderr, "Invalid value for --timeout: %s\n\n", argv[i]);
+									usage (argv[0]);
+									goto teardown;
+								}
+
+							continue;
+						}
+
+					if (strncmp (argv[i], "--cpu-limit", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --cpu-limit.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							err = parse_duration (&options->cpu_limit, argv[++i]);
+							if (err)
+								{
+									fprintf (stderr, "Invalid value for --cpu-limit: %s\n\n", argv[i]);
+									usage (argv[0]);
+									goto teardown;
+								}
+
+							continue;
+						}
+
+					if (strncmp (argv[i], "--memory-limit", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --memory-limit.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							err = parse_size (&options->memory_limit, argv[++i]);
+							if (err)
+								{
+									fprintf (stderr, "Invalid value for --memory-limit: %s\n\n", argv[i]);
+									usage (argv[0]);
+									goto teardown;
+								}
+
+							continue;
+						}
+
+					if (strncmp (argv[i], "--max-duration", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --max-duration.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							err = parse_duration (&options->max_duration, argv[++i]);
+							if (err)
+								{
+									fprintf (stderr, "Invalid value for --max-duration: %s\n\n", argv[i]);
+									usage (argv[0]);
+									goto teardown;
+								}
+
+							continue;
+						}
+
+					if (strncmp (argv[i], "--history", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --history.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->history, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--report", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --report.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->report, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--stats", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --stats.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->stats, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--backup-dir", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --backup-dir.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->backup_dir, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--compress", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --compress.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->compress, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--metrics", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --metrics.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->metrics, MAX_PATH_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
+					if (strncmp (argv[i], "--from-structure", 20) == 0)
+						{
+							options->from_structure = true;
+							continue;
+						}
+
+					if (strncmp (argv[i], "--until", 20) == 0)
+						{
+							if (argc < i + 2)
+								{
+									fprintf (stderr, "You need to provide a value for --until.\n\n");
+									usage (argv[0]);
+									err = 1;
+									goto teardown;
+								}
+
+							snprintf (options->until, MAX_NAME_LEN - 1, "%s", argv[++i]);
+							continue;
+						}
+
 					if (strncmp (argv[i], "generate", 10) == 0)
 						{
 							options->command = COMMAND_GENERATE;
@@ -209,7 +776,31 @@ parse_options (int argc, char **argv, options_t options[static 1])
 							continue;
 						}
 
-					if (options->command == COMMAND_GENERATE && options->migration_name[0] == 0)
+					if (strncmp (argv[i], "template", 10) == 0)
+						{
+							options->command = COMMAND_TEMPLATE;
+							continue;
+						}
+
+					if (strncmp (argv[i], "squash", 10) == 0)
+						{
+							options->command = COMMAND_SQUASH;
+							continue;
+						}
+
+					if (strncmp (argv[i], "rollback", 10) == 0)
+						{
+							options->command = COMMAND_ROLLBACK;
+							continue;
+						}
+
+					if (strncmp (argv[i], "verify", 10) == 0)
+						{
+							options->command = COMMAND_VERIFY;
+							continue;
+						}
+
+					if ((options->command == COMMAND_GENERATE || options->command == COMMAND_ROLLBACK) && options->migration_name[0] == 0)
 						{
 							snprintf (options->migration_name, MAX_NAME_LEN - 1, "%s", argv[i]);
 							continue;
@@ -234,6 +825,9 @@ parse_options (int argc, char **argv, options_t options[static 1])
 	if (options->init[0] == 0)
 		find_init_file (options->init);
 
+	if (options->cache[0] == 0)
+		find_cache_directory (options->cache);
+
 	teardown:
 	return err;
 }
@@ -268,6 +862,42 @@ main (int argc, char **argv)
 					}
 				break;
 
+			case COMMAND_TEMPLATE:
+				err = template (&options);
+				if (err)
+					{
+						fprintf (stderr, "main.c: main(): could not create database from template.\n");
+						goto teardown;
+					}
+				break;
+
+			case COMMAND_SQUASH:
+				err = squash (&options);
+				if (err)
+					{
+						fprintf (stderr, "main.c: main(): could not squash migrations.\n");
+						goto teardown;
+					}
+				break;
+
+			case COMMAND_ROLLBACK:
+				err = rollback (&options);
+				if (err)
+					{
+						fprintf (stderr, "main.c: main(): could not rollback migration.\n");
+						goto teardown;
+					}
+				break;
+
+			case COMMAND_VERIFY:
+				err = verify (&options);
+				if (err)
+					{
+						fprintf (stderr, "main.c: main(): could not verify schema.\n");
+						goto teardown;
+					}
+				break;
+
 			default:
 				fprintf (stderr, "unknown command.\n\n");
 				usage (argv[0]);
@@ -11,7 +11,27 @@ typedef struct {
 	char migrations[MAX_PATH_LEN];
 	char structure[MAX_PATH_LEN];
 	char init[MAX_PATH_LEN];
+	char cache[MAX_PATH_LEN];
 	char recreate[MAX_NAME_LEN];
+	char order_by[MAX_NAME_LEN];
+	char until[MAX_NAME_LEN];
+	char diff[MAX_PATH_LEN];
+	bool from_structure;
+	bool dry_run;
+	bool capture;
+	bool verify;
+	bool verify_backup;
+	char backup_dir[MAX_PATH_LEN];
+	char compress[MAX_PATH_LEN];
+	char changesets[MAX_PATH_LEN];
+	int timeout;
+	int cpu_limit;
+	long long memory_limit;
+	int max_duration;
+	char history[MAX_PATH_LEN];
+	char report[MAX_PATH_LEN];
+	char metrics[MAX_PATH_LEN];
+	char stats[MAX_PATH_LEN];
 	char migration_name[MAX_NAME_LEN];
 	int command;
 } options_t;
@@ -20,6 +40,10 @@ enum {
 	UNKNOWN_COMMAND,
 	COMMAND_GENERATE,
 	COMMAND_MIGRATE,
+	COMMAND_TEMPLATE,
+	COMMAND_SQUASH,
+	COMMAND_ROLLBACK,
+	COMMAND_VERIFY,
 };
 
 #endif
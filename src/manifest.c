@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "manifest.h"
+
+/*
+ * Finds the object in the manifest, or adds it. Returns NULL when out of
+ * memory.
+ */
+static touched_object_t *
+touched_object (manifest_t manifest[static 1], const char *type, const char *name)
+{
+	for (size_t i = 0; i < manifest->objects_len; i++)
+		if (manifest->objects[i].type == type && strncmp (manifest->objects[i].name, name, MAX_NAME_LEN) == 0)
+			return &manifest->objects[i];
+
+	touched_object_t *objects = realloc (manifest->objects, sizeof (touched_object_t) * (manifest->objects_len + 1));
+	if (!objects)
+		{
+			manifest->out_of_memory = true;
+			return NULL;
+		}
+
+	manifest->objects = objects;
+
+	touched_object_t *object = &manifest->objects[manifest->objects_len++];
+	memset (object, 0, sizeof (touched_object_t));
+	snprintf (object->name, MAX_NAME_LEN, "%s", name);
+	object->type = type;
+
+	return object;
+}
+
+/*
+ * Records schema changes, and which tables are written. The authorizer is
+ * called when statements (and the triggers they fire) are compiled rather
+ * than run, which is right before for migrations, and it never denies
+ * anything.
+ *
+ * Rows are counted by the update hook, which misses some writes (see
+ * `record_dml()`), but every table a statement may write goes through the
+ * authorizer, so none is missing from the manifest.
+ */
+static int
+record_statement (void *context, int action, const char *first, const char *second, const char *database, const char *trigger)
+{
+	manifest_t *manifest = context;
+	touched_object_t *object = NULL;
+
+	(void) trigger;
+
+	if (database && strncmp (database, "main", 5) != 0)
+		return SQLITE_OK;
+
+	switch (action)
+		{
+			case SQLITE_CREATE_TABLE:
+			case SQLITE_CREATE_VTABLE:
+				if ((object = touched_object (manifest, "table", first)))
+					object->created = true;
+				break;
+
+			case SQLITE_CREATE_INDEX:
+				if ((object = touched_object (manifest, "index", first)))
+					object->created = true;
+				break;
+
+			case SQLITE_ALTER_TABLE:
+				if ((object = touched_object (manifest, "table", second)))
+					object->altered = true;
+				break;
+
+			case SQLITE_DROP_TABLE:
+			case SQLITE_DROP_VTABLE:
+				if ((object = touched_object (manifest, "table", first)))
+					object->dropped = true;
+				break;
+
+			case SQLITE_DROP_INDEX:
+				if ((object = touched_object (manifest, "index", first)))
+					object->dropped = true;
+				break;
+
+			case SQLITE_INSERT:
+			case SQLITE_UPDATE:
+			case SQLITE_DELETE:
+				// Schema changes write internal tables, which aren't ours to report.
+				if (strncmp (first, "sqlite_", 7) != 0 && (object = touched_object (manifest, "table", first)))
+					object->written = true;
+				break;
+		}
+
+	return SQLITE_OK;
+}
+
+/*
+ * Counts rows written, including by triggers. SQLite doesn't call the
+ * update hook for WITHOUT ROWID tables, nor when a table is emptied by a
+ * `DELETE` without `WHERE`, so those tables are only known to be written.
+ * The preupdate hook would see them, but it's taken by the session of
+ * `--capture`.
+ */
+static void
+record_dml (void *context, int operation, const char *database, const char *table, sqlite3_int64 rowid)
+{
+	manifest_t *manifest = context;
+	touched_object_t *object = NULL;
+
+	(void) rowid;
+
+	if (strncmp (database, "main", 5) != 0)
+		return;
+
+	// Migrations usually write one table many times in a row.
+	if (manifest->last_written < manifest->objects_len && strncmp (manifest->objects[manifest->last_written].name, table, MAX_NAME_LEN) == 0 && strncmp (manifest->objects[manifest->last_written].type, "table", 6) == 0)
+		object = &manifest->objects[manifest->last_written];
+	else if ((object = touched_object (manifest, "table", table)))
+		manifest->last_written = (size_t) (object - manifest->objects);
+	else
+		return;
+
+	object->written = true;
+
+	if (operation == SQLITE_INSERT)
+		object->inserted++;
+	else if (operation == SQLITE_UPDATE)
+		object->updated++;
+	else if (operation == SQLITE_DELETE)
+		object->deleted++;
+}
+
+/*
+ * Starts tracking the tables and indexes created, altered, dropped or
+ * written through `conn`.
+ */
+void
+start_manifest (manifest_t manifest[static 1], sqlite3 *conn)
+{
+	manifest->conn = conn;
+	manifest->tracked = true;
+	manifest->last_written = 0;
+	sqlite3_set_authorizer (conn, record_statement, manifest);
+	sqlite3_update_hook (conn, record_dml, manifest);
+}
+
+int
+finish_manifest (manifest_t manifest[static 1])
+{
+	int err = 0;
+
+	if (manifest->conn)
+		{
+			sqlite3_set_authorizer (manifest->conn, NULL, NULL);
+			sqlite3_update_hook (manifest->conn, NULL, NULL);
+			manifest->conn = NULL;
+		}
+
+	if (manifest->out_of_memory)
+		{
+			err = 1;
+			fprintf (stderr, "manifest.c: finish_manifest(): out of memory while tracking touched objects.\n");
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Prints one line per touched object, or nothing if the migration wasn't
+ * tracked (executables don't use our connection).
+ */
+void
+print_manifest (const manifest_t manifest[static 1])
+{
+	for (size_t i = 0; i < manifest->objects_len; i++)
+		{
+			const touched_object_t *object = &manifest->objects[i];
+			const char *separator = "";
+
+			printf ("  %s %s:", object->type, object->name);
+
+			if (object->created)
+				{
+					printf (" created");
+					separator = ",";
+				}
+
+			if (object->altered)
+				{
+					printf ("%s altered", separator);
+					separator = ",";
+				}
+
+			if (object->dropped)
+				{
+					printf ("%s dropped", separator);
+					separator = ",";
+				}
+
+			if (object->inserted + object->updated + object->deleted > 0)
+				printf ("%s %lld inserted, %lld updated, %lld deleted", separator, (long long) object->inserted, (long long) object->updated, (long long) object->deleted);
+			else if (object->written)
+				printf ("%s written (rows not counted)", separator);
+
+			printf (".\n");
+		}
+}
+
+static void
+append_json_string (sqlite3_str *str, const char *string)
+{
+	sqlite3_str_appendchar (str, 1, '"');
+
+	for (const char *c = string; *c; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				sqlite3_str_appendf (str, "\\%c", *c);
+			else if ((unsigned char) *c < 0x20)
+				sqlite3_str_appendf (str, "\\u%04x", (unsigned char) *c);
+			else
+				sqlite3_str_appendchar (str, 1, *c);
+		}
+
+	sqlite3_str_appendchar (str, 1, '"');
+}
+
+/*
+ * Serializes the manifest as a JSON array, or `null` if the migration
+ * wasn't tracked.
+ *
+ * Caller must free `json` with `sqlite3_free()`.
+ */
+int
+manifest_to_json (const manifest_t manifest[static 1], char *json[static 1])
+{
+	int err = 0;
+	sqlite3_str *str = sqlite3_str_new (NULL);
+
+	if (!manifest->tracked)
+		sqlite3_str_appendall (str, "null");
+	else
+		{
+			sqlite3_str_appendchar (str, 1, '[');
+
+			for (size_t i = 0; i < manifest->objects_len; i++)
+				{
+					const touched_object_t *object = &manifest->objects[i];
+
+					sqlite3_str_appendf (str, "%s{\"type\": \"%s\", \"name\": ", i > 0 ? ", " : "", object->type);
+					append_json_string (str, object->name);
+					sqlite3_str_appendf (str, ", \"created\": %s, \"altered\": %s, \"dropped\": %s, \"written\": %s, \"inserted\": %lld, \"updated\": %lld, \"deleted\": %lld}",
+							object->created ? "true" : "false", object->altered ? "true" : "false", object->dropped ? "true" : "false", object->written ? "true" : "false",
+							(long long) object->inserted, (long long) object->updated, (long long) object->deleted);
+				}
+
+			sqlite3_str_appendchar (str, 1, ']');
+		}
+
+	if (sqlite3_str_errcode (str) != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "manifest.c: manifest_to_json(): out of memory.\n");
+		}
+
+	*json = sqlite3_str_finish (str);
+	if (err && *json)
+		{
+			sqlite3_free (*json);
+			*json = NULL;
+		}
+
+	return err;
+}
+
+void
+free_manifest (manifest_t manifest[static 1])
+{
+	if (manifest->objects) free (manifest->objects);
+	manifest->objects = NULL;
+	manifest->objects_len = 0;
+}
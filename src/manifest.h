@@ -0,0 +1,34 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <sqlite3.h>
+#include "main.h"
+
+typedef struct {
+	char name[MAX_NAME_LEN];
+	const char *type;
+	bool created;
+	bool altered;
+	bool dropped;
+	bool written;
+	sqlite3_int64 inserted;
+	sqlite3_int64 updated;
+	sqlite3_int64 deleted;
+} touched_object_t;
+
+typedef struct {
+	touched_object_t *objects;
+	size_t objects_len;
+	size_t last_written;
+	bool tracked;
+	bool out_of_memory;
+	sqlite3 *conn;
+} manifest_t;
+
+void start_manifest (manifest_t manifest[static 1], sqlite3 *conn);
+int finish_manifest (manifest_t manifest[static 1]);
+void print_manifest (const manifest_t manifest[static 1]);
+int manifest_to_json (const manifest_t manifest[static 1], char *json[static 1]);
+void free_manifest (manifest_t manifest[static 1]);
+
+#endif
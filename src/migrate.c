@@ -1,19 +1,56 @@
+// For wait4().
+#define _DEFAULT_SOURCE
+
 #include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "main.h"
+#include "backup.h"
+#include "changeset.h"
 #include "database.h"
+#include "estimate.h"
+#include "fingerprint.h"
+#include "hash.h"
+#include "integrity.h"
+#include "manifest.h"
+#include "migrate.h"
+#include "progress.h"
+#include "report.h"
+#include "window.h"
 
 extern char **environ;
 
+// Time given to executables to exit after SIGTERM, before SIGKILL.
+#define KILL_GRACE_SECONDS 5
+
 char last_migration_applied[MAX_PATH_LEN] = {0};
+char until_migration[MAX_NAME_LEN] = {0};
+
+/*
+ * Seconds since the epoch, for reports.
+ */
+static double
+wall_clock ()
+{
+	struct timespec now = {0};
+	clock_gettime (CLOCK_REALTIME, &now);
+	return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
 
-static bool
+bool
 is_executable (const char migration_file[MAX_PATH_LEN])
 {
 	struct stat st;
@@ -29,13 +66,93 @@ is_executable (const char migration_file[MAX_PATH_LEN])
 	return false;
 }
 
+/*
+ * Columns added to the migrations table after its creation, which older
+ * databases may not have yet.
+ */
+static const char *migrations_columns[][2] = {
+	{ "changeset", "BLOB" },
+	{ "duration", "REAL" },
+	{ "manifest", "TEXT" },
+	{ "fingerprint", "TEXT" },
+};
+
 static int
+ensure_migrations_columns ()
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char *alter = NULL;
+	char query[BUFSIZ] = "SELECT count(*) FROM pragma_table_info('migrations') WHERE name = ?";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: ensure_migrations_columns(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	for (size_t i = 0; i < sizeof (migrations_columns) / sizeof (migrations_columns[0]); i++)
+		{
+			bool exists = false;
+
+			sqlite3_reset (stmt);
+			sqlite3_bind_text (stmt, 1, migrations_columns[i][0], -1, NULL);
+
+			while (1)
+				{
+					int s = sqlite3_step (stmt);
+					if (s == SQLITE_ROW)
+						exists = sqlite3_column_int (stmt, 0) > 0;
+					else if (s == SQLITE_DONE)
+						break;
+					else
+						{
+							err = 1;
+							fprintf (stderr, "migrate.c: ensure_migrations_columns(): error while performing query: %s\n", sqlite3_errmsg (db));
+							goto teardown;
+						}
+				}
+
+			if (exists)
+				continue;
+
+			alter = sqlite3_mprintf ("ALTER TABLE migrations ADD COLUMN %s %s", migrations_columns[i][0], migrations_columns[i][1]);
+			if (!alter)
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: ensure_migrations_columns(): out of memory.\n");
+					goto teardown;
+				}
+
+			err = db_exec (alter);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: ensure_migrations_columns(): can't add column %s.\n", migrations_columns[i][0]);
+					goto teardown;
+				}
+
+			sqlite3_free (alter);
+			alter = NULL;
+		}
+
+	teardown:
+	if (alter) sqlite3_free (alter);
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+int
 find_last_migration_applied ()
 {
 	int err = 0;
 	sqlite3_stmt *stmt = NULL;
 	char query[BUFSIZ] = "SELECT name FROM migrations ORDER BY name DESC LIMIT 1";
 
+	// Not left over from a previous database, when called more than once.
+	last_migration_applied[0] = 0;
+
 	err = db_exec ("CREATE TABLE IF NOT EXISTS migrations(name TEXT NOT NULL)");
 	if (err)
 		{
@@ -43,6 +160,13 @@ find_last_migration_applied ()
 			goto teardown;
 		}
 
+	err = ensure_migrations_columns ();
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: find_last_migration_table(): can't upgrade migrations table.\n");
+			goto teardown;
+		}
+
 	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
 	if (rc != SQLITE_OK)
 		{
@@ -75,12 +199,39 @@ find_last_migration_applied ()
 	return err;
 }
 
+/*
+ * Down migrations are named after their migration, without the `.sql` or
+ * `.so` extension, followed by `.down.sql`, `.down.so` for plugins, or
+ * `.down` for executables.
+ */
+bool
+is_down_migration (const char *migration_file)
+{
+	size_t len = strnlen (migration_file, MAX_PATH_LEN);
+	if (len > 5 && strncmp (migration_file + len - 5, ".down", MAX_PATH_LEN) == 0)
+		return true;
+
+	if (len > 8 && strncmp (migration_file + len - 8, ".down.so", MAX_PATH_LEN) == 0)
+		return true;
+
+	return len > 9 && strncmp (migration_file + len - 9, ".down.sql", MAX_PATH_LEN) == 0;
+}
+
 static int
 filter_applied_migrations (const struct dirent *entry)
 {
 	if (strncmp (entry->d_name, ".", 1) == 0)
 		return 0;
 
+	if (strncmp (entry->d_name, BASELINE_FILE, MAX_PATH_LEN) == 0)
+		return 0;
+
+	if (is_down_migration (entry->d_name))
+		return 0;
+
+	if (until_migration[0] != 0 && strncmp (entry->d_name, until_migration, MAX_NAME_LEN) > 0)
+		return 0;
+
 	return strncmp (entry->d_name, last_migration_applied, MAX_PATH_LEN) > 0;
 }
 
@@ -102,18 +253,22 @@ find_migration_files (const char migrations_dir[MAX_PATH_LEN], struct dirent ***
 	return err;
 }
 
+/*
+ * Reads the whole migration file.
+ *
+ * Caller must free `content`.
+ */
 static int
-apply_sql_migration (const char migration_file[MAX_PATH_LEN])
+read_migration_file (char *content[static 1], const char migration_file[MAX_PATH_LEN])
 {
 	int err = 0;
 	FILE *file = NULL;
-	char *sql = NULL;
 
 	file = fopen (migration_file, "r");
 	if (!file)
 		{
 			err = 1;
-			fprintf (stderr, "migrate.c: apply_sql_migration(): can't open migration file: %s\n", migration_file);
+			fprintf (stderr, "migrate.c: read_migration_file(): can't open migration file: %s\n", migration_file);
 			goto teardown;
 		}
 
@@ -123,25 +278,57 @@ apply_sql_migration (const char migration_file[MAX_PATH_LEN])
 	if (size < 0)
 		{
 			err = 1;
-			fprintf (stderr, "migrate.c: apply_sql_migration(): error while reading migration file.\n");
+			fprintf (stderr, "migrate.c: read_migration_file(): error while reading migration file.\n");
 			goto teardown;
 		}
 
 	fseek (file, 0, SEEK_SET);
 
-	sql = calloc (1, size + 1);
-	if (!sql)
+	*content = calloc (1, size + 1);
+	if (!*content)
 		{
 			err = 1;
-			fprintf (stderr, "migrate.c: apply_sql_migration(): out of memory.\n");
+			fprintf (stderr, "migrate.c: read_migration_file(): out of memory.\n");
 			goto teardown;
 		}
 
-	size_t read = fread (sql, 1, size, file);
+	size_t read = fread (*content, 1, size, file);
 	if (read != (size_t) size)
 		{
 			err = 1;
-			fprintf (stderr, "migrate.c: apply_sql_migration(): could not read the whole migration file: %s\n", migration_file);
+			fprintf (stderr, "migrate.c: read_migration_file(): could not read the whole migration file: %s\n", migration_file);
+			goto teardown;
+		}
+
+	teardown:
+	if (file) fclose (file);
+	return err;
+}
+
+bool
+is_sql_migration (const char *migration_file)
+{
+	size_t len = strnlen (migration_file, MAX_PATH_LEN);
+	return len > 4 && strncmp (migration_file + len - 4, ".sql", MAX_PATH_LEN) == 0;
+}
+
+bool
+is_plugin_migration (const char *migration_file)
+{
+	size_t len = strnlen (migration_file, MAX_PATH_LEN);
+	return len > 3 && strncmp (migration_file + len - 3, ".so", MAX_PATH_LEN) == 0;
+}
+
+int
+apply_sql_migration (const char migration_file[MAX_PATH_LEN])
+{
+	int err = 0;
+	char *sql = NULL;
+
+	err = read_migration_file (&sql, migration_file);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_sql_migration(): can't read migration file: %s\n", migration_file);
 			goto teardown;
 		}
 
@@ -153,283 +340,1567 @@ apply_sql_migration (const char migration_file[MAX_PATH_LEN])
 		}
 
 	teardown:
-	if (file) fclose (file);
 	if (sql) free (sql);
 	return err;
 }
 
-static int
-apply_executable_migration (const char migration_file[MAX_PATH_LEN], const char database_path[MAX_PATH_LEN])
+/*
+ * Loads a plugin migration and calls its `exodus_migration()` function on
+ * our connection, inside a savepoint: if it returns non zero, everything it
+ * did is rolled back. The plugin stays loaded until the connection is
+ * closed.
+ */
+int
+apply_plugin_migration (const char migration_file[MAX_PATH_LEN], const char database_path[MAX_PATH_LEN])
 {
 	int err = 0;
+	bool in_savepoint = false;
+	plugin_migration_t plugin_migration = NULL;
 
-	pid_t pid = fork ();
-	if (pid < 0)
+	void *handle = dlopen (migration_file, RTLD_NOW | RTLD_LOCAL);
+	if (!handle)
 		{
 			err = 1;
-			fprintf (stderr, "migrate.c: apply_executable_migration(): can't fork to execute migration %s\n", migration_file);
+			fprintf (stderr, "migrate.c: apply_plugin_migration(): can't load plugin: %s\n", dlerror ());
 			goto teardown;
 		}
 
-	if (pid == 0)
-		{
-			const char *args[] = { migration_file, database_path, NULL };
-			execve (args[0], (char **) args, environ);
-			exit (127);
-		}
-
-	int status = 0;
-	waitpid (pid, &status, 0);
-
-	if (WIFSIGNALED (status))
+	// ISO C doesn't allow casting `void *` to a function pointer, POSIX does it this way.
+	*(void **) (&plugin_migration) = dlsym (handle, PLUGIN_SYMBOL);
+	if (!plugin_migration)
 		{
 			err = 1;
-			fprintf (stderr, "migrate.c: apply_executable_migration(): migration executable was killed: %s\n", migration_file);
+			fprintf (stderr, "migrate.c: apply_plugin_migration(): plugin does not export " PLUGIN_SYMBOL "(): %s\n", migration_file);
 			goto teardown;
 		}
 
-	err = WEXITSTATUS (status);
+	err = db_exec ("SAVEPOINT exodus_plugin");
 	if (err)
 		{
-			fprintf (stderr, "migrate.c: apply_executable_migration(): migration executable returned non zero status (%d): %s\n", err, migration_file);
+			fprintf (stderr, "migrate.c: apply_plugin_migration(): can't start savepoint.\n");
 			goto teardown;
 		}
 
-	teardown:
-	return err;
-}
-
-static int
-append_name_in_migrations_table (const char migration_file[MAX_NAME_LEN])
-{
-	int err = 0;
-	sqlite3_stmt *stmt = NULL;
-	char query[BUFSIZ] = "INSERT INTO migrations(name) VALUES (?)";
+	in_savepoint = true;
 
-	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
-	if (rc != SQLITE_OK)
+	err = plugin_migration (db, database_path);
+	if (err)
 		{
-			err = 1;
-			fprintf (stderr, "migrate.c: append_name_in_migrations_table(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			fprintf (stderr, "migrate.c: apply_plugin_migration(): plugin returned non zero status (%d): %s\n", err, migration_file);
 			goto teardown;
 		}
 
-	sqlite3_bind_text (stmt, 1, migration_file, -1, NULL);
-
-	while (1)
+	err = db_exec ("RELEASE exodus_plugin");
+	if (err)
 		{
-			int s = sqlite3_step (stmt);
-			if (s == SQLITE_ROW)
-				continue;
-			else if (s == SQLITE_DONE)
-				break;
-			else
-				{
-					err = 1;
-					fprintf (stderr, "migrate.c: append_name_in_migrations_table(): error while performing query: %s\n", sqlite3_errmsg (db));
-					goto teardown;
-				}
+			fprintf (stderr, "migrate.c: apply_plugin_migration(): can't release savepoint, did the plugin end our transaction?\n");
+			goto teardown;
 		}
 
-	teardown:
-	if (stmt) sqlite3_finalize (stmt);
+	in_savepoint = false;
 
+	teardown:
+	if (in_savepoint) db_exec ("ROLLBACK TO exodus_plugin; RELEASE exodus_plugin");
+	if (handle) hold_plugin (handle);
 	return err;
 }
 
+/*
+ * Applies pending SQL migrations to an empty in-memory copy of the schema,
+ * so that broken migrations are found before backing up the database.
+ *
+ * Executables and plugins can't be applied there, so we stop at the first
+ * one: later migrations may depend on what it does.
+ */
 static int
-dump_structure (const char *structure_path, const char *migration_file)
+preflight_migrations (const char migrations_dir[MAX_PATH_LEN], struct dirent **migration_files, size_t migration_files_len, const char init_path[MAX_PATH_LEN])
 {
 	int err = 0;
-	sqlite3_stmt *stmt = NULL;
-	char query[BUFSIZ] = "SELECT sql FROM sqlite_schema WHERE sql IS NOT NULL ORDER BY rowid";
-	FILE *file = NULL;
+	sqlite3 *preflight = NULL;
+	char *sql = NULL;
 
-	file = fopen (structure_path, "w");
-	if (!file)
+	err = open_schema_copy (&preflight, init_path);
+	if (err)
 		{
-			err = 1;
-			fprintf (stderr, "migrate.c: dump_structure(): can't open structure file: %s\n", structure_path);
+			fprintf (stderr, "migrate.c: preflight_migrations(): can't copy schema.\n");
 			goto teardown;
 		}
 
-	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
-	if (rc != SQLITE_OK)
+	// The copy has no rows, so foreign keys enabled by the init file would reject rows referencing existing ones.
+	err = db_exec_on (preflight, "PRAGMA foreign_keys = OFF");
+	if (err)
 		{
-			err = 1;
-			fprintf (stderr, "migrate.c: dump_structure(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			fprintf (stderr, "migrate.c: preflight_migrations(): can't disable foreign keys.\n");
 			goto teardown;
 		}
 
-	while (1)
+	for (size_t i = 0; i < migration_files_len; i++)
 		{
-			int s = sqlite3_step (stmt);
-			if (s == SQLITE_ROW)
+			const char *migration_file = migration_files[i]->d_name;
+			char migration_path[MAX_PATH_LEN] = {0};
+
+			if (!is_sql_migration (migration_file))
 				{
-					const char *sql = (const char *) sqlite3_column_text (stmt, 0);
-					fprintf (file, "%s;\n\n", sql);
+					printf ("Preflight stopped at %s migration %s.\n", is_plugin_migration (migration_file) ? "plugin" : "executable", migration_file);
+					break;
 				}
-			else if (s == SQLITE_DONE)
-				break;
-			else
+
+			int written = snprintf (migration_path, MAX_PATH_LEN, "%s/%s", migrations_dir, migration_file);
+			if (written >= MAX_PATH_LEN)
 				{
 					err = 1;
-					fprintf (stderr, "migrate.c: dump_structure(): error while performing query: %s\n", sqlite3_errmsg (db));
+					fprintf (stderr, "migrate.c: preflight_migrations(): truncated migration path: %s\n", migration_path);
 					goto teardown;
 				}
-		}
 
-	char *escaped = sqlite3_mprintf("%Q", migration_file);
-	if (!escaped)
-		{
-			err = 1;
-			fprintf (stderr, "migrate.c: dump_structure(): out of memory while escaping migration name.\n");
-			goto teardown;
-		}
+			err = read_migration_file (&sql, migration_path);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: preflight_migrations(): can't read migration file: %s\n", migration_path);
+					goto teardown;
+				}
 
-	fprintf (file, "INSERT INTO migrations(name) VALUES (%s);\n", escaped);
-	sqlite3_free (escaped);
+			err = db_exec_on (preflight, sql);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: preflight_migrations(): migration fails on the current schema: %s\n", migration_path);
+					goto teardown;
+				}
 
-	teardown:
-	if (stmt) sqlite3_finalize (stmt);
-	if (file) fclose (file);
+			free (sql);
+			sql = NULL;
+		}
 
+	teardown:
+	if (sql) free (sql);
+	if (preflight) sqlite3_close (preflight);
 	return err;
 }
 
-int
-migrate (options_t *options)
+/*
+ * Estimates the cost of tables recreation in pending migrations.
+ *
+ * Tables to recreate are found from the markers left by `generate --recreate`.
+ * Tables which don't exist yet (because a previous pending migration will
+ * create them) are ignored.
+ */
+static int
+estimate_pending_recreates (const char migrations_dir[MAX_PATH_LEN], struct dirent **migration_files, size_t migration_files_len, sqlite3_int64 copy_bytes[static 1])
 {
 	int err = 0;
-	bool should_restore_db = false;
-
-	struct dirent **migration_files = NULL;
-	size_t migration_files_len = 0;
-	char backup_file[MAX_PATH_LEN] = {0};
-	char fail_file[MAX_PATH_LEN] = {0};
-	char last_migration_file[MAX_PATH_LEN] = {0};
-
-	int written = snprintf (backup_file, MAX_PATH_LEN, "%s.prev", options->database);
-	if (written >= MAX_PATH_LEN)
-		{
-			err = 1;
-			fprintf (stderr, "migrate.c: migrate(): truncated backup database file path:%s\n", backup_file);
-			goto teardown;
-		}
-
-	written = snprintf (fail_file, MAX_PATH_LEN, "%s.failed", options->database);
-	if (written >= MAX_PATH_LEN)
-		{
-			err = 1;
-			fprintf (stderr, "migrate.c: migrate(): truncated fail database file path:%s\n", fail_file);
-			goto teardown;
-		}
-
-	err = open_db (options->database, options->init);
-	if (err)
-		{
-			fprintf (stderr, "migrate.c: migrate(): can't open database.\n");
-			goto teardown;
-		}
-
-	err = find_last_migration_applied ();
-	if (err)
-		{
-			fprintf (stderr, "migrate.c: migrate(): can't find last migration applied.\n");
-			goto teardown;
-		}
-
-	err = find_migration_files (options->migrations, &migration_files, &migration_files_len);
-	if (err)
-		{
-			fprintf (stderr, "migrate.c: migrate(): can't find migration files.\n");
-			goto teardown;
-		}
-
-	if (migration_files_len == 0)
-		goto teardown;
-
-	err = backup_db (options->database, backup_file);
-	if (err)
-		{
-			fprintf (stderr, "migrate.c: migrate(): can't backup database.\n");
-			goto teardown;
-		}
+	char *sql = NULL;
+	recreate_estimate_t estimate = {0};
 
 	for (size_t i = 0; i < migration_files_len; i++)
 		{
 			const char *migration_file = migration_files[i]->d_name;
 			char migration_path[MAX_PATH_LEN] = {0};
-			int written = snprintf (migration_path, MAX_PATH_LEN, "%s/%s", options->migrations, migration_file);
+
+			if (!is_sql_migration (migration_file))
+				continue;
+
+			int written = snprintf (migration_path, MAX_PATH_LEN, "%s/%s", migrations_dir, migration_file);
 			if (written >= MAX_PATH_LEN)
 				{
-					should_restore_db = true;
-					fprintf (stderr, "migrate.c: migrate(): truncated migration path: %s\n", migration_path);
+					err = 1;
+					fprintf (stderr, "migrate.c: estimate_pending_recreates(): truncated migration path: %s\n", migration_path);
 					goto teardown;
 				}
 
-			printf ("Applying migration %s…\n", migration_path);
-
-			snprintf (last_migration_file, MAX_PATH_LEN, "%s", migration_file);
-
-			if (strnlen (migration_file, MAX_PATH_LEN) > 4 && strncmp (migration_file + strnlen (migration_file, MAX_PATH_LEN) - 4, ".sql", MAX_PATH_LEN) == 0)
+			err = read_migration_file (&sql, migration_path);
+			if (err)
 				{
-					err = apply_sql_migration (migration_path);
-					if (err)
-						{
-							should_restore_db = true;
-							fprintf (stderr, "migrate.c: migrate(): can't apply migration: %s\n", migration_path);
-							goto teardown;
-						}
+					fprintf (stderr, "migrate.c: estimate_pending_recreates(): can't read migration file: %s\n", migration_path);
+					goto teardown;
 				}
-			else
+
+			for (char *line = sql; line && *line; line = strchr (line, '\n') ? strchr (line, '\n') + 1 : NULL)
 				{
-					if (!is_executable (migration_path))
-						{
-							err = 1;
-							should_restore_db = true;
-							fprintf (stderr, "migrate.c: migrate(): migration is not an executable and does not have .sql extension: %s\n", migration_path);
-							goto teardown;
-						}
+					if (strncmp (line, RECREATE_MARKER, strlen (RECREATE_MARKER)) != 0)
+						continue;
 
-					err = apply_executable_migration (migration_path, options->database);
+					char table_name[MAX_NAME_LEN] = {0};
+					const char *start = line + strlen (RECREATE_MARKER);
+					size_t len = strcspn (start, "\r\n");
+					snprintf (table_name, MAX_NAME_LEN, "%.*s", (int) len, start);
+
+					if (sqlite3_table_column_metadata (db, "main", table_name, NULL, NULL, NULL, NULL, NULL, NULL) != SQLITE_OK)
+						continue;
+
+					err = estimate_recreate (&estimate, table_name);
 					if (err)
 						{
-							should_restore_db = true;
-							fprintf (stderr, "migrate.c: migrate(): can't apply migration: %s\n", migration_path);
+							fprintf (stderr, "migrate.c: estimate_pending_recreates(): can't estimate recreation of table %s.\n", table_name);
 							goto teardown;
 						}
+
+					print_recreate_estimate (&estimate);
+					*copy_bytes += recreate_copy_bytes (&estimate);
+					free_recreate_estimate (&estimate);
 				}
 
-			// Each migration may have set its own PRAGMAs, so let's reset to a clean state.
-			err = reopen_db (options->database, options->init);
-			if (err)
+			free (sql);
+			sql = NULL;
+		}
+
+	teardown:
+	free_recreate_estimate (&estimate);
+	if (sql) free (sql);
+	return err;
+}
+
+/*
+ * Applies the memory and CPU limits in the executable's process, before
+ * exec. Going over the CPU limit sends SIGXCPU, then SIGKILL after the
+ * grace period.
+ */
+static int
+limit_resources (const options_t options[static 1])
+{
+	int err = 0;
+
+	if (options->memory_limit > 0)
+		{
+			struct rlimit limit = { .rlim_cur = (rlim_t) options->memory_limit, .rlim_max = (rlim_t) options->memory_limit };
+			err = setrlimit (RLIMIT_AS, &limit);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: limit_resources(): can't limit memory.\n");
+					goto teardown;
+				}
+		}
+
+	if (options->cpu_limit > 0)
+		{
+			struct rlimit limit = { .rlim_cur = (rlim_t) options->cpu_limit, .rlim_max = (rlim_t) options->cpu_limit + KILL_GRACE_SECONDS };
+			err = setrlimit (RLIMIT_CPU, &limit);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: limit_resources(): can't limit CPU time.\n");
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Waits for the executable, collecting its resource usage and rendering
+ * what it writes on the progress pipe. Its process group receives SIGTERM
+ * when we are interrupted or once the timeout is reached, then SIGKILL if
+ * it's still running after the grace period.
+ */
+static int
+wait_executable (pid_t pid, int progress_fd, const options_t options[static 1], int status[static 1], struct rusage usage[static 1], progress_t progress[static 1], bool timed_out[static 1])
+{
+	int err = 0;
+	bool terminated = false;
+	bool killed = false;
+	double terminated_at = 0;
+	struct pollfd progress_poll = { .fd = progress_fd, .events = POLLIN };
+
+	while (1)
+		{
+			pid_t done = wait4 (pid, status, WNOHANG, usage);
+			if (done == pid)
+				break;
+
+			if (done < 0)
+				{
+					if (errno == EINTR)
+						continue;
+
+					err = 1;
+					fprintf (stderr, "migrate.c: wait_executable(): can't wait for migration executable.\n");
+					goto teardown;
+				}
+
+			double elapsed = elapsed_since (&progress->start);
+			if (!terminated && interrupted)
+				{
+					fprintf (stderr, "Interrupted, sending SIGTERM to migration executable.\n");
+					kill (-pid, SIGTERM);
+					terminated = true;
+					terminated_at = elapsed;
+				}
+			else if (!terminated && options->timeout > 0 && elapsed >= options->timeout)
+				{
+					fprintf (stderr, "Migration executable timed out after %ds, sending SIGTERM.\n", options->timeout);
+					kill (-pid, SIGTERM);
+					terminated = true;
+					terminated_at = elapsed;
+					*timed_out = true;
+				}
+			else if (terminated && !killed && elapsed >= terminated_at + KILL_GRACE_SECONDS)
+				{
+					fprintf (stderr, "Migration executable still running %ds after SIGTERM, sending SIGKILL.\n", KILL_GRACE_SECONDS);
+					kill (-pid, SIGKILL);
+					killed = true;
+				}
+
+			// Once the pipe is closed, this only waits: poll() ignores negative file descriptors.
+			if (poll (&progress_poll, 1, 10) > 0)
+				{
+					bool eof = false;
+					err = read_progress (progress, progress_poll.fd, &eof);
+					if (err)
+						{
+							fprintf (stderr, "migrate.c: wait_executable(): can't read progress.\n");
+							goto teardown;
+						}
+
+					if (eof)
+						progress_poll.fd = -1;
+				}
+		}
+
+	// Lines written just before exiting.
+	while (progress_poll.fd >= 0 && poll (&progress_poll, 1, 0) > 0)
+		{
+			bool eof = false;
+			err = read_progress (progress, progress_poll.fd, &eof);
+			if (err || eof)
+				break;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Builds the environment of executables: ours, plus `variable`.
+ *
+ * Caller must free `env`.
+ */
+static int
+build_executable_environment (char **env[static 1], char variable[static 1])
+{
+	int err = 0;
+	size_t len = 0;
+
+	while (environ[len])
+		len++;
+
+	*env = calloc (len + 2, sizeof (char *));
+	if (!*env)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: build_executable_environment(): out of memory.\n");
+			goto teardown;
+		}
+
+	memcpy (*env, environ, len * sizeof (char *));
+	(*env)[len] = variable;
+
+	teardown:
+	return err;
+}
+
+/*
+ * Runs a migration executable, passing it the database path, within the
+ * limits given in options. Its resource usage is retrieved in `usage`.
+ *
+ * The executable inherits the writing end of a pipe, announced in the
+ * `EXODUS_PROGRESS_FD` environment variable, on which it can report its
+ * progress. The last progress is printed if it fails.
+ */
+int
+apply_executable_migration (const char migration_file[MAX_PATH_LEN], const char database_path[MAX_PATH_LEN], const options_t options[static 1], struct rusage usage[static 1])
+{
+	int err = 0;
+	int status = 0;
+	bool timed_out = false;
+	int progress_pipe[2] = { -1, -1 };
+	char **env = NULL;
+	char progress_variable[MAX_NAME_LEN] = {0};
+	progress_t progress = {0};
+
+	err = pipe (progress_pipe);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_executable_migration(): can't create progress pipe.\n");
+			goto teardown;
+		}
+
+	fcntl (progress_pipe[0], F_SETFD, FD_CLOEXEC);
+
+	snprintf (progress_variable, MAX_NAME_LEN, PROGRESS_FD_VARIABLE "=%d", progress_pipe[1]);
+	err = build_executable_environment (&env, progress_variable);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_executable_migration(): can't build environment.\n");
+			goto teardown;
+		}
+
+	start_progress (&progress);
+
+	pid_t pid = fork ();
+	if (pid < 0)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_executable_migration(): can't fork to execute migration %s\n", migration_file);
+			goto teardown;
+		}
+
+	// Both sides set the process group, so it exists before we may signal it.
+	if (pid == 0)
+		{
+			setpgid (0, 0);
+			if (limit_resources (options))
+				exit (127);
+
+			const char *args[] = { migration_file, database_path, NULL };
+			execve (args[0], (char **) args, env);
+			exit (127);
+		}
+
+	setpgid (pid, pid);
+	close (progress_pipe[1]);
+	progress_pipe[1] = -1;
+
+	err = wait_executable (pid, progress_pipe[0], options, &status, usage, &progress, &timed_out);
+	finish_progress (&progress);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_executable_migration(): can't wait for migration %s\n", migration_file);
+			goto teardown;
+		}
+
+	if (timed_out)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_executable_migration(): migration executable timed out: %s\n", migration_file);
+			goto teardown;
+		}
+
+	if (interrupted)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_executable_migration(): interrupted while running migration executable: %s\n", migration_file);
+			goto teardown;
+		}
+
+	if (WIFSIGNALED (status))
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_executable_migration(): migration executable was killed by signal %d: %s\n", WTERMSIG (status), migration_file);
+			goto teardown;
+		}
+
+	err = WEXITSTATUS (status);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_executable_migration(): migration executable returned non zero status (%d): %s\n", err, migration_file);
+			goto teardown;
+		}
+
+	teardown:
+	if (err) print_last_progress (&progress);
+	if (progress_pipe[0] >= 0) close (progress_pipe[0]);
+	if (progress_pipe[1] >= 0) close (progress_pipe[1]);
+	if (env) free (env);
+
+	return err;
+}
+
+/*
+ * Records the migration as applied, with its changeset if captured, its
+ * duration, the JSON manifest of the objects it touched, and the schema
+ * fingerprint it left.
+ */
+static int
+append_name_in_migrations_table (const char migration_file[static 1], const changeset_t changeset[static 1], const migration_report_t measure[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char *manifest = NULL;
+	uint64_t fingerprint = 0;
+	char fingerprint_hex[HASH_HEX_LEN] = {0};
+	char query[BUFSIZ] = "INSERT INTO migrations(name, changeset, duration, manifest, fingerprint) VALUES (?, ?, ?, ?, ?)";
+
+	err = manifest_to_json (&measure->manifest, &manifest);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: append_name_in_migrations_table(): can't serialize manifest.\n");
+			goto teardown;
+		}
+
+	err = schema_fingerprint (&fingerprint, db);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: append_name_in_migrations_table(): can't compute schema fingerprint.\n");
+			goto teardown;
+		}
+
+	hash_to_hex (fingerprint_hex, fingerprint);
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: append_name_in_migrations_table(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, migration_file, -1, NULL);
+	if (changeset->data)
+		sqlite3_bind_blob (stmt, 2, changeset->data, changeset->size, NULL);
+	else
+		sqlite3_bind_null (stmt, 2);
+	sqlite3_bind_double (stmt, 3, measure->seconds);
+	if (measure->manifest.tracked)
+		sqlite3_bind_text (stmt, 4, manifest, -1, NULL);
+	else
+		sqlite3_bind_null (stmt, 4);
+	sqlite3_bind_text (stmt, 5, fingerprint_hex, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				continue;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: append_name_in_migrations_table(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	if (manifest) sqlite3_free (manifest);
+
+	return err;
+}
+
+/*
+ * Syncs a file written at `tmp_path` and moves it to `path`, unless `path`
+ * already has the same content, in which case it's left untouched. Readers
+ * never see a partial file, and unchanged files keep their modification
+ * time. The file is closed in any case.
+ */
+static int
+replace_file (FILE *file, const char tmp_path[MAX_PATH_LEN + 5], const char path[MAX_PATH_LEN])
+{
+	int err = 0;
+	uint64_t tmp_hash = HASH_SEED;
+	uint64_t current_hash = HASH_SEED;
+	char directory[MAX_PATH_LEN] = {0};
+
+	if (fflush (file) != 0 || fsync (fileno (file)) != 0)
+		err = 1;
+	if (fclose (file) != 0)
+		err = 1;
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: replace_file(): can't write file: %s\n", tmp_path);
+			goto teardown;
+		}
+
+	if (access (path, F_OK) == 0)
+		{
+			err = hash_file (&tmp_hash, tmp_path) || hash_file (&current_hash, path);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: replace_file(): can't compare files.\n");
+					goto teardown;
+				}
+
+			if (tmp_hash == current_hash)
+				goto teardown;
+		}
+
+	err = rename (tmp_path, path);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: replace_file(): can't move file to %s\n", path);
+			goto teardown;
+		}
+
+	// The rename itself is only durable once the directory is synced.
+	snprintf (directory, MAX_PATH_LEN, "%s", path);
+	int fd = open (dirname (directory), O_RDONLY);
+	if (fd >= 0)
+		{
+			fsync (fd);
+			close (fd);
+		}
+
+	teardown:
+	unlink (tmp_path);
+	return err;
+}
+
+/*
+ * Writes the structure file through a temporary file, see `replace_file()`.
+ */
+int
+dump_structure (const char *structure_path, const char *migration_file)
+{
+	int err = 0;
+	FILE *file = NULL;
+	uint64_t fingerprint = 0;
+	char fingerprint_hex[HASH_HEX_LEN] = {0};
+	char tmp_path[MAX_PATH_LEN + 5] = {0};
+
+	snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", structure_path);
+
+	err = schema_fingerprint (&fingerprint, db);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: dump_structure(): can't compute schema fingerprint.\n");
+			goto teardown;
+		}
+
+	hash_to_hex (fingerprint_hex, fingerprint);
+
+	file = fopen (tmp_path, "w");
+	if (!file)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: dump_structure(): can't open structure file: %s\n", tmp_path);
+			goto teardown;
+		}
+
+	fprintf (file, FINGERPRINT_PREFIX "%s\n\n", fingerprint_hex);
+
+	err = dump_schema (db, file, true);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: dump_structure(): can't dump schema.\n");
+			goto teardown;
+		}
+
+	if (migration_file[0] != 0)
+		{
+			char *escaped = sqlite3_mprintf("%Q", migration_file);
+			if (!escaped)
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: dump_structure(): out of memory while escaping migration name.\n");
+					goto teardown;
+				}
+
+			fprintf (file, "INSERT INTO migrations(name) VALUES (%s);\n", escaped);
+			sqlite3_free (escaped);
+		}
+
+	err = replace_file (file, tmp_path, structure_path);
+	file = NULL;
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: dump_structure(): can't replace structure file: %s\n", structure_path);
+			goto teardown;
+		}
+
+	teardown:
+	if (file)
+		{
+			fclose (file);
+			unlink (tmp_path);
+		}
+
+	return err;
+}
+
+/*
+ * Writes the statistics of tables and indexes, see `write_table_stats()`.
+ */
+static int
+dump_table_stats (const char stats_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	FILE *file = NULL;
+	char tmp_path[MAX_PATH_LEN + 5] = {0};
+
+	snprintf (tmp_path, sizeof (tmp_path), "%s.tmp", stats_path);
+
+	file = fopen (tmp_path, "w");
+	if (!file)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: dump_table_stats(): can't open stats file: %s\n", tmp_path);
+			goto teardown;
+		}
+
+	err = write_table_stats (file);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: dump_table_stats(): can't write table statistics.\n");
+			goto teardown;
+		}
+
+	err = replace_file (file, tmp_path, stats_path);
+	file = NULL;
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: dump_table_stats(): can't replace stats file: %s\n", stats_path);
+			goto teardown;
+		}
+
+	teardown:
+	if (file)
+		{
+			fclose (file);
+			unlink (tmp_path);
+		}
+
+	return err;
+}
+
+static sqlite3_int64
+file_size (const char path[static 1])
+{
+	struct stat st;
+	if (stat (path, &st) != 0)
+		return 0;
+
+	return (sqlite3_int64) st.st_size;
+}
+
+/*
+ * Size of the rollback journal or of the WAL file, whichever exists.
+ */
+static sqlite3_int64
+journal_size (const char database[MAX_PATH_LEN])
+{
+	char path[MAX_PATH_LEN + 10] = {0};
+
+	snprintf (path, sizeof (path), "%s-journal", database);
+	sqlite3_int64 journal = file_size (path);
+
+	snprintf (path, sizeof (path), "%s-wal", database);
+	sqlite3_int64 wal = file_size (path);
+
+	return journal > wal ? journal : wal;
+}
+
+/*
+ * In rollback journal mode, the journal is deleted at the end of each
+ * transaction. Dry runs switch to `PERSIST` so that it stays on disk with
+ * the size it reached, and empty it before each migration. WAL files stay
+ * until the connection is closed, so they are left alone.
+ */
+static int
+keep_journal (const char database[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	bool wal = false;
+	char journal_path[MAX_PATH_LEN + 10] = {0};
+
+	int rc = sqlite3_prepare_v2 (db, "PRAGMA journal_mode", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: keep_journal(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				wal = strncmp ((const char *) sqlite3_column_text (stmt, 0), "wal", 10) == 0;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: keep_journal(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	if (wal)
+		goto teardown;
+
+	err = db_exec ("PRAGMA journal_mode = PERSIST");
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: keep_journal(): can't change journal mode.\n");
+			goto teardown;
+		}
+
+	snprintf (journal_path, sizeof (journal_path), "%s-journal", database);
+	if (file_size (journal_path) > 0 && truncate (journal_path, 0) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: keep_journal(): can't empty journal: %s\n", journal_path);
+			goto teardown;
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Removes the dry run clone, and the journal files it may have left.
+ */
+static void
+remove_dry_run_database (const char database[MAX_PATH_LEN])
+{
+	char path[MAX_PATH_LEN + 10] = {0};
+	const char *suffixes[] = { "", "-journal", "-wal", "-shm" };
+
+	for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+		{
+			snprintf (path, sizeof (path), "%s%s", database, suffixes[i]);
+			unlink (path);
+		}
+}
+
+static int
+find_schema_version (int version[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	int rc = sqlite3_prepare_v2 (db, "PRAGMA schema_version", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: find_schema_version(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*version = sqlite3_column_int (stmt, 0);
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: find_schema_version(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Applies a migration, and records it in the migrations table.
+ *
+ * With `--capture`, the changes of data-only migrations are recorded as a
+ * changeset: through a session for SQL migrations, and by comparing with a
+ * copy of the database made beforehand for executables, which use their own
+ * connection. With `--changesets`, executables and plugins are replaced by
+ * the changeset recorded for them in an other database, when there is one.
+ */
+static int
+apply_migration (options_t *options, const char database[MAX_PATH_LEN], const char migration_file[static 1], sqlite3 *changesets_source, run_report_t report[static 1])
+{
+	int err = 0;
+	char migration_path[MAX_PATH_LEN] = {0};
+	char capture_path[MAX_PATH_LEN] = {0};
+	migration_report_t measure = { .pages_written = -1, .rows_changed = -1, .lock_wait = -1 };
+	changeset_t changeset = {0};
+	changeset_t recorded = {0};
+	sqlite3_session *session = NULL;
+	statement_progress_t statement_progress = {0};
+	int schema_version = 0;
+	int unused = 0;
+	bool is_sql = false;
+	bool is_plugin = false;
+	bool through_connection = false;
+	bool schema_changed = false;
+	bool reported = false;
+
+	int written = snprintf (migration_path, MAX_PATH_LEN, "%s/%s", options->migrations, migration_file);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_migration(): truncated migration path: %s\n", migration_path);
+			goto teardown;
+		}
+
+	written = snprintf (capture_path, MAX_PATH_LEN, "%s.capture", database);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_migration(): truncated capture database path: %s\n", capture_path);
+			goto teardown;
+		}
+
+	is_sql = is_sql_migration (migration_file);
+	is_plugin = is_plugin_migration (migration_file);
+	if (!is_sql && !is_plugin && !is_executable (migration_path))
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_migration(): migration is not an executable and does not have .sql or .so extension: %s\n", migration_path);
+			goto teardown;
+		}
+
+	if (!is_sql && changesets_source)
+		{
+			err = find_recorded_changeset (&recorded, changesets_source, migration_file);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't retrieve recorded changeset.\n");
+					goto teardown;
+				}
+		}
+
+	through_connection = is_sql || is_plugin || recorded.data;
+
+	if (recorded.data)
+		printf ("Applying recorded changeset for migration %s…\n", migration_path);
+	else
+		printf ("Applying migration %s…\n", migration_path);
+
+	snprintf (measure.name, MAX_PATH_LEN, "%s", migration_file);
+
+	if (options->dry_run)
+		{
+			err = keep_journal (database);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't keep journal to measure it.\n");
+					goto teardown;
+				}
+		}
+
+	if (options->capture)
+		{
+			err = find_schema_version (&schema_version);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't find schema version.\n");
+					goto teardown;
+				}
+
+			if (through_connection)
+				err = start_capture (&session);
+			else
+				err = backup_db (database, capture_path);
+
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't start capturing changes.\n");
+					goto teardown;
+				}
+		}
+
+	measure.kind = recorded.data ? "changeset" : is_sql ? "sql" : is_plugin ? "plugin" : "executable";
+	measure.started_at = wall_clock ();
+
+	sqlite3_int64 size_before = file_size (database);
+	sqlite3_int64 changes_before = sqlite3_total_changes64 (db);
+	sqlite3_db_status (db, SQLITE_DBSTATUS_CACHE_WRITE, &unused, &unused, 1);
+
+	if (through_connection)
+		{
+			err = start_statement_progress (&statement_progress, db);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't watch statements progress.\n");
+					goto teardown;
+				}
+
+			start_manifest (&measure.manifest, db);
+		}
+
+	struct timespec start = {0};
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	if (recorded.data)
+		err = apply_changeset (&recorded);
+	else if (is_sql)
+		err = apply_sql_migration (migration_path);
+	else if (is_plugin)
+		err = apply_plugin_migration (migration_path, database);
+	else
+		{
+			struct rusage usage = {0};
+			err = apply_executable_migration (migration_path, database, options, &usage);
+
+			measure.executable = true;
+			measure.user_seconds = (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec / 1e6;
+			measure.system_seconds = (double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec / 1e6;
+			measure.peak_rss = (sqlite3_int64) usage.ru_maxrss * 1024;
+			measure.blocks_read = usage.ru_inblock;
+			measure.blocks_written = usage.ru_oublock;
+		}
+
+	if (through_connection)
+		{
+			finish_statement_progress (&statement_progress);
+
+			int manifest_err = finish_manifest (&measure.manifest);
+			if (!err)
+				err = manifest_err;
+		}
+
+	measure.seconds = elapsed_since (&start);
+	measure.journal_bytes = journal_size (database);
+	measure.failed = err != 0;
+
+	if (through_connection)
+		{
+			int pages_written = 0;
+			sqlite3_db_status (db, SQLITE_DBSTATUS_CACHE_WRITE, &pages_written, &unused, 0);
+			measure.pages_written = pages_written;
+			measure.rows_changed = sqlite3_total_changes64 (db) - changes_before;
+			measure.lock_wait = statement_progress.lock_wait;
+		}
+
+	if (err)
+		{
+			// A migration may fail or be interrupted in the middle of its own transaction.
+			if (!sqlite3_get_autocommit (db))
+				db_exec ("ROLLBACK");
+
+			reported = report_add_migration (report, &measure) == 0;
+			fprintf (stderr, "migrate.c: apply_migration(): can't apply migration: %s\n", migration_path);
+			goto teardown;
+		}
+
+	if (session)
+		{
+			int version = 0;
+			err = find_schema_version (&version);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't find schema version.\n");
+					goto teardown;
+				}
+
+			schema_changed = version != schema_version;
+			if (!schema_changed)
+				{
+					err = finish_capture (session, &measure.manifest, &changeset);
+					session = NULL;
+					if (err)
+						{
+							fprintf (stderr, "migrate.c: apply_migration(): can't capture changes.\n");
+							goto teardown;
+						}
+				}
+		}
+
+	// Each migration may have set its own PRAGMAs, so let's reset to a clean state.
+	err = reopen_db (database, options->init);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_migration(): can't reopen database.\n");
+			goto teardown;
+		}
+
+	measure.growth = file_size (database) - size_before;
+
+	if (options->capture && !through_connection)
+		{
+			int version = 0;
+			err = find_schema_version (&version);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: apply_migration(): can't find schema version.\n");
+					goto teardown;
+				}
+
+			schema_changed = version != schema_version;
+			if (!schema_changed)
+				{
+					err = diff_capture (&changeset, capture_path);
+					if (err)
+						{
+							fprintf (stderr, "migrate.c: apply_migration(): can't capture changes.\n");
+							goto teardown;
+						}
+				}
+		}
+
+	if (schema_changed)
+		printf ("Migration %s changed the schema, no changeset recorded.\n", migration_file);
+
+	err = report_add_migration (report, &measure);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_migration(): can't add migration to report.\n");
+			goto teardown;
+		}
+
+	reported = true;
+
+	err = append_name_in_migrations_table (migration_file, &changeset, &measure);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_migration(): can't remember migration was executed: %s\n", migration_file);
+			goto teardown;
+		}
+
+	teardown:
+	if (session) sqlite3session_delete (session);
+	if (options->capture && !through_connection) unlink (capture_path);
+	free_changeset (&changeset);
+	free_changeset (&recorded);
+	// Otherwise, the report owns the manifest.
+	if (!reported) free_manifest (&measure.manifest);
+	return err;
+}
+
+/*
+ * Tells if nothing was ever created in the database, beside the migrations
+ * table.
+ */
+static int
+is_empty_database (bool empty[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT count(*) FROM sqlite_schema WHERE name != 'migrations'";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: is_empty_database(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*empty = sqlite3_column_int64 (stmt, 0) == 0 && last_migration_applied[0] == 0;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: is_empty_database(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+
+	return err;
+}
+
+/*
+ * Loads the baseline left by `squash` in an empty database, in a single
+ * transaction. It records the names of all the migrations it replaces, so
+ * only the migrations written after it are applied afterward.
+ */
+static int
+apply_baseline (const char migrations_dir[MAX_PATH_LEN], bool applied[static 1])
+{
+	int err = 0;
+	bool in_transaction = false;
+	bool empty = false;
+	char baseline_path[MAX_PATH_LEN] = {0};
+	struct stat st = {0};
+
+	int written = snprintf (baseline_path, MAX_PATH_LEN, "%s/%s", migrations_dir, BASELINE_FILE);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: apply_baseline(): truncated baseline path: %s\n", baseline_path);
+			goto teardown;
+		}
+
+	if (stat (baseline_path, &st) != 0)
+		goto teardown;
+
+	err = is_empty_database (&empty);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_baseline(): can't check if database is empty.\n");
+			goto teardown;
+		}
+
+	if (!empty)
+		goto teardown;
+
+	printf ("Applying baseline %s…\n", baseline_path);
+
+	err = db_exec ("BEGIN");
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_baseline(): can't start transaction.\n");
+			goto teardown;
+		}
+
+	in_transaction = true;
+
+	err = load_schema (db, baseline_path);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_baseline(): can't load baseline: %s\n", baseline_path);
+			goto teardown;
+		}
+
+	err = db_exec ("COMMIT");
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: apply_baseline(): can't commit baseline.\n");
+			goto teardown;
+		}
+
+	in_transaction = false;
+	*applied = true;
+
+	teardown:
+	if (in_transaction) db_exec ("ROLLBACK");
+	return err;
+}
+
+/*
+ * Estimates the duration of each pending migration, and counts how many of
+ * them fit in the `--max-duration` window, given the time already spent.
+ * Migrations with no estimate count as instant, so we warn about them.
+ *
+ * Caller must free `estimates`.
+ */
+static int
+plan_window (double *estimates[static 1], size_t runnable[static 1], options_t *options, struct dirent **migration_files, size_t migration_files_len, const struct timespec run_start[static 1])
+{
+	int err = 0;
+	duration_history_t history = {0};
+
+	*estimates = calloc (migration_files_len, sizeof (double));
+	if (!*estimates)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: plan_window(): out of memory.\n");
+			goto teardown;
+		}
+
+	err = open_duration_history (&history, options->database, options->history);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: plan_window(): can't open durations history.\n");
+			goto teardown;
+		}
+
+	double expected = elapsed_since (run_start);
+	*runnable = migration_files_len;
+
+	for (size_t i = 0; i < migration_files_len; i++)
+		{
+			err = estimate_duration (&(*estimates)[i], &history, migration_files[i]->d_name);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: plan_window(): can't estimate duration of %s.\n", migration_files[i]->d_name);
+					goto teardown;
+				}
+
+			expected += (*estimates)[i] > 0 ? (*estimates)[i] : 0;
+			if (*runnable == migration_files_len && expected > options->max_duration)
+				*runnable = i;
+		}
+
+	for (size_t i = 0; i < *runnable; i++)
+		if ((*estimates)[i] < 0)
+			fprintf (stderr, "Warning: no known duration for %s, it will be started even though it may not fit in the window.\n", migration_files[i]->d_name);
+
+	teardown:
+	close_duration_history (&history);
+	return err;
+}
+
+static void
+print_deferred_migrations (struct dirent **migration_files, size_t from, size_t migration_files_len, const double estimates[static 1])
+{
+	printf ("Stopping before the end of the maintenance window, %zu migrations deferred to the next one:\n", migration_files_len - from);
+
+	for (size_t i = from; i < migration_files_len; i++)
+		{
+			if (estimates[i] >= 0)
+				printf ("  %s (estimated %.1fs)\n", migration_files[i]->d_name, estimates[i]);
+			else
+				printf ("  %s (no estimate)\n", migration_files[i]->d_name);
+		}
+}
+
+int
+migrate (options_t *options)
+{
+	int err = 0;
+	bool should_restore_db = false;
+
+	struct dirent **migration_files = NULL;
+	size_t migration_files_len = 0;
+	char backup_file[MAX_PATH_LEN] = {0};
+	char fail_file[MAX_PATH_LEN] = {0};
+	char last_migration_file[MAX_PATH_LEN] = {0};
+	char database[MAX_PATH_LEN] = {0};
+	run_report_t report = {0};
+	sqlite3 *changesets_source = NULL;
+	struct sigaction previous_handlers[2] = {0};
+	bool catching_interruptions = false;
+	double *estimates = NULL;
+	size_t runnable = 0;
+	struct timespec run_start = {0};
+	background_backup_t backup = {0};
+
+	clock_gettime (CLOCK_MONOTONIC, &run_start);
+	report.started_at = wall_clock ();
+	report.size_before = file_size (options->database);
+
+	err = backup_file_path (backup_file, options->database, ".prev", options);
+	err = err || backup_file_path (fail_file, options->database, ".failed", options);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't build backup paths.\n");
+			goto teardown;
+		}
+
+	snprintf (database, MAX_PATH_LEN, "%s", options->database);
+
+	if (options->dry_run)
+		{
+			int written = snprintf (database, MAX_PATH_LEN, "%s.dry-run", options->database);
+			if (written >= MAX_PATH_LEN)
+				{
+					err = 1;
+					fprintf (stderr, "migrate.c: migrate(): truncated dry run database file path:%s\n", database);
+					goto teardown;
+				}
+
+			printf ("Cloning database to %s…\n", database);
+
+			err = backup_db (options->database, database);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: migrate(): can't clone database for dry run.\n");
+					goto teardown;
+				}
+		}
+
+	err = open_db (database, options->init);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't open database.\n");
+			goto teardown;
+		}
+
+	err = find_last_migration_applied ();
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't find last migration applied.\n");
+			goto teardown;
+		}
+
+	bool baseline_applied = false;
+	err = apply_baseline (options->migrations, &baseline_applied);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't apply baseline.\n");
+			goto teardown;
+		}
+
+	if (baseline_applied)
+		{
+			err = find_last_migration_applied ();
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: migrate(): can't find last migration applied.\n");
+					goto teardown;
+				}
+		}
+
+	snprintf (until_migration, MAX_NAME_LEN, "%s", options->until);
+
+	err = find_migration_files (options->migrations, &migration_files, &migration_files_len);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't find migration files.\n");
+			goto teardown;
+		}
+
+	if (migration_files_len == 0)
+		{
+			if (baseline_applied && !options->dry_run)
+				{
+					err = dump_structure (options->structure, last_migration_applied);
+					if (err)
+						{
+							fprintf (stderr, "migrate.c: migrate(): can't dump structure file.\n");
+							goto teardown;
+						}
+				}
+
+			goto teardown;
+		}
+
+	sqlite3_int64 copy_bytes = 0;
+	err = estimate_pending_recreates (options->migrations, migration_files, migration_files_len, &copy_bytes);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't estimate tables recreation.\n");
+			goto teardown;
+		}
+
+	bool enough_space = false;
+	err = check_disk_space (database, options->backup_dir, options->compress[0] != 0, copy_bytes, copy_bytes > 0, &enough_space);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't check disk space.\n");
+			goto teardown;
+		}
+
+	if (!enough_space)
+		{
+			err = 1;
+			fprintf (stderr, "migrate.c: migrate(): not enough free disk space to run migrations safely.\n");
+			goto teardown;
+		}
+
+	runnable = migration_files_len;
+	if (options->max_duration > 0)
+		{
+			err = plan_window (&estimates, &runnable, options, migration_files, migration_files_len, &run_start);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: migrate(): can't plan maintenance window.\n");
+					goto teardown;
+				}
+
+			if (runnable == 0)
+				{
+					print_deferred_migrations (migration_files, 0, migration_files_len, estimates);
+					goto teardown;
+				}
+		}
+
+	// The backup only reads the database, so preparing migrations can go on meanwhile.
+	if (!options->dry_run)
+		{
+			backup.verify = options->verify_backup;
+			snprintf (backup.compress, MAX_PATH_LEN, "%s", options->compress);
+			err = start_background_backup (&backup, options->database, backup_file);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: migrate(): can't backup database.\n");
+					goto teardown;
+				}
+		}
+
+	err = preflight_migrations (options->migrations, migration_files, migration_files_len, options->init);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): preflight failed, no migration was applied.\n");
+			goto teardown;
+		}
+
+	if (options->changesets[0] != 0)
+		{
+			err = sqlite3_open_v2 (options->changesets, &changesets_source, SQLITE_OPEN_READONLY, NULL);
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: migrate(): can't open changesets database: %s\n", options->changesets);
+					goto teardown;
+				}
+		}
+
+	if (!options->dry_run)
+		{
+			err = finish_background_backup (&backup);
+			report.backup_seconds = backup.seconds;
+			report.backup_verify_seconds = backup.verify_seconds;
+			report.backup_bytes = backup.stats.bytes;
+			report.backup_stored_bytes = backup.stats.stored_bytes;
+			if (err)
+				{
+					fprintf (stderr, "migrate.c: migrate(): can't backup database.\n");
+					goto teardown;
+				}
+
+			if (options->compress[0] != 0)
+				print_backup_stats (&backup.stats);
+		}
+
+	err = catch_interruptions (previous_handlers);
+	if (err)
+		{
+			fprintf (stderr, "migrate.c: migrate(): can't catch interruptions.\n");
+			goto teardown;
+		}
+
+	catching_interruptions = true;
+
+	for (size_t i = 0; i < migration_files_len; i++)
+		{
+			const char *migration_file = migration_files[i]->d_name;
+
+			// Estimates are checked again against the actual time spent, as migrations may take longer than before.
+			if (estimates && (i >= runnable || elapsed_since (&run_start) + (estimates[i] > 0 ? estimates[i] : 0) > options->max_duration))
+				{
+					print_deferred_migrations (migration_files, i, migration_files_len, estimates);
+					break;
+				}
+
+			if (interrupted)
+				{
+					err = 1;
+					should_restore_db = i > 0;
+					fprintf (stderr, "migrate.c: migrate(): interrupted before migration %s.\n", migration_file);
+					goto teardown;
+				}
+
+			snprintf (last_migration_file, MAX_PATH_LEN, "%s", migration_file);
+
+			err = apply_migration (options, database, migration_file, changesets_source, &report);
+			if (err)
 				{
-					fprintf (stderr, "migrate.c: migrate(): can't reopen database.\n");
+					should_restore_db = true;
+					fprintf (stderr, "migrate.c: migrate(): can't apply migration: %s\n", migration_file);
 					goto teardown;
 				}
+		}
+
+	if (options->verify && report.migrations_len > 0)
+		{
+			struct timespec verify_start = {0};
+			clock_gettime (CLOCK_MONOTONIC, &verify_start);
 
-			err = append_name_in_migrations_table (migration_file);
+			err = verify_touched_objects (&report);
+			report.verify_seconds = elapsed_since (&verify_start);
 			if (err)
 				{
 					should_restore_db = true;
-					fprintf (stderr, "migrate.c: migrate(): can't remember migration was executed: %s\n", migration_file);
+					fprintf (stderr, "migrate.c: migrate(): verification of modified tables failed.\n");
 					goto teardown;
 				}
 		}
 
-	if (last_migration_file[0] != 0)
+	if (last_migration_file[0] != 0 && !options->dry_run)
 		{
+			struct timespec dump_start = {0};
+			clock_gettime (CLOCK_MONOTONIC, &dump_start);
+
 			err = dump_structure (options->structure, last_migration_file);
+			report.dump_seconds = elapsed_since (&dump_start);
 			if (err)
 				{
 					should_restore_db = true;
 					fprintf (stderr, "migrate.c: migrate(): can't dump structure file.\n");
 					goto teardown;
 				}
+
+			// Statistics are informative: failing to write them doesn't undo the migrations.
+			if (options->stats[0] != 0 && dump_table_stats (options->stats))
+				fprintf (stderr, "migrate.c: migrate(): can't write table statistics.\n");
 		}
 
 	teardown:
+	// When preparing migrations failed, the backup is still running.
+	finish_background_backup (&backup);
+
 	if (migration_files)
 		{
 			for (size_t i = 0; i < migration_files_len; i++)
@@ -437,16 +1908,63 @@ migrate (options_t *options)
 			free (migration_files);
 		}
 
+	if (changesets_source) sqlite3_close (changesets_source);
+
+	if (estimates) free (estimates);
+
+	if (report.migrations_len > 0)
+		print_report (&report);
+
+	if (options->dry_run)
+		{
+			if (report.migrations_len > 0 && save_dry_run_durations (&report, options->database))
+				fprintf (stderr, "migrate.c: migrate(): can't save dry run durations.\n");
+
+			report.size_after = file_size (database);
+			close_db ();
+			if (database[0] != 0)
+				remove_dry_run_database (database);
+
+			should_restore_db = false;
+		}
+
 	if (should_restore_db)
 		{
-			int err = backup_db (options->database, fail_file);
+			struct timespec restore_start = {0};
+			clock_gettime (CLOCK_MONOTONIC, &restore_start);
+
+			if (interrupted)
+				fprintf (stderr, "Interrupted, restoring the database as it was before migrating.\n");
+
+			// Our connection may still hold a lock, which would prevent the restoration.
+			close_db ();
+
+			backup_stats_t fail_stats = {0};
+			int err = options->compress[0] != 0 ? stream_backup_db (options->database, fail_file, options->compress, &fail_stats) : backup_db (options->database, fail_file);
 			if (err)
 				fprintf (stderr, "migrate.c: migrate(): can't save current state to fail database dump.\n");
 
-			err = backup_db (backup_file, options->database);
+			err = options->compress[0] != 0 ? stream_restore_db (backup_file, options->database, options) : backup_db (backup_file, options->database);
 			if (err)
 				fprintf (stderr, "migrate.c: migrate(): can't restore database. Sorry, we tried. 😢\n");
+
+			report.restore_seconds = elapsed_since (&restore_start);
 		}
 
+	if (!options->dry_run)
+		report.size_after = file_size (options->database);
+
+	report.failed = err != 0;
+
+	if (options->report[0] != 0 && write_json_report (&report, options->report))
+		fprintf (stderr, "migrate.c: migrate(): can't write JSON report.\n");
+
+	if (options->metrics[0] != 0 && write_metrics_report (&report, options->metrics))
+		fprintf (stderr, "migrate.c: migrate(): can't write metrics report.\n");
+
+	free_report (&report);
+
+	if (catching_interruptions) release_interruptions (previous_handlers);
+
 	return err;
 }
@@ -1,6 +1,28 @@
 #ifndef _MIGRATE_H_
 #define _MIGRATE_H_
 
+#include <sys/resource.h>
+
+#define BASELINE_FILE "baseline.sql"
+#define PLUGIN_SYMBOL "exodus_migration"
+
+/*
+ * Function exported by plugin migrations, called on our connection. It
+ * returns non zero on failure.
+ */
+typedef int (*plugin_migration_t) (sqlite3 *db, const char *database_path);
+
+extern char last_migration_applied[MAX_PATH_LEN];
+
+bool is_executable (const char migration_file[MAX_PATH_LEN]);
+bool is_sql_migration (const char *migration_file);
+bool is_down_migration (const char *migration_file);
+bool is_plugin_migration (const char *migration_file);
+int apply_sql_migration (const char migration_file[MAX_PATH_LEN]);
+int apply_plugin_migration (const char migration_file[MAX_PATH_LEN], const char database_path[MAX_PATH_LEN]);
+int apply_executable_migration (const char migration_file[MAX_PATH_LEN], const char database_path[MAX_PATH_LEN], const options_t options[static 1], struct rusage usage[static 1]);
+int find_last_migration_applied ();
+int dump_structure (const char *structure_path, const char *migration_file);
 int migrate (options_t *options);
 
 #endif
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "progress.h"
+
+// Seconds between two renders, on a terminal and in logs.
+#define RENDER_INTERVAL 0.1
+#define LOG_INTERVAL 10
+
+// Virtual machine instructions between two calls of the progress handler.
+#define STATEMENT_STEPS 100000
+
+// Statements running for less than this many seconds are not displayed.
+#define STATEMENT_QUIET_SECONDS 1
+
+volatile sig_atomic_t interrupted = 0;
+
+double
+elapsed_since (const struct timespec start[static 1])
+{
+	struct timespec now = {0};
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+on_interruption (int signum)
+{
+	(void) signum;
+	interrupted = 1;
+}
+
+/*
+ * Catches SIGINT and SIGTERM, so that they stop the migration at a point
+ * where we can roll back and restore the database, rather than killing us.
+ */
+int
+catch_interruptions (struct sigaction previous[static 2])
+{
+	int err = 0;
+	struct sigaction action = { .sa_handler = on_interruption };
+	sigemptyset (&action.sa_mask);
+
+	interrupted = 0;
+
+	if (sigaction (SIGINT, &action, &previous[0]) != 0 || sigaction (SIGTERM, &action, &previous[1]) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "progress.c: catch_interruptions(): can't install signal handlers.\n");
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+void
+release_interruptions (const struct sigaction previous[static 2])
+{
+	sigaction (SIGINT, &previous[0], NULL);
+	sigaction (SIGTERM, &previous[1], NULL);
+}
+
+/*
+ * Called by SQLite while statements run. Long statements get a display of
+ * the virtual machine steps, elapsed time and pages written so far, and
+ * are interrupted when we received SIGINT or SIGTERM.
+ */
+static int
+statement_progress (void *context)
+{
+	statement_progress_t *progress = context;
+	progress->steps += STATEMENT_STEPS;
+
+	if (interrupted)
+		{
+			if (progress->rendered && isatty (STDOUT_FILENO))
+				printf ("\n");
+
+			progress->rendered = false;
+			sqlite3_interrupt (progress->conn);
+			return 1;
+		}
+
+	bool terminal = isatty (STDOUT_FILENO);
+	double elapsed = elapsed_since (&progress->start);
+	if (elapsed < STATEMENT_QUIET_SECONDS || elapsed - progress->last_render < (terminal ? RENDER_INTERVAL : LOG_INTERVAL))
+		return 0;
+
+	int pages_written = 0;
+	int unused = 0;
+	sqlite3_db_status (progress->conn, SQLITE_DBSTATUS_CACHE_WRITE, &pages_written, &unused, 0);
+
+	progress->last_render = elapsed;
+	progress->rendered = true;
+
+	printf ("%s  %lld VM steps, %.1fs, %d pages written%s", terminal ? "\r\033[K" : "", progress->steps, elapsed, pages_written, terminal ? "" : "\n");
+	fflush (stdout);
+
+	return 0;
+}
+
+/*
+ * Replaces the busy timeout while statements run, waiting the same way but
+ * measuring how long we waited for locks.
+ */
+static int
+wait_for_lock (void *context, int count)
+{
+	statement_progress_t *progress = context;
+
+	if (interrupted || progress->lock_wait * 1000 >= progress->busy_timeout)
+		return 0;
+
+	struct timespec start = {0};
+	struct timespec delay = { .tv_nsec = (count < 100 ? count + 1 : 100) * 1000 * 1000 };
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	nanosleep (&delay, NULL);
+	progress->lock_wait += elapsed_since (&start);
+
+	return 1;
+}
+
+static int
+find_busy_timeout (sqlite3 *conn, int timeout[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+
+	int rc = sqlite3_prepare_v2 (conn, "PRAGMA busy_timeout", -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "progress.c: find_busy_timeout(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*timeout = sqlite3_column_int (stmt, 0);
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "progress.c: find_busy_timeout(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+int
+start_statement_progress (statement_progress_t progress[static 1], sqlite3 *conn)
+{
+	int err = 0;
+
+	memset (progress, 0, sizeof (statement_progress_t));
+	progress->conn = conn;
+
+	err = find_busy_timeout (conn, &progress->busy_timeout);
+	if (err)
+		{
+			fprintf (stderr, "progress.c: start_statement_progress(): can't find busy timeout.\n");
+			goto teardown;
+		}
+
+	clock_gettime (CLOCK_MONOTONIC, &progress->start);
+	sqlite3_progress_handler (conn, STATEMENT_STEPS, statement_progress, progress);
+	sqlite3_busy_handler (conn, wait_for_lock, progress);
+
+	teardown:
+	return err;
+}
+
+void
+finish_statement_progress (statement_progress_t progress[static 1])
+{
+	sqlite3_progress_handler (progress->conn, 0, NULL, NULL);
+	sqlite3_busy_timeout (progress->conn, progress->busy_timeout);
+
+	if (progress->rendered && isatty (STDOUT_FILENO))
+		printf ("\n");
+}
+
+void
+start_progress (progress_t progress[static 1])
+{
+	memset (progress, 0, sizeof (progress_t));
+	clock_gettime (CLOCK_MONOTONIC, &progress->start);
+}
+
+static void
+format_duration (char formatted[32], double seconds)
+{
+	long long rounded = (long long) seconds;
+	if (rounded >= 60 * 60)
+		snprintf (formatted, 32, "%lldh%02lldm", rounded / 3600, rounded % 3600 / 60);
+	else if (rounded >= 60)
+		snprintf (formatted, 32, "%lldm%02llds", rounded / 60, rounded % 60);
+	else
+		snprintf (formatted, 32, "%llds", rounded);
+}
+
+/*
+ * Prints the progress with the rate since the migration started, and the
+ * estimated time left when the total is known. On a terminal, the line is
+ * rewritten in place, otherwise a new line is printed from time to time.
+ */
+static void
+render_progress (progress_t progress[static 1], bool force)
+{
+	bool terminal = isatty (STDOUT_FILENO);
+	double elapsed = elapsed_since (&progress->start);
+
+	if (!force && elapsed - progress->last_render < (terminal ? RENDER_INTERVAL : LOG_INTERVAL))
+		return;
+
+	progress->last_render = elapsed;
+
+	double rate = elapsed > 0 ? (double) progress->done / elapsed : 0;
+
+	printf ("%s  %lld", terminal ? "\r\033[K" : "", progress->done);
+	if (progress->total > 0)
+		printf ("/%lld (%.1f%%)", progress->total, 100.0 * (double) progress->done / (double) progress->total);
+	printf (" rows, %.0f rows/s", rate);
+
+	if (progress->total > progress->done && rate > 0)
+		{
+			char eta[32] = {0};
+			format_duration (eta, (double) (progress->total - progress->done) / rate);
+			printf (", ETA %s", eta);
+		}
+
+	if (progress->message[0] != 0)
+		printf (": %s", progress->message);
+
+	if (!terminal)
+		printf ("\n");
+
+	fflush (stdout);
+}
+
+/*
+ * Lines are `<rows done> <rows total> <message>`, where the total is 0 when
+ * unknown, and the message is optional. Other lines are ignored.
+ */
+static void
+parse_progress_line (progress_t progress[static 1], const char *line)
+{
+	long long done = 0;
+	long long total = 0;
+	int consumed = 0;
+
+	if (sscanf (line, "%lld %lld %n", &done, &total, &consumed) < 2)
+		return;
+
+	progress->done = done;
+	progress->total = total;
+	progress->received = true;
+	snprintf (progress->message, MAX_NAME_LEN, "%s", line + consumed);
+}
+
+/*
+ * Reads what's available on the progress pipe, and renders the last
+ * complete line. `eof` is set once the writing end is closed.
+ */
+int
+read_progress (progress_t progress[static 1], int fd, bool eof[static 1])
+{
+	int err = 0;
+	bool updated = false;
+
+	ssize_t len = read (fd, progress->buffer + progress->buffer_len, sizeof (progress->buffer) - progress->buffer_len - 1);
+	if (len < 0)
+		{
+			err = 1;
+			fprintf (stderr, "progress.c: read_progress(): can't read progress pipe.\n");
+			goto teardown;
+		}
+
+	*eof = len == 0;
+	progress->buffer_len += (size_t) len;
+	progress->buffer[progress->buffer_len] = 0;
+
+	char *line = progress->buffer;
+	for (char *newline = strchr (line, '\n'); newline; newline = strchr (line, '\n'))
+		{
+			*newline = 0;
+			parse_progress_line (progress, line);
+			line = newline + 1;
+			updated = true;
+		}
+
+	progress->buffer_len -= (size_t) (line - progress->buffer);
+	memmove (progress->buffer, line, progress->buffer_len);
+
+	// A line longer than the buffer can't be parsed, drop it.
+	if (progress->buffer_len == sizeof (progress->buffer) - 1)
+		progress->buffer_len = 0;
+
+	if (updated && progress->received)
+		render_progress (progress, false);
+
+	teardown:
+	return err;
+}
+
+/*
+ * Renders the final state, and ends the progress line.
+ */
+void
+finish_progress (progress_t progress[static 1])
+{
+	if (!progress->received)
+		return;
+
+	render_progress (progress, true);
+	if (isatty (STDOUT_FILENO))
+		printf ("\n");
+}
+
+void
+print_last_progress (const progress_t progress[static 1])
+{
+	if (!progress->received)
+		return;
+
+	fprintf (stderr, "Last progress: %lld", progress->done);
+	if (progress->total > 0)
+		fprintf (stderr, "/%lld", progress->total);
+	fprintf (stderr, " rows after %.1fs%s%s\n", elapsed_since (&progress->start), progress->message[0] != 0 ? ": " : ".", progress->message);
+}
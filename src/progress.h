@@ -0,0 +1,45 @@
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include <signal.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <time.h>
+#include "main.h"
+
+#define PROGRESS_FD_VARIABLE "EXODUS_PROGRESS_FD"
+
+typedef struct {
+	long long done;
+	long long total;
+	char message[MAX_NAME_LEN];
+	bool received;
+	struct timespec start;
+	double last_render;
+	char buffer[BUFSIZ];
+	size_t buffer_len;
+} progress_t;
+
+typedef struct {
+	sqlite3 *conn;
+	long long steps;
+	int busy_timeout;
+	double lock_wait;
+	struct timespec start;
+	double last_render;
+	bool rendered;
+} statement_progress_t;
+
+extern volatile sig_atomic_t interrupted;
+
+double elapsed_since (const struct timespec start[static 1]);
+int catch_interruptions (struct sigaction previous[static 2]);
+void release_interruptions (const struct sigaction previous[static 2]);
+int start_statement_progress (statement_progress_t progress[static 1], sqlite3 *conn);
+void finish_statement_progress (statement_progress_t progress[static 1]);
+void start_progress (progress_t progress[static 1]);
+int read_progress (progress_t progress[static 1], int fd, bool eof[static 1]);
+void finish_progress (progress_t progress[static 1]);
+void print_last_progress (const progress_t progress[static 1]);
+
+#endif
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "estimate.h"
+#include "manifest.h"
+#include "report.h"
+
+int
+report_add_migration (run_report_t report[static 1], const migration_report_t migration[static 1])
+{
+	int err = 0;
+
+	migration_report_t *migrations = realloc (report->migrations, sizeof (migration_report_t) * (report->migrations_len + 1));
+	if (!migrations)
+		{
+			err = 1;
+			fprintf (stderr, "report.c: report_add_migration(): out of memory.\n");
+			goto teardown;
+		}
+
+	report->migrations = migrations;
+	report->migrations[report->migrations_len++] = *migration;
+
+	teardown:
+	return err;
+}
+
+/*
+ * Prints one line per migration, then the totals.
+ *
+ * Pages written are only known for migrations going through our connection,
+ * while executables get the resource usage of their process. Blocks are
+ * counted in units of 512 bytes. Each migration is followed by the tables
+ * and indexes it touched.
+ */
+void
+print_report (const run_report_t report[static 1])
+{
+	char growth[32] = {0};
+	char journal[32] = {0};
+	double seconds = 0;
+	sqlite3_int64 total_growth = 0;
+	sqlite3_int64 max_journal = 0;
+
+	for (size_t i = 0; i < report->migrations_len; i++)
+		{
+			const migration_report_t *migration = &report->migrations[i];
+
+			format_size (growth, migration->growth < 0 ? -migration->growth : migration->growth);
+			format_size (journal, migration->journal_bytes);
+
+			printf ("%s%s: %.3fs, ", migration->name, migration->failed ? " (failed)" : "", migration->seconds);
+			if (migration->pages_written >= 0)
+				printf ("%lld pages written, ", (long long) migration->pages_written);
+			printf ("growth %s%s, journal %s", migration->growth < 0 ? "-" : "", growth, journal);
+			if (migration->executable)
+				{
+					char rss[32] = {0};
+					format_size (rss, migration->peak_rss);
+					printf (", cpu %.3fs user %.3fs system, peak RSS %s, %lld blocks read, %lld blocks written", migration->user_seconds, migration->system_seconds, rss, (long long) migration->blocks_read, (long long) migration->blocks_written);
+				}
+			printf (".\n");
+			print_manifest (&migration->manifest);
+
+			seconds += migration->seconds;
+			total_growth += migration->growth;
+			if (migration->journal_bytes > max_journal)
+				max_journal = migration->journal_bytes;
+		}
+
+	format_size (growth, total_growth < 0 ? -total_growth : total_growth);
+	format_size (journal, max_journal);
+	printf ("Total: %zu migrations in %.3fs, growth %s%s, largest journal %s.\n", report->migrations_len, seconds, total_growth < 0 ? "-" : "", growth, journal);
+}
+
+/*
+ * Opens a temporary file next to `path`, which `close_report_file()` moves
+ * in place, so that collectors never read a partial report.
+ */
+static FILE *
+open_report_file (char tmp_path[MAX_PATH_LEN + 5], const char path[MAX_PATH_LEN])
+{
+	snprintf (tmp_path, MAX_PATH_LEN + 5, "%s.tmp", path);
+
+	FILE *file = fopen (tmp_path, "w");
+	if (!file)
+		fprintf (stderr, "report.c: open_report_file(): can't open report file: %s\n", tmp_path);
+
+	return file;
+}
+
+static int
+close_report_file (FILE *file, const char tmp_path[MAX_PATH_LEN + 5], const char path[MAX_PATH_LEN], bool failed)
+{
+	int err = 0;
+
+	if (fclose (file) != 0 || failed)
+		{
+			err = 1;
+			fprintf (stderr, "report.c: close_report_file(): can't write report file: %s\n", tmp_path);
+			unlink (tmp_path);
+			goto teardown;
+		}
+
+	err = rename (tmp_path, path);
+	if (err)
+		{
+			fprintf (stderr, "report.c: close_report_file(): can't move report to %s\n", path);
+			unlink (tmp_path);
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+static void
+write_json_string (FILE *file, const char *string)
+{
+	fputc ('"', file);
+
+	for (const char *c = string; *c; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				fprintf (file, "\\%c", *c);
+			else if ((unsigned char) *c < 0x20)
+				fprintf (file, "\\u%04x", (unsigned char) *c);
+			else
+				fputc (*c, file);
+		}
+
+	fputc ('"', file);
+}
+
+/*
+ * Writes an integer, or null when it's unknown (negative).
+ */
+static void
+write_json_count (FILE *file, const char *key, sqlite3_int64 value)
+{
+	if (value >= 0)
+		fprintf (file, ", \"%s\": %lld", key, (long long) value);
+	else
+		fprintf (file, ", \"%s\": null", key);
+}
+
+/*
+ * Writes the run report as JSON: the run's timings and database sizes, and
+ * one record per migration applied. Values which are not known for a kind
+ * of migration are null.
+ */
+int
+write_json_report (const run_report_t report[static 1], const char path[MAX_PATH_LEN])
+{
+	char tmp_path[MAX_PATH_LEN + 5] = {0};
+
+	FILE *file = open_report_file (tmp_path, path);
+	if (!file)
+		return 1;
+
+	fprintf (file, "{\n  \"started_at\": %.3f,\n  \"failed\": %s,\n", report->started_at, report->failed ? "true" : "false");
+	fprintf (file, "  \"database_size_before\": %lld,\n  \"database_size_after\": %lld,\n", (long long) report->size_before, (long long) report->size_after);
+	fprintf (file, "  \"backup_bytes\": %lld,\n  \"backup_stored_bytes\": %lld,\n", (long long) report->backup_bytes, (long long) report->backup_stored_bytes);
+	fprintf (file, "  \"backup_seconds\": %.6f,\n  \"backup_verify_seconds\": %.6f,\n  \"restore_seconds\": %.6f,\n  \"dump_structure_seconds\": %.6f,\n  \"verify_seconds\": %.6f,\n", report->backup_seconds, report->backup_verify_seconds, report->restore_seconds, report->dump_seconds, report->verify_seconds);
+	fprintf (file, "  \"migrations\": [");
+
+	for (size_t i = 0; i < report->migrations_len; i++)
+		{
+			const migration_report_t *migration = &report->migrations[i];
+
+			fprintf (file, "%s\n    {\"name\": ", i > 0 ? "," : "");
+			write_json_string (file, migration->name);
+			fprintf (file, ", \"kind\": \"%s\", \"started_at\": %.3f, \"seconds\": %.6f, \"failed\": %s", migration->kind, migration->started_at, migration->seconds, migration->failed ? "true" : "false");
+			write_json_count (file, "rows_changed", migration->rows_changed);
+			write_json_count (file, "pages_written", migration->pages_written);
+
+			if (migration->lock_wait >= 0)
+				fprintf (file, ", \"lock_wait_seconds\": %.6f", migration->lock_wait);
+			else
+				fprintf (file, ", \"lock_wait_seconds\": null");
+
+			fprintf (file, ", \"growth\": %lld, \"journal_bytes\": %lld", (long long) migration->growth, (long long) migration->journal_bytes);
+
+			if (migration->executable)
+				fprintf (file, ", \"user_seconds\": %.6f, \"system_seconds\": %.6f, \"peak_rss\": %lld, \"blocks_read\": %lld, \"blocks_written\": %lld", migration->user_seconds, migration->system_seconds, (long long) migration->peak_rss, (long long) migration->blocks_read, (long long) migration->blocks_written);
+
+			char *touched = NULL;
+			if (manifest_to_json (&migration->manifest, &touched) == 0)
+				{
+					fprintf (file, ", \"touched\": %s", touched);
+					sqlite3_free (touched);
+				}
+
+			fprintf (file, "}");
+		}
+
+	fprintf (file, "%s]\n}\n", report->migrations_len > 0 ? "\n  " : "");
+
+	return close_report_file (file, tmp_path, path, ferror (file) != 0);
+}
+
+enum {
+	METRIC_SECONDS,
+	METRIC_ROWS_CHANGED,
+	METRIC_PAGES_WRITTEN,
+	METRIC_LOCK_WAIT,
+	METRIC_GROWTH,
+	METRIC_JOURNAL,
+	METRIC_FAILED,
+	METRIC_USER_SECONDS,
+	METRIC_SYSTEM_SECONDS,
+	METRIC_PEAK_RSS,
+	METRIC_BLOCKS_READ,
+	METRIC_BLOCKS_WRITTEN,
+};
+
+static const struct {
+	int metric;
+	const char *name;
+	const char *help;
+} migration_metrics[] = {
+	{ METRIC_SECONDS, "exodus_migration_duration_seconds", "Wall time of the migration." },
+	{ METRIC_ROWS_CHANGED, "exodus_migration_rows_changed", "Rows inserted, updated or deleted through our connection." },
+	{ METRIC_PAGES_WRITTEN, "exodus_migration_pages_written", "Pages written through our connection." },
+	{ METRIC_LOCK_WAIT, "exodus_migration_lock_wait_seconds", "Time spent waiting for database locks." },
+	{ METRIC_GROWTH, "exodus_migration_growth_bytes", "Database file growth." },
+	{ METRIC_JOURNAL, "exodus_migration_journal_bytes", "Size reached by the journal." },
+	{ METRIC_FAILED, "exodus_migration_failed", "1 if the migration failed." },
+	{ METRIC_USER_SECONDS, "exodus_migration_user_cpu_seconds", "User CPU time of the executable." },
+	{ METRIC_SYSTEM_SECONDS, "exodus_migration_system_cpu_seconds", "System CPU time of the executable." },
+	{ METRIC_PEAK_RSS, "exodus_migration_peak_rss_bytes", "Peak resident set size of the executable." },
+	{ METRIC_BLOCKS_READ, "exodus_migration_blocks_read", "Blocks of 512 bytes read by the executable." },
+	{ METRIC_BLOCKS_WRITTEN, "exodus_migration_blocks_written", "Blocks of 512 bytes written by the executable." },
+};
+
+/*
+ * Retrieves the value of a metric for a migration. Returns false when it's
+ * not known for this kind of migration.
+ */
+static bool
+migration_metric (double value[static 1], const migration_report_t migration[static 1], int metric)
+{
+	switch (metric)
+		{
+			case METRIC_SECONDS: *value = migration->seconds; return true;
+			case METRIC_ROWS_CHANGED: *value = (double) migration->rows_changed; return migration->rows_changed >= 0;
+			case METRIC_PAGES_WRITTEN: *value = (double) migration->pages_written; return migration->pages_written >= 0;
+			case METRIC_LOCK_WAIT: *value = migration->lock_wait; return migration->lock_wait >= 0;
+			case METRIC_GROWTH: *value = (double) migration->growth; return true;
+			case METRIC_JOURNAL: *value = (double) migration->journal_bytes; return true;
+			case METRIC_FAILED: *value = migration->failed ? 1 : 0; return true;
+			case METRIC_USER_SECONDS: *value = migration->user_seconds; return migration->executable;
+			case METRIC_SYSTEM_SECONDS: *value = migration->system_seconds; return migration->executable;
+			case METRIC_PEAK_RSS: *value = (double) migration->peak_rss; return migration->executable;
+			case METRIC_BLOCKS_READ: *value = (double) migration->blocks_read; return migration->executable;
+			case METRIC_BLOCKS_WRITTEN: *value = (double) migration->blocks_written; return migration->executable;
+			default: return false;
+		}
+}
+
+static void
+write_metric_label (FILE *file, const char *value)
+{
+	for (const char *c = value; *c; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				fprintf (file, "\\%c", *c);
+			else if (*c == '\n')
+				fprintf (file, "\\n");
+			else
+				fputc (*c, file);
+		}
+}
+
+static void
+write_run_metric (FILE *file, const char *name, const char *help, double value)
+{
+	fprintf (file, "# TYPE %s gauge\n# HELP %s %s\n%s %.6f\n", name, name, help, name, value);
+}
+
+/*
+ * Writes the run report in the OpenMetrics text format, for the textfile
+ * collector of node_exporter. Migrations are labelled by name and kind.
+ */
+int
+write_metrics_report (const run_report_t report[static 1], const char path[MAX_PATH_LEN])
+{
+	char tmp_path[MAX_PATH_LEN + 5] = {0};
+
+	FILE *file = open_report_file (tmp_path, path);
+	if (!file)
+		return 1;
+
+	write_run_metric (file, "exodus_run_timestamp_seconds", "Time the run started.", report->started_at);
+	write_run_metric (file, "exodus_run_failed", "1 if the run failed.", report->failed ? 1 : 0);
+	write_run_metric (file, "exodus_backup_duration_seconds", "Time spent backing up the database.", report->backup_seconds);
+	write_run_metric (file, "exodus_backup_verify_duration_seconds", "Time spent comparing the backup to the database.", report->backup_verify_seconds);
+	write_run_metric (file, "exodus_restore_duration_seconds", "Time spent restoring the database after a failure.", report->restore_seconds);
+	write_run_metric (file, "exodus_dump_structure_duration_seconds", "Time spent dumping the structure file.", report->dump_seconds);
+	write_run_metric (file, "exodus_verify_duration_seconds", "Time spent verifying modified tables.", report->verify_seconds);
+
+	fprintf (file, "# TYPE exodus_database_size_bytes gauge\n# HELP exodus_database_size_bytes Size of the database file.\n");
+	fprintf (file, "exodus_database_size_bytes{when=\"before\"} %lld\n", (long long) report->size_before);
+	fprintf (file, "exodus_database_size_bytes{when=\"after\"} %lld\n", (long long) report->size_after);
+
+	fprintf (file, "# TYPE exodus_backup_size_bytes gauge\n# HELP exodus_backup_size_bytes Size of the backed up database, and of the backup on disk once compressed.\n");
+	fprintf (file, "exodus_backup_size_bytes{of=\"database\"} %lld\n", (long long) report->backup_bytes);
+	fprintf (file, "exodus_backup_size_bytes{of=\"backup\"} %lld\n", (long long) report->backup_stored_bytes);
+
+	for (size_t m = 0; m < sizeof (migration_metrics) / sizeof (migration_metrics[0]); m++)
+		{
+			bool described = false;
+
+			for (size_t i = 0; i < report->migrations_len; i++)
+				{
+					double value = 0;
+					if (!migration_metric (&value, &report->migrations[i], migration_metrics[m].metric))
+						continue;
+
+					if (!described)
+						{
+							fprintf (file, "# TYPE %s gauge\n# HELP %s %s\n", migration_metrics[m].name, migration_metrics[m].name, migration_metrics[m].help);
+							described = true;
+						}
+
+					fprintf (file, "%s{migration=\"", migration_metrics[m].name);
+					write_metric_label (file, report->migrations[i].name);
+					fprintf (file, "\",kind=\"%s\"} %.6f\n", report->migrations[i].kind, value);
+				}
+		}
+
+	fprintf (file, "# EOF\n");
+
+	return close_report_file (file, tmp_path, path, ferror (file) != 0);
+}
+
+void
+free_report (run_report_t report[static 1])
+{
+	for (size_t i = 0; i < report->migrations_len; i++)
+		free_manifest (&report->migrations[i].manifest);
+
+	if (report->migrations) free (report->migrations);
+	report->migrations = NULL;
+	report->migrations_len = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _REPORT_H_
+#define _REPORT_H_
+
+#include <sqlite3.h>
+#include "main.h"
+#include "manifest.h"
+
+typedef struct {
+	char name[MAX_PATH_LEN];
+	const char *kind;
+	double started_at;
+	double seconds;
+	sqlite3_int64 pages_written;
+	sqlite3_int64 growth;
+	sqlite3_int64 journal_bytes;
+	sqlite3_int64 rows_changed;
+	double lock_wait;
+	bool executable;
+	double user_seconds;
+	double system_seconds;
+	sqlite3_int64 peak_rss;
+	sqlite3_int64 blocks_read;
+	sqlite3_int64 blocks_written;
+	manifest_t manifest;
+	bool failed;
+} migration_report_t;
+
+typedef struct {
+	migration_report_t *migrations;
+	size_t migrations_len;
+	double started_at;
+	double backup_seconds;
+	double backup_verify_seconds;
+	sqlite3_int64 backup_bytes;
+	sqlite3_int64 backup_stored_bytes;
+	double restore_seconds;
+	double dump_seconds;
+	double verify_seconds;
+	sqlite3_int64 size_before;
+	sqlite3_int64 size_after;
+	bool failed;
+} run_report_t;
+
+int report_add_migration (run_report_t report[static 1], const migration_report_t migration[static 1]);
+void print_report (const run_report_t report[static 1]);
+int write_json_report (const run_report_t report[static 1], const char path[MAX_PATH_LEN]);
+int write_metrics_report (const run_report_t report[static 1], const char path[MAX_PATH_LEN]);
+void free_report (run_report_t report[static 1]);
+
+#endif
@@ -0,0 +1,493 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "changeset.h"
+#include "database.h"
+#include "migrate.h"
+#include "rollback.h"
+
+enum {
+	REVERT_DOWN_SQL,
+	REVERT_DOWN_PLUGIN,
+	REVERT_DOWN_EXECUTABLE,
+	REVERT_CHANGESET,
+};
+
+typedef struct {
+	char name[MAX_PATH_LEN];
+	int method;
+	char down_path[MAX_PATH_LEN];
+	changeset_t changeset;
+} revert_t;
+
+static bool
+is_number (const char string[static 1])
+{
+	if (string[0] == 0)
+		return false;
+
+	for (size_t i = 0; string[i]; i++)
+		if (!isdigit ((unsigned char) string[i]))
+			return false;
+
+	return true;
+}
+
+static int
+forget_migration (const char migration_name[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "DELETE FROM migrations WHERE name = ?";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: forget_migration(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, migration_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				continue;
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: forget_migration(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Tells if the migration was applied, and how many migrations have been
+ * applied since it, itself included.
+ */
+static int
+is_applied (bool applied[static 1], long position[static 1], const char migration_name[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT count(*) FILTER (WHERE name = ?1), count(*) FILTER (WHERE name >= ?1) FROM migrations";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: is_applied(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, migration_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					*applied = sqlite3_column_int (stmt, 0) > 0;
+					*position = (long) sqlite3_column_int64 (stmt, 1);
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: is_applied(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Retrieves the names of the last `count` migrations applied, most recent
+ * first.
+ *
+ * Caller must free `reverts`.
+ */
+static int
+find_last_migrations (revert_t **reverts, size_t reverts_len[static 1], long count)
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT name FROM migrations ORDER BY name DESC LIMIT ?";
+
+	int rc = sqlite3_prepare_v2 (db, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: find_last_migrations(): error while preparing query: %s\n", sqlite3_errmsg (db));
+			goto teardown;
+		}
+
+	sqlite3_bind_int64 (stmt, 1, count);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					revert_t *grown = realloc (*reverts, sizeof (revert_t) * (*reverts_len + 1));
+					if (!grown)
+						{
+							err = 1;
+							fprintf (stderr, "rollback.c: find_last_migrations(): out of memory.\n");
+							goto teardown;
+						}
+
+					*reverts = grown;
+					revert_t *revert = &(*reverts)[(*reverts_len)++];
+					memset (revert, 0, sizeof (revert_t));
+					snprintf (revert->name, MAX_PATH_LEN, "%s", (const char *) sqlite3_column_text (stmt, 0));
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: find_last_migrations(): error while performing query: %s\n", sqlite3_errmsg (db));
+					goto teardown;
+				}
+		}
+
+	if ((long) *reverts_len < count)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: find_last_migrations(): only %zu migrations were applied.\n", *reverts_len);
+			goto teardown;
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Finds how to revert a migration: with its down migration if there is
+ * one, or else with the inverse of the changeset recorded by
+ * `migrate --capture`.
+ */
+static int
+plan_revert (revert_t revert[static 1], const char migrations_dir[MAX_PATH_LEN])
+{
+	int err = 0;
+	char stem[MAX_PATH_LEN] = {0};
+
+	snprintf (stem, MAX_PATH_LEN, "%s", revert->name);
+	if (is_sql_migration (stem))
+		stem[strlen (stem) - 4] = 0;
+	else if (is_plugin_migration (stem))
+		stem[strlen (stem) - 3] = 0;
+
+	int written = snprintf (revert->down_path, MAX_PATH_LEN, "%s/%s.down.sql", migrations_dir, stem);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: plan_revert(): truncated down migration path: %s\n", revert->down_path);
+			goto teardown;
+		}
+
+	if (file_exists (revert->down_path))
+		{
+			revert->method = REVERT_DOWN_SQL;
+			goto teardown;
+		}
+
+	written = snprintf (revert->down_path, MAX_PATH_LEN, "%s/%s.down.so", migrations_dir, stem);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: plan_revert(): truncated down migration path: %s\n", revert->down_path);
+			goto teardown;
+		}
+
+	if (file_exists (revert->down_path))
+		{
+			revert->method = REVERT_DOWN_PLUGIN;
+			goto teardown;
+		}
+
+	written = snprintf (revert->down_path, MAX_PATH_LEN, "%s/%s.down", migrations_dir, stem);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: plan_revert(): truncated down migration path: %s\n", revert->down_path);
+			goto teardown;
+		}
+
+	if (file_exists (revert->down_path))
+		{
+			if (!is_executable (revert->down_path))
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: plan_revert(): down migration is not executable: %s\n", revert->down_path);
+					goto teardown;
+				}
+
+			revert->method = REVERT_DOWN_EXECUTABLE;
+			goto teardown;
+		}
+
+	revert->down_path[0] = 0;
+
+	changeset_t recorded = {0};
+	err = find_recorded_changeset (&recorded, db, revert->name);
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: plan_revert(): can't retrieve recorded changeset.\n");
+			goto teardown;
+		}
+
+	if (!recorded.data)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: plan_revert(): %s has no down migration, and no changeset was recorded for it with --capture.\n", revert->name);
+			goto teardown;
+		}
+
+	revert->method = REVERT_CHANGESET;
+	int rc = sqlite3changeset_invert (recorded.size, recorded.data, &revert->changeset.size, &revert->changeset.data);
+	free_changeset (&recorded);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: plan_revert(): can't invert changeset: %s\n", sqlite3_errstr (rc));
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Reverts a migration and removes it from the migrations table. Except for
+ * executables, this happens in the caller's transaction.
+ *
+ * Inverted changesets only write the rows the migration touched, and rows
+ * changed since then are detected as conflicts, which abort the rollback.
+ */
+static int
+revert_migration (const revert_t revert[static 1], const options_t options[static 1])
+{
+	int err = 0;
+
+	printf ("Rolling back migration %s…\n", revert->name);
+
+	switch (revert->method)
+		{
+			case REVERT_DOWN_SQL:
+				err = apply_sql_migration (revert->down_path);
+				break;
+
+			case REVERT_DOWN_PLUGIN:
+				err = apply_plugin_migration (revert->down_path, options->database);
+				break;
+
+			case REVERT_DOWN_EXECUTABLE:
+				{
+					struct rusage usage = {0};
+					err = apply_executable_migration (revert->down_path, options->database, options, &usage);
+					break;
+				}
+
+			case REVERT_CHANGESET:
+				err = apply_changeset (&revert->changeset);
+				break;
+		}
+
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: revert_migration(): can't revert migration %s.\n", revert->name);
+			goto teardown;
+		}
+
+	err = forget_migration (revert->name);
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: revert_migration(): can't remove migration from migrations table.\n");
+			goto teardown;
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Rolls back the last N migrations, or the last one given by name.
+ *
+ * Reverts happen in reverse order, in a single transaction. Down
+ * executables use their own connection and can't be part of it, so when
+ * there are some, each migration is reverted in its own transaction
+ * instead.
+ */
+int
+rollback (options_t *options)
+{
+	int err = 0;
+	bool in_transaction = false;
+	bool has_executable = false;
+	revert_t *reverts = NULL;
+	size_t reverts_len = 0;
+
+	if (options->migration_name[0] == 0)
+		{
+			err = 1;
+			fprintf (stderr, "rollback.c: rollback(): you need to provide the migration to rollback, or the number of migrations.\n");
+			goto teardown;
+		}
+
+	err = open_db (options->database, options->init);
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: rollback(): can't open database.\n");
+			goto teardown;
+		}
+
+	err = find_last_migration_applied ();
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: rollback(): can't read migrations table.\n");
+			goto teardown;
+		}
+
+	if (is_number (options->migration_name))
+		{
+			err = find_last_migrations (&reverts, &reverts_len, strtol (options->migration_name, NULL, 10));
+			if (err)
+				{
+					fprintf (stderr, "rollback.c: rollback(): can't find migrations to rollback.\n");
+					goto teardown;
+				}
+		}
+	else
+		{
+			bool applied = false;
+			long position = 0;
+			err = is_applied (&applied, &position, options->migration_name);
+			if (err)
+				{
+					fprintf (stderr, "rollback.c: rollback(): can't read migrations table.\n");
+					goto teardown;
+				}
+
+			if (!applied)
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: rollback(): migration was not applied: %s\n", options->migration_name);
+					goto teardown;
+				}
+
+			// Reverting it alone would leave the migrations applied after it on top of a schema they don't expect.
+			if (strncmp (options->migration_name, last_migration_applied, MAX_PATH_LEN) != 0)
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: rollback(): %s is not the last migration applied (%s is), use `rollback %ld` to rollback it along with the ones applied since.\n", options->migration_name, last_migration_applied, position);
+					goto teardown;
+				}
+
+			reverts = calloc (1, sizeof (revert_t));
+			if (!reverts)
+				{
+					err = 1;
+					fprintf (stderr, "rollback.c: rollback(): out of memory.\n");
+					goto teardown;
+				}
+
+			reverts_len = 1;
+			snprintf (reverts[0].name, MAX_PATH_LEN, "%s", options->migration_name);
+		}
+
+	for (size_t i = 0; i < reverts_len; i++)
+		{
+			err = plan_revert (&reverts[i], options->migrations);
+			if (err)
+				{
+					fprintf (stderr, "rollback.c: rollback(): can't rollback migration %s.\n", reverts[i].name);
+					goto teardown;
+				}
+
+			if (reverts[i].method == REVERT_DOWN_EXECUTABLE)
+				has_executable = true;
+		}
+
+	if (has_executable && reverts_len > 1)
+		printf ("Down executables can't be part of our transaction, each migration will be rolled back separately.\n");
+
+	for (size_t i = 0; i < reverts_len; i++)
+		{
+			bool own_transaction = reverts[i].method != REVERT_DOWN_EXECUTABLE && (i == 0 || has_executable);
+			if (own_transaction)
+				{
+					err = db_exec ("BEGIN IMMEDIATE");
+					if (err)
+						{
+							fprintf (stderr, "rollback.c: rollback(): can't start transaction.\n");
+							goto teardown;
+						}
+
+					in_transaction = true;
+				}
+
+			err = revert_migration (&reverts[i], options);
+			if (err)
+				{
+					fprintf (stderr, "rollback.c: rollback(): can't rollback migration %s.\n", reverts[i].name);
+					goto teardown;
+				}
+
+			if (in_transaction && (has_executable || i == reverts_len - 1))
+				{
+					err = db_exec ("COMMIT");
+					if (err)
+						{
+							fprintf (stderr, "rollback.c: rollback(): can't commit rollback.\n");
+							goto teardown;
+						}
+
+					in_transaction = false;
+				}
+		}
+
+	err = find_last_migration_applied ();
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: rollback(): can't read migrations table.\n");
+			goto teardown;
+		}
+
+	err = dump_structure (options->structure, last_migration_applied);
+	if (err)
+		{
+			fprintf (stderr, "rollback.c: rollback(): can't dump structure file.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (in_transaction) db_exec ("ROLLBACK");
+	if (reverts)
+		{
+			for (size_t i = 0; i < reverts_len; i++)
+				free_changeset (&reverts[i].changeset);
+			free (reverts);
+		}
+
+	return err;
+}
@@ -0,0 +1,6 @@
+#ifndef _ROLLBACK_H_
+#define _ROLLBACK_H_
+
+int rollback (options_t *options);
+
+#endif
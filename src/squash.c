@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "database.h"
+#include "migrate.h"
+#include "squash.h"
+
+static int
+remove_file (const char *path)
+{
+	if (!file_exists (path))
+		return 0;
+
+	if (unlink (path) != 0)
+		return 1;
+
+	printf ("Removed %s\n", path);
+	return 0;
+}
+
+/*
+ * Writes the baseline: the schema of the squashed database, followed by the
+ * names of the migrations it replaces.
+ */
+static int
+write_baseline (sqlite3 *conn, FILE *file, const char until[MAX_NAME_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT name FROM migrations ORDER BY name";
+
+	fprintf (file, "-- exodus baseline, squashing migrations until %s\n\n", until);
+
+	err = dump_schema (conn, file, false);
+	if (err)
+		{
+			fprintf (stderr, "squash.c: write_baseline(): can't dump schema.\n");
+			goto teardown;
+		}
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: write_baseline(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					char *escaped = sqlite3_mprintf ("%Q", (const char *) sqlite3_column_text (stmt, 0));
+					if (!escaped)
+						{
+							err = 1;
+							fprintf (stderr, "squash.c: write_baseline(): out of memory while escaping migration name.\n");
+							goto teardown;
+						}
+
+					fprintf (file, "INSERT INTO migrations(name) VALUES (%s);\n", escaped);
+					sqlite3_free (escaped);
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "squash.c: write_baseline(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Removes the migration files replaced by the baseline, and their down
+ * migrations.
+ */
+static int
+remove_squashed_migrations (sqlite3 *conn, const char migrations_dir[MAX_PATH_LEN])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT name FROM migrations ORDER BY name";
+
+	int rc = sqlite3_prepare_v2 (conn, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: remove_squashed_migrations(): error while preparing query: %s\n", sqlite3_errmsg (conn));
+			goto teardown;
+		}
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				{
+					const char *name = (const char *) sqlite3_column_text (stmt, 0);
+					char path[MAX_PATH_LEN] = {0};
+
+					int written = snprintf (path, MAX_PATH_LEN, "%s/%s", migrations_dir, name);
+					if (written >= MAX_PATH_LEN)
+						{
+							err = 1;
+							fprintf (stderr, "squash.c: remove_squashed_migrations(): truncated migration path: %s\n", path);
+							goto teardown;
+						}
+
+					err = remove_file (path);
+					if (err)
+						{
+							fprintf (stderr, "squash.c: remove_squashed_migrations(): can't remove migration: %s\n", path);
+							goto teardown;
+						}
+
+					if (is_sql_migration (path))
+						path[strlen (path) - 4] = 0;
+					else if (is_plugin_migration (path))
+						path[strlen (path) - 3] = 0;
+
+					const char *down_suffixes[] = { ".down.sql", ".down.so", ".down" };
+					for (size_t i = 0; i < sizeof (down_suffixes) / sizeof (down_suffixes[0]); i++)
+						{
+							char down_path[MAX_PATH_LEN + 10] = {0};
+							snprintf (down_path, sizeof (down_path), "%s%s", path, down_suffixes[i]);
+
+							err = remove_file (down_path);
+							if (err)
+								{
+									fprintf (stderr, "squash.c: remove_squashed_migrations(): can't remove down migration: %s\n", down_path);
+									goto teardown;
+								}
+						}
+				}
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "squash.c: remove_squashed_migrations(): error while performing query: %s\n", sqlite3_errmsg (conn));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+/*
+ * Collapses all migrations until `--until` into a baseline file.
+ *
+ * The baseline is built by migrating a scratch database rather than reading
+ * the real one, so it only depends on the migration files.
+ */
+int
+squash (options_t *options)
+{
+	int err = 0;
+	options_t scratch_options = *options;
+	sqlite3 *scratch = NULL;
+	FILE *file = NULL;
+	char until_path[MAX_PATH_LEN] = {0};
+	char scratch_path[MAX_PATH_LEN - 16] = {0};
+	char baseline_path[MAX_PATH_LEN] = {0};
+	char building_path[MAX_PATH_LEN] = {0};
+	char leftover_path[MAX_PATH_LEN] = {0};
+
+	if (options->until[0] == 0)
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): you need to provide the last migration to squash with --until.\n");
+			goto teardown;
+		}
+
+	int written = snprintf (until_path, MAX_PATH_LEN, "%s/%s", options->migrations, options->until);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): truncated migration path: %s\n", until_path);
+			goto teardown;
+		}
+
+	if (!file_exists (until_path))
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): migration does not exist: %s\n", until_path);
+			goto teardown;
+		}
+
+	// Kept shorter than other paths, to leave room for the suffixes of files created next to it.
+	written = snprintf (scratch_path, sizeof (scratch_path), "%s/.squash-%d.db", options->migrations, (int) getpid ());
+	if (written >= (int) sizeof (scratch_path))
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): truncated scratch database path: %s\n", scratch_path);
+			goto teardown;
+		}
+
+	written = snprintf (baseline_path, MAX_PATH_LEN, "%s/%s", options->migrations, BASELINE_FILE);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): truncated baseline path: %s\n", baseline_path);
+			goto teardown;
+		}
+
+	snprintf (building_path, MAX_PATH_LEN, "%s.sql", scratch_path);
+	snprintf (scratch_options.database, MAX_PATH_LEN, "%s", scratch_path);
+	snprintf (scratch_options.structure, MAX_PATH_LEN, "%s.structure", scratch_path);
+	// The scratch database is thrown away, its backups are the plain ones cleaned up below.
+	scratch_options.backup_dir[0] = 0;
+	scratch_options.compress[0] = 0;
+
+	err = migrate (&scratch_options);
+	close_db ();
+	if (err)
+		{
+			fprintf (stderr, "squash.c: squash(): can't migrate scratch database.\n");
+			goto teardown;
+		}
+
+	err = sqlite3_open (scratch_path, &scratch);
+	if (err)
+		{
+			fprintf (stderr, "squash.c: squash(): can't open scratch database.\n");
+			goto teardown;
+		}
+
+	file = fopen (building_path, "w");
+	if (!file)
+		{
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): can't open baseline file: %s\n", building_path);
+			goto teardown;
+		}
+
+	err = write_baseline (scratch, file, options->until);
+	if (err)
+		{
+			fprintf (stderr, "squash.c: squash(): can't write baseline.\n");
+			goto teardown;
+		}
+
+	if (fclose (file) != 0)
+		{
+			file = NULL;
+			err = 1;
+			fprintf (stderr, "squash.c: squash(): can't write baseline file: %s\n", building_path);
+			goto teardown;
+		}
+
+	file = NULL;
+
+	err = rename (building_path, baseline_path);
+	if (err)
+		{
+			fprintf (stderr, "squash.c: squash(): can't move baseline to %s\n", baseline_path);
+			goto teardown;
+		}
+
+	printf ("Baseline written to %s\n", baseline_path);
+
+	err = remove_squashed_migrations (scratch, options->migrations);
+	if (err)
+		{
+			fprintf (stderr, "squash.c: squash(): can't remove squashed migrations.\n");
+			goto teardown;
+		}
+
+	teardown:
+	if (file) fclose (file);
+	if (scratch) sqlite3_close (scratch);
+
+	if (scratch_path[0] != 0)
+		{
+			const char *suffixes[] = { "", ".sql", ".prev", ".failed", ".structure" };
+			for (size_t i = 0; i < sizeof (suffixes) / sizeof (suffixes[0]); i++)
+				{
+					snprintf (leftover_path, MAX_PATH_LEN, "%s%s", scratch_path, suffixes[i]);
+					unlink (leftover_path);
+				}
+		}
+
+	return err;
+}
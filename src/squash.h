@@ -0,0 +1,6 @@
+#ifndef _SQUASH_H_
+#define _SQUASH_H_
+
+int squash (options_t *options);
+
+#endif
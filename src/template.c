@@ -0,0 +1,293 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "main.h"
+#include "database.h"
+#include "hash.h"
+#include "migrate.h"
+#include "template.h"
+
+/*
+ * Creates the directory and its missing parents, like `mkdir -p`.
+ */
+static int
+ensure_directory_exists (const char directory[MAX_PATH_LEN])
+{
+	int err = 0;
+	char path[MAX_PATH_LEN] = {0};
+	snprintf (path, MAX_PATH_LEN, "%s", directory);
+
+	for (char *slash = strchr (path + 1, '/'); ; slash = strchr (slash + 1, '/'))
+		{
+			if (slash)
+				*slash = 0;
+
+			if (mkdir (path, 0755) != 0 && errno != EEXIST)
+				{
+					err = 1;
+					fprintf (stderr, "template.c: ensure_directory_exists(): can't create directory: %s\n", path);
+					goto teardown;
+				}
+
+			if (!slash)
+				break;
+
+			*slash = '/';
+		}
+
+	teardown:
+	return err;
+}
+
+static int
+filter_hidden_files (const struct dirent *entry)
+{
+	return strncmp (entry->d_name, ".", 1) != 0;
+}
+
+/*
+ * Computes the template key from the name and content of every migration
+ * file, and from the init file, which may change how migrations behave.
+ */
+static int
+compute_template_key (char key[HASH_HEX_LEN], options_t *options)
+{
+	int err = 0;
+	struct dirent **entries = NULL;
+	uint64_t hash = HASH_SEED;
+
+	int len = scandir (options->migrations, &entries, &filter_hidden_files, alphasort);
+	if (len == -1)
+		{
+			err = 1;
+			fprintf (stderr, "template.c: compute_template_key(): can't scan migrations directory.\n");
+			goto teardown;
+		}
+
+	for (int i = 0; i < len; i++)
+		{
+			char path[MAX_PATH_LEN] = {0};
+			int written = snprintf (path, MAX_PATH_LEN, "%s/%s", options->migrations, entries[i]->d_name);
+			if (written >= MAX_PATH_LEN)
+				{
+					err = 1;
+					fprintf (stderr, "template.c: compute_template_key(): truncated migration path: %s\n", path);
+					goto teardown;
+				}
+
+			hash = hash_string (hash, entries[i]->d_name);
+			err = hash_file (&hash, path);
+			if (err)
+				{
+					fprintf (stderr, "template.c: compute_template_key(): can't hash migration: %s\n", path);
+					goto teardown;
+				}
+		}
+
+	if (options->init[0] != 0)
+		{
+			err = hash_file (&hash, options->init);
+			if (err)
+				{
+					fprintf (stderr, "template.c: compute_template_key(): can't hash init file: %s\n", options->init);
+					goto teardown;
+				}
+		}
+
+	hash_to_hex (key, hash);
+
+	teardown:
+	if (entries)
+		{
+			for (int i = 0; i < len; i++)
+				free (entries[i]);
+			free (entries);
+		}
+
+	return err;
+}
+
+/*
+ * Builds the template by migrating an empty database, which is only moved to
+ * its final place once fully migrated, so that concurrent runs never see a
+ * partial template.
+ */
+static int
+build_template (options_t *options, const char template_path[MAX_PATH_LEN])
+{
+	int err = 0;
+	options_t template_options = *options;
+	char building_path[MAX_PATH_LEN] = {0};
+	char backup_path[MAX_PATH_LEN] = {0};
+	char fail_path[MAX_PATH_LEN] = {0};
+
+	int written = snprintf (building_path, MAX_PATH_LEN, "%s.%d", template_path, (int) getpid ());
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "template.c: build_template(): truncated template path: %s\n", building_path);
+			goto teardown;
+		}
+
+	written = snprintf (backup_path, MAX_PATH_LEN, "%s.prev", building_path);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "template.c: build_template(): truncated backup path: %s\n", backup_path);
+			goto teardown;
+		}
+
+	written = snprintf (fail_path, MAX_PATH_LEN, "%s.failed", building_path);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "template.c: build_template(): truncated fail path: %s\n", fail_path);
+			goto teardown;
+		}
+
+	snprintf (template_options.database, MAX_PATH_LEN, "%s", building_path);
+	// Backups of the template are thrown away, they're the plain ones removed below.
+	template_options.backup_dir[0] = 0;
+	template_options.compress[0] = 0;
+	written = snprintf (template_options.structure, MAX_PATH_LEN, "%s.sql", template_path);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "template.c: build_template(): truncated structure path: %s\n", template_options.structure);
+			goto teardown;
+		}
+
+	err = migrate (&template_options);
+	close_db ();
+	if (err)
+		{
+			fprintf (stderr, "template.c: build_template(): can't migrate template database.\n");
+			goto teardown;
+		}
+
+	err = rename (building_path, template_path);
+	if (err)
+		{
+			fprintf (stderr, "template.c: build_template(): can't move template in cache: %s\n", template_path);
+			goto teardown;
+		}
+
+	teardown:
+	if (backup_path[0] != 0) unlink (backup_path);
+	if (fail_path[0] != 0) unlink (fail_path);
+	if (err && building_path[0] != 0) unlink (building_path);
+	return err;
+}
+
+/*
+ * Clones the template into the database, sharing its blocks when the
+ * filesystem supports reflinks, or copying it with the backup API otherwise.
+ */
+static int
+clone_template (const char template_path[MAX_PATH_LEN], const char database[MAX_PATH_LEN])
+{
+	int err = 0;
+	bool cloned = false;
+
+#ifdef FICLONE
+	int src = open (template_path, O_RDONLY);
+	if (src >= 0)
+		{
+			int dest = open (database, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if (dest >= 0)
+				{
+					cloned = ioctl (dest, FICLONE, src) == 0;
+					close (dest);
+					if (!cloned)
+						unlink (database);
+				}
+
+			close (src);
+		}
+#endif
+
+	if (!cloned)
+		{
+			err = backup_db (template_path, database);
+			if (err)
+				{
+					fprintf (stderr, "template.c: clone_template(): can't copy template to %s\n", database);
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+int
+template (options_t *options)
+{
+	int err = 0;
+	char key[HASH_HEX_LEN] = {0};
+	char template_path[MAX_PATH_LEN] = {0};
+
+	if (file_exists (options->database))
+		{
+			err = 1;
+			fprintf (stderr, "template.c: template(): database already exists: %s\n", options->database);
+			goto teardown;
+		}
+
+	err = compute_template_key (key, options);
+	if (err)
+		{
+			fprintf (stderr, "template.c: template(): can't compute template key.\n");
+			goto teardown;
+		}
+
+	err = ensure_directory_exists (options->cache);
+	if (err)
+		{
+			fprintf (stderr, "template.c: template(): can't create cache directory.\n");
+			goto teardown;
+		}
+
+	int written = snprintf (template_path, MAX_PATH_LEN, "%s/template-%s.db", options->cache, key);
+	if (written >= MAX_PATH_LEN)
+		{
+			err = 1;
+			fprintf (stderr, "template.c: template(): truncated template path: %s\n", template_path);
+			goto teardown;
+		}
+
+	if (!file_exists (template_path))
+		{
+			printf ("Building template %s…\n", template_path);
+
+			err = build_template (options, template_path);
+			if (err)
+				{
+					fprintf (stderr, "template.c: template(): can't build template.\n");
+					goto teardown;
+				}
+		}
+
+	err = clone_template (template_path, options->database);
+	if (err)
+		{
+			fprintf (stderr, "template.c: template(): can't clone template.\n");
+			goto teardown;
+		}
+
+	printf ("Database %s created from template %s\n", options->database, template_path);
+
+	teardown:
+	return err;
+}
@@ -0,0 +1,6 @@
+#ifndef _TEMPLATE_H_
+#define _TEMPLATE_H_
+
+int template (options_t *options);
+
+#endif
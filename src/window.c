@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+#include "report.h"
+#include "window.h"
+
+static int
+durations_path (char path[MAX_PATH_LEN], const char database[MAX_PATH_LEN])
+{
+	int written = snprintf (path, MAX_PATH_LEN, "%s.durations", database);
+	if (written >= MAX_PATH_LEN)
+		{
+			fprintf (stderr, "window.c: durations_path(): truncated durations file path: %s\n", path);
+			return 1;
+		}
+
+	return 0;
+}
+
+/*
+ * Loads the durations measured by the last dry run of the database, if
+ * any. Lines are `<seconds> <migration name>`.
+ */
+static int
+load_dry_run_durations (duration_history_t history[static 1], const char database[MAX_PATH_LEN])
+{
+	int err = 0;
+	FILE *file = NULL;
+	char path[MAX_PATH_LEN] = {0};
+	char line[MAX_PATH_LEN + 32] = {0};
+
+	err = durations_path (path, database);
+	if (err)
+		goto teardown;
+
+	file = fopen (path, "r");
+	if (!file)
+		{
+			if (errno != ENOENT)
+				{
+					err = 1;
+					fprintf (stderr, "window.c: load_dry_run_durations(): can't open durations file: %s\n", path);
+				}
+
+			goto teardown;
+		}
+
+	while (fgets (line, sizeof (line), file))
+		{
+			double seconds = 0;
+			int consumed = 0;
+
+			line[strcspn (line, "\n")] = 0;
+			if (sscanf (line, "%lf %n", &seconds, &consumed) < 1 || line[consumed] == 0)
+				continue;
+
+			duration_t *dry_run = realloc (history->dry_run, sizeof (duration_t) * (history->dry_run_len + 1));
+			if (!dry_run)
+				{
+					err = 1;
+					fprintf (stderr, "window.c: load_dry_run_durations(): out of memory.\n");
+					goto teardown;
+				}
+
+			history->dry_run = dry_run;
+			duration_t *duration = &history->dry_run[history->dry_run_len++];
+			duration->seconds = seconds;
+			snprintf (duration->name, MAX_PATH_LEN, "%s", line + consumed);
+		}
+
+	teardown:
+	if (file) fclose (file);
+	return err;
+}
+
+/*
+ * Gathers what we know of the duration of migrations: the last dry run of
+ * the database, and the durations recorded in the migrations table of the
+ * history database, which already ran them.
+ *
+ * Caller must call `close_duration_history()`.
+ */
+int
+open_duration_history (duration_history_t history[static 1], const char database[MAX_PATH_LEN], const char history_path[MAX_PATH_LEN])
+{
+	int err = 0;
+
+	err = load_dry_run_durations (history, database);
+	if (err)
+		{
+			fprintf (stderr, "window.c: open_duration_history(): can't load dry run durations.\n");
+			goto teardown;
+		}
+
+	if (history_path[0] != 0)
+		{
+			err = sqlite3_open_v2 (history_path, &history->history, SQLITE_OPEN_READONLY, NULL);
+			if (err)
+				{
+					fprintf (stderr, "window.c: open_duration_history(): can't open history database: %s\n", history_path);
+					goto teardown;
+				}
+		}
+
+	teardown:
+	return err;
+}
+
+/*
+ * Finds the expected duration of a migration, preferring the dry run of
+ * the same database to the history database. `seconds` is negative when
+ * neither knows the migration.
+ */
+int
+estimate_duration (double seconds[static 1], duration_history_t history[static 1], const char migration_name[static 1])
+{
+	int err = 0;
+	sqlite3_stmt *stmt = NULL;
+	char query[BUFSIZ] = "SELECT duration FROM migrations WHERE name = ? AND duration IS NOT NULL";
+
+	*seconds = -1;
+
+	for (size_t i = 0; i < history->dry_run_len; i++)
+		{
+			if (strncmp (history->dry_run[i].name, migration_name, MAX_PATH_LEN) == 0)
+				{
+					*seconds = history->dry_run[i].seconds;
+					goto teardown;
+				}
+		}
+
+	if (!history->history)
+		goto teardown;
+
+	int rc = sqlite3_prepare_v2 (history->history, query, -1, &stmt, NULL);
+	if (rc != SQLITE_OK)
+		{
+			err = 1;
+			fprintf (stderr, "window.c: estimate_duration(): error while preparing query: %s\n", sqlite3_errmsg (history->history));
+			goto teardown;
+		}
+
+	sqlite3_bind_text (stmt, 1, migration_name, -1, NULL);
+
+	while (1)
+		{
+			int s = sqlite3_step (stmt);
+			if (s == SQLITE_ROW)
+				*seconds = sqlite3_column_double (stmt, 0);
+			else if (s == SQLITE_DONE)
+				break;
+			else
+				{
+					err = 1;
+					fprintf (stderr, "window.c: estimate_duration(): error while performing query: %s\n", sqlite3_errmsg (history->history));
+					goto teardown;
+				}
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	return err;
+}
+
+void
+close_duration_history (duration_history_t history[static 1])
+{
+	if (history->dry_run) free (history->dry_run);
+	if (history->history) sqlite3_close (history->history);
+	memset (history, 0, sizeof (duration_history_t));
+}
+
+/*
+ * Saves the durations measured by a dry run next to the database, for
+ * `--max-duration` to plan the real run.
+ */
+int
+save_dry_run_durations (const run_report_t report[static 1], const char database[MAX_PATH_LEN])
+{
+	int err = 0;
+	FILE *file = NULL;
+	char path[MAX_PATH_LEN] = {0};
+
+	err = durations_path (path, database);
+	if (err)
+		goto teardown;
+
+	file = fopen (path, "w");
+	if (!file)
+		{
+			err = 1;
+			fprintf (stderr, "window.c: save_dry_run_durations(): can't open durations file: %s\n", path);
+			goto teardown;
+		}
+
+	for (size_t i = 0; i < report->migrations_len; i++)
+		{
+			if (!report->migrations[i].failed)
+				fprintf (file, "%.3f %s\n", report->migrations[i].seconds, report->migrations[i].name);
+		}
+
+	teardown:
+	if (file && fclose (file) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "window.c: save_dry_run_durations(): can't write durations file: %s\n", path);
+		}
+
+	return err;
+}
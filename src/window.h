@@ -0,0 +1,24 @@
+#ifndef _WINDOW_H_
+#define _WINDOW_H_
+
+#include <sqlite3.h>
+#include "main.h"
+#include "report.h"
+
+typedef struct {
+	char name[MAX_PATH_LEN];
+	double seconds;
+} duration_t;
+
+typedef struct {
+	duration_t *dry_run;
+	size_t dry_run_len;
+	sqlite3 *history;
+} duration_history_t;
+
+int open_duration_history (duration_history_t history[static 1], const char database[MAX_PATH_LEN], const char history_path[MAX_PATH_LEN]);
+int estimate_duration (double seconds[static 1], duration_history_t history[static 1], const char migration_name[static 1]);
+void close_duration_history (duration_history_t history[static 1]);
+int save_dry_run_durations (const run_report_t report[static 1], const char database[MAX_PATH_LEN]);
+
+#endif
@@ -0,0 +1,35 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+/*
+ * Exodus is verbose about what it does, which we don't want in the middle
+ * of results, from the bench or the tests.
+ */
+int
+silence_stdout ()
+{
+	fflush (stdout);
+	int saved = dup (STDOUT_FILENO);
+	int null = open ("/dev/null", O_WRONLY);
+	if (null >= 0)
+		{
+			dup2 (null, STDOUT_FILENO);
+			close (null);
+		}
+
+	return saved;
+}
+
+void
+restore_stdout (int saved)
+{
+	fflush (stdout);
+	if (saved < 0)
+		return;
+
+	dup2 (saved, STDOUT_FILENO);
+	close (saved);
+}
@@ -0,0 +1,7 @@
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+int silence_stdout ();
+void restore_stdout (int saved);
+
+#endif
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "database.h"
+#include "harness.h"
+#include "migrate.h"
+
+/*
+ * Regression tests of `migrate --verify`: each case migrates a small
+ * database, and expects the run to fail and the database to be restored
+ * when the migration breaks a foreign key, or to succeed otherwise. The
+ * check query must return 1 afterwards.
+ *
+ * Cases run in `<directory>/<case name>`, removed when they pass.
+ */
+
+#define SCHEMA "CREATE TABLE parent(id INTEGER PRIMARY KEY);\n" \
+	"CREATE TABLE child(id INTEGER PRIMARY KEY, parent_id INTEGER REFERENCES parent(id));\n" \
+	"CREATE TABLE kv(k TEXT PRIMARY KEY, v INTEGER REFERENCES parent(id)) WITHOUT ROWID;\n" \
+	"INSERT INTO parent VALUES (1), (2);\n" \
+	"INSERT INTO child VALUES (1, 1);\n"
+
+typedef struct {
+	const char *name;
+	const char *init;
+	const char *migration;
+	const char *check;
+	bool valid;
+} verify_case_t;
+
+static const verify_case_t cases[] = {
+	{ "delete-without-where-orphans-children", NULL, "DELETE FROM parent;\n", "SELECT count(*) = 2 FROM parent", false },
+	{ "without-rowid-insert-misses-parent", NULL, "INSERT INTO kv VALUES ('a', 42);\n", "SELECT count(*) = 0 FROM kv", false },
+	{ "drop-parent-orphans-children", NULL, "PRAGMA foreign_keys = OFF;\nDROP TABLE parent;\n", "SELECT count(*) = 2 FROM parent", false },
+	{ "preflight-ignores-init-foreign-keys", "PRAGMA foreign_keys = ON;\n", "INSERT INTO child(parent_id) VALUES (1);\n", "SELECT count(*) = 2 FROM child", true },
+};
+
+static int
+write_file (const char path[MAX_PATH_LEN], const char *content)
+{
+	FILE *file = fopen (path, "w");
+	if (!file)
+		{
+			fprintf (stderr, "verify.c: write_file(): can't create file: %s\n", path);
+			return 1;
+		}
+
+	fputs (content, file);
+	return fclose (file) != 0;
+}
+
+static void
+remove_case (const char *directory)
+{
+	char path[MAX_PATH_LEN + 32] = {0};
+	const char *files[] = { "app.db", "app.db-journal", "app.db.prev", "app.db.failed", "init.sql", "structure.sql", "migrations/001-change.sql", "migrations" };
+
+	for (size_t i = 0; i < sizeof (files) / sizeof (files[0]); i++)
+		{
+			snprintf (path, sizeof (path), "%s/%s", directory, files[i]);
+			remove (path);
+		}
+
+	rmdir (directory);
+}
+
+static int
+run_case (const char *root, const verify_case_t test[static 1])
+{
+	int err = 0;
+	sqlite3 *conn = NULL;
+	sqlite3_stmt *stmt = NULL;
+	options_t options = {0};
+	char directory[MAX_PATH_LEN - 64] = {0};
+	char migrations[MAX_PATH_LEN] = {0};
+	char migration[MAX_PATH_LEN] = {0};
+
+	snprintf (directory, sizeof (directory), "%s/%s", root, test->name);
+	snprintf (migrations, MAX_PATH_LEN, "%s/migrations", directory);
+	snprintf (migration, MAX_PATH_LEN, "%s/001-change.sql", migrations);
+	snprintf (options.database, MAX_PATH_LEN, "%s/app.db", directory);
+	snprintf (options.structure, MAX_PATH_LEN, "%s/structure.sql", directory);
+	snprintf (options.migrations, MAX_PATH_LEN, "%s", migrations);
+	options.verify = true;
+	if (test->init)
+		snprintf (options.init, MAX_PATH_LEN, "%s/init.sql", directory);
+
+	remove_case (directory);
+	if (mkdir (directory, 0755) != 0 || mkdir (migrations, 0755) != 0)
+		{
+			err = 1;
+			fprintf (stderr, "verify.c: run_case(): can't create directory: %s\n", migrations);
+			goto teardown;
+		}
+
+	err = sqlite3_open (options.database, &conn);
+	err = err || db_exec_on (conn, SCHEMA);
+	sqlite3_close (conn);
+	conn = NULL;
+	err = err || write_file (migration, test->migration);
+	err = err || (test->init && write_file (options.init, test->init));
+	if (err)
+		{
+			fprintf (stderr, "verify.c: run_case(): can't create database.\n");
+			goto teardown;
+		}
+
+	int saved = silence_stdout ();
+	int migrate_err = migrate (&options);
+	close_db ();
+	restore_stdout (saved);
+
+	if (test->valid && migrate_err)
+		{
+			err = 1;
+			fprintf (stderr, "verify.c: run_case(): migrate --verify failed on a valid migration.\n");
+			goto teardown;
+		}
+
+	if (!test->valid && !migrate_err)
+		{
+			err = 1;
+			fprintf (stderr, "verify.c: run_case(): migrate --verify succeeded on a broken foreign key.\n");
+			goto teardown;
+		}
+
+	err = sqlite3_open (options.database, &conn);
+	if (err || sqlite3_prepare_v2 (conn, test->check, -1, &stmt, NULL) != SQLITE_OK || sqlite3_step (stmt) != SQLITE_ROW || sqlite3_column_int (stmt, 0) != 1)
+		{
+			err = 1;
+			fprintf (stderr, "verify.c: run_case(): %s\n", test->valid ? "migration wasn't applied." : "database wasn't restored.");
+			goto teardown;
+		}
+
+	teardown:
+	if (stmt) sqlite3_finalize (stmt);
+	if (conn) sqlite3_close (conn);
+	if (!err) remove_case (directory);
+	return err;
+}
+
+int
+main (int argc, char **argv)
+{
+	int failures = 0;
+	char root[MAX_PATH_LEN - 128] = "build/tests";
+
+	if (argc > 1)
+		snprintf (root, sizeof (root), "%s", argv[1]);
+
+	if (mkdir (root, 0755) != 0 && errno != EEXIST)
+		{
+			fprintf (stderr, "verify.c: main(): can't create directory: %s\n", root);
+			return 1;
+		}
+
+	for (size_t i = 0; i < sizeof (cases) / sizeof (cases[0]); i++)
+		{
+			int err = run_case (root, &cases[i]);
+			fprintf (stderr, "%s: %s\n", cases[i].name, err ? "FAILED" : "ok");
+			failures += err != 0;
+		}
+
+	return failures > 0;
+}